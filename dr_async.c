@@ -0,0 +1,200 @@
+//
+//  dr_async.c
+//
+//      Asynchronous read pipeline for data extents.
+//
+//      Reads are queued up to a fixed queue depth and kept in flight
+//      with POSIX AIO (on glibc a thread pool services the requests).
+//      Completed reads are passed to the output writer strictly in the
+//      order they were queued, holes included, so the output is the
+//      same as with synchronous copying.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <minix/config.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include <minix/const.h>
+#include <minix/type.h>
+#include "mfs/const.h"
+
+#include "drecover.h"
+
+/* async_create(depth, chunk)
+ *
+ *      allocate a pipeline with "depth" reads of at most "chunk"
+ *      bytes in flight. NULL is returned if asynchronous I/O is
+ *      not available or there is not enough memory.
+ */
+dr_async *async_create(depth, chunk)
+int depth;
+size_t chunk;
+{
+#ifdef HAVE_AIO
+    dr_async *a;
+
+    if((a = (dr_async *)calloc(1, sizeof(dr_async))) == NULL)
+        return(NULL);
+
+    a->depth = depth;
+    a->chunk = chunk;
+    a->ops = (dr_async_op *)calloc(depth, sizeof(dr_async_op));
+    a->data = dev_alloc((size_t)depth * chunk);
+
+    if(a->ops == NULL || a->data == NULL) {
+        async_destroy(a);
+        return(NULL);
+    }
+
+    return(a);
+#else
+    return(NULL);
+#endif
+}
+
+/* async_destroy(a)
+ *
+ */
+void async_destroy(a)
+dr_async *a;
+{
+    if(a == NULL)
+        return;
+
+    free(a->ops);
+    free(a->data);
+    free(a);
+}
+
+/* async_queue(st, addr, len)
+ *
+ *      queue a read of "len" bytes at "addr" on the device, to be
+ *      appended to the output file. a negative "addr" queues a
+ *      hole of "len" bytes. the oldest request is completed first
+ *      if the pipeline is full.
+ */
+int async_queue(st, addr, len)
+dr_state *st;
+off_t addr;
+off_t len;
+{
+#ifdef HAVE_AIO
+    dr_async *a = st->async;
+    dr_async_op *op;
+    int slot;
+
+    while(len > 0) {
+        if(a->count == a->depth && async_complete(st) != OK)
+            return ERROR;
+
+        slot = (a->head + a->count) % a->depth;
+        op = &a->ops[slot];
+        memset(op, 0, sizeof(dr_async_op));
+
+        if(addr < 0) {
+            /* a hole takes a slot to keep its place in the order */
+            op->len = len;
+            op->hole = 1;
+            ++ a->count;
+            return OK;
+        }
+
+        op->len = len > (off_t)a->chunk ? (off_t)a->chunk : len;
+        op->cb.aio_fildes = st->device_d;
+        op->cb.aio_offset = addr;
+        op->cb.aio_buf = &a->data[(size_t)slot * a->chunk];
+        op->cb.aio_nbytes = (size_t)op->len;
+        op->cb.aio_sigevent.sigev_notify = SIGEV_NONE;
+
+        /* under O_DIRECT the end of a file is read to the next aligned block */
+        if(st->direct == DIRECT_IO)
+            op->cb.aio_nbytes = (op->cb.aio_nbytes + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+
+        ++ st->stats.reads;
+        gettimeofday(&op->start, NULL);
+        if(aio_read(&op->cb) == -1) {
+            /* out of resources: finish what is in flight and retry */
+            if(errno == EAGAIN && a->count > 0) {
+                if(async_complete(st) != OK)
+                    return ERROR;
+                continue;
+            }
+            return ERROR;
+        }
+
+        throttle_wait(st, op->len, NULL);
+        ++ a->count;
+        st->stats.bytes_read += op->len;
+        addr += op->len;
+        len -= op->len;
+    }
+
+    return OK;
+#else
+    return ERROR;
+#endif
+}
+
+/* async_complete(st)
+ *
+ *      wait for the oldest request and pass it to the output
+ *      writer.
+ */
+int async_complete(st)
+dr_state *st;
+{
+#ifdef HAVE_AIO
+    dr_async *a = st->async;
+    dr_async_op *op = &a->ops[a->head];
+    const struct aiocb *list[1];
+    int err;
+
+    if(a->count == 0)
+        return OK;
+
+    a->head = (a->head + 1) % a->depth;
+    -- a->count;
+
+    if(op->hole)
+        return out_hole(st, op->len);
+
+    list[0] = &op->cb;
+    while((err = aio_error(&op->cb)) == EINPROGRESS)
+        aio_suspend(list, 1, NULL);
+
+    if(err != 0 || aio_return(&op->cb) < (ssize_t)op->len) {
+        dr_msg(st, DR_LOG_INFO, "Error reading %s\n", st->device_name);
+        return ERROR;
+    }
+    throttle_done(st, &op->start);
+    dev_drop(st, op->cb.aio_offset, op->len);
+
+    return out_write(st, (char *)op->cb.aio_buf, op->len);
+#else
+    return ERROR;
+#endif
+}
+
+/* async_drain(st)
+ *
+ *      complete every queued request. after an error the rest are
+ *      still waited for, so no read is left writing into a buffer.
+ */
+int async_drain(st)
+dr_state *st;
+{
+    int r = OK;
+
+    while(st->async->count > 0) {
+        if(async_complete(st) != OK)
+            r = ERROR;
+    }
+
+    return(r);
+}
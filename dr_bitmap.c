@@ -0,0 +1,250 @@
+//
+//  dr_bitmap.c
+//
+//      Queries on the inode and zone bit maps.
+//
+//      The maps are scanned 64 bits at a time (128 with SSE2) instead
+//      of bit by bit, so "is this whole run of zones free?" costs about
+//      one word operation per 64 zones. Map blocks are little-endian
+//      arrays of bitchunk_t, as on disk, so on the little-endian hosts
+//      MINIX runs on bit n of the map is bit n % 64 of word n / 64
+//      whatever the size of bitchunk_t.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <minix/config.h>
+#include <sys/types.h>
+#include <limits.h>
+#include <string.h>
+#include <dirent.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <minix/const.h>
+#include <minix/type.h>
+#include "mfs/const.h"
+
+#include "drecover.h"
+
+#define WORD_BITS       64
+
+/* bit_test(st, mode, bit)
+ *
+ *      is "bit" set in the inode or zone map? bits past the end of
+ *      the map, or in a map block that can not be read, count as
+ *      set so nothing is recovered from them.
+ */
+int bit_test(st, mode, bit)
+dr_state *st;
+int mode;
+bit_t bit;
+{
+    bitchunk_t *chunk;
+
+    if((chunk = map_chunk(st, mode, bit)) == NULL)
+        return(1);
+
+    return (*chunk >> (bit % BITCHUNK_BITS)) & 1;
+}
+
+/* map_words(st, mode, bit, count, &words, &lo, &hi)
+ *
+ *      load the map block holding "bit" and return its words
+ *      covering [bit, bit + count), clipped to the end of that map
+ *      block. "lo" and "hi" are the bit offsets of the range in the
+ *      first word and one past it in the last word. the number of
+ *      words is returned, 0 if the map block can not be read.
+ */
+int map_words(st, mode, bit, count, words, lo, hi)
+dr_state *st;
+int mode;
+bit_t bit;
+bit_t count;
+uint64_t **words;
+int *lo;
+int *hi;
+{
+    bit_t per_block = (bit_t)st->block_size * CHAR_BIT;
+    bit_t end = bit + count;
+    bitchunk_t *chunk;
+
+    if((chunk = map_chunk(st, mode, bit - bit % per_block)) == NULL)
+        return(0);
+
+    if(end > bit - bit % per_block + per_block)
+        end = bit - bit % per_block + per_block;
+
+    *words = (uint64_t *)chunk + (bit % per_block) / WORD_BITS;
+    *lo = bit % WORD_BITS;
+    *hi = (end - 1) % WORD_BITS + 1;
+    return (int)((end - 1) / WORD_BITS - bit / WORD_BITS + 1);
+}
+
+/* word_mask(lo, hi)
+ *
+ *      mask of bits lo .. hi - 1 of a word
+ */
+uint64_t word_mask(lo, hi)
+int lo;
+int hi;
+{
+    uint64_t m = hi == WORD_BITS ? ~(uint64_t)0 : ((uint64_t)1 << hi) - 1;
+
+    return m & ~(((uint64_t)1 << lo) - 1);
+}
+
+/* range_free(st, mode, bit, count)
+ *
+ *      are all of the "count" bits from "bit" clear? this lets a
+ *      whole extent of zones be checked with one query.
+ */
+int range_free(st, mode, bit, count)
+dr_state *st;
+int mode;
+bit_t bit;
+bit_t count;
+{
+    uint64_t *w;
+    uint64_t acc;
+    int lo, hi;
+    int n, i;
+
+    while(count > 0) {
+        if((n = map_words(st, mode, bit, count, &w, &lo, &hi)) == 0)
+            return(0);
+
+        if(n == 1) {
+            if(w[0] & word_mask(lo, hi))
+                return(0);
+        }
+        else {
+            if((w[0] & word_mask(lo, WORD_BITS)) || (w[n - 1] & word_mask(0, hi)))
+                return(0);
+
+            /* the middle words are whole, OR them together */
+            acc = 0;
+            i = 1;
+#ifdef __SSE2__
+            {
+                __m128i v = _mm_setzero_si128();
+
+                for(; i + 2 <= n - 1; i += 2)
+                    v = _mm_or_si128(v, _mm_loadu_si128((__m128i *)&w[i]));
+                if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff)
+                    return(0);
+            }
+#endif
+            for(; i < n - 1; ++ i)
+                acc |= w[i];
+            if(acc != 0)
+                return(0);
+        }
+
+        i = n * WORD_BITS - lo - (WORD_BITS - hi);
+        bit += i;
+        count -= i;
+    }
+
+    return(1);
+}
+
+/* popcount(w)
+ *
+ */
+int popcount(w)
+uint64_t w;
+{
+#ifdef __GNUC__
+    return __builtin_popcountll(w);
+#else
+    int n;
+
+    for(n = 0; w != 0; ++ n)
+        w &= w - 1;
+    return(n);
+#endif
+}
+
+/* count_used(st, mode, bit, count)
+ *
+ *      number of set bits among the "count" bits from "bit"
+ */
+bit_t count_used(st, mode, bit, count)
+dr_state *st;
+int mode;
+bit_t bit;
+bit_t count;
+{
+    uint64_t *w;
+    bit_t used = 0;
+    int lo, hi;
+    int n, i;
+
+    while(count > 0) {
+        if((n = map_words(st, mode, bit, count, &w, &lo, &hi)) == 0)
+            return(used + count);
+
+        for(i = 0; i < n; ++ i)
+            used += popcount(w[i] & word_mask(i == 0 ? lo : 0, i == n - 1 ? hi : WORD_BITS));
+
+        i = n * WORD_BITS - lo - (WORD_BITS - hi);
+        bit += i;
+        count -= i;
+    }
+
+    return(used);
+}
+
+/* find_bit(st, mode, bit, limit, value)
+ *
+ *      return the first bit from "bit" up to "limit" whose value
+ *      is "value" (0 or 1), or "limit" if there is none.
+ */
+bit_t find_bit(st, mode, bit, limit, value)
+dr_state *st;
+int mode;
+bit_t bit;
+bit_t limit;
+int value;
+{
+    uint64_t *w;
+    uint64_t m;
+    int lo, hi;
+    int n, i;
+
+    while(bit < limit) {
+        if((n = map_words(st, mode, bit, limit - bit, &w, &lo, &hi)) == 0)
+            return(value ? bit : limit);
+
+        for(i = 0; i < n; ++ i) {
+            m = (value ? w[i] : ~w[i]) & word_mask(i == 0 ? lo : 0, i == n - 1 ? hi : WORD_BITS);
+            if(m != 0)
+                return bit - lo + (bit_t)i * WORD_BITS + popcount((m & -m) - 1);
+        }
+
+        bit += n * WORD_BITS - lo - (WORD_BITS - hi);
+    }
+
+    return(limit);
+}
+
+/* extents_free(st, x, n)
+ *
+ *      are the zones of the "n" extents from "x" all free?
+ */
+int extents_free(st, x, n)
+dr_state *st;
+dr_extent *x;
+int n;
+{
+    int i;
+
+    for(i = 0; i < n; ++ i) {
+        if(x[i].start != NO_ZONE &&
+           !range_free(st, MAP_ZONE, (bit_t)(x[i].start - (st->first_data - 1)), (bit_t)x[i].length))
+            return(0);
+    }
+    return(1);
+}
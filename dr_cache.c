@@ -0,0 +1,190 @@
+//
+//  dr_cache.c
+//
+//      Read-through block cache in front of the device.
+//
+//      Blocks are keyed by block number and replaced with the CLOCK
+//      algorithm: a newly loaded block starts with its reference bit
+//      clear, so blocks that are read only once (bit maps, the odd
+//      directory block) are evicted before the inode and indirect
+//      blocks that are hit again.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <minix/config.h>
+#include <sys/types.h>
+#include <string.h>
+#include <dirent.h>
+
+#include <minix/const.h>
+#include <minix/type.h>
+#include "mfs/const.h"
+
+#include "drecover.h"
+
+#define NO_SLOT         (-1)
+#define NO_BLOCK        ((zone_t) -1)
+
+/* cache_create(slots, block_size)
+ *
+ *      allocate a cache of "slots" blocks of "block_size" bytes.
+ *      NULL is returned if there is not enough memory.
+ */
+dr_cache *cache_create(slots, block_size)
+int slots;
+int block_size;
+{
+    dr_cache *c;
+
+    if((c = (dr_cache *)calloc(1, sizeof(dr_cache))) == NULL)
+        return(NULL);
+
+    c->slots = slots;
+    c->block_size = block_size;
+    for(c->buckets = 1; c->buckets < slots; c->buckets <<= 1)
+        ;
+
+    c->block = (zone_t *)malloc(slots * sizeof(zone_t));
+    c->ref = (unsigned char *)calloc(slots, 1);
+    c->next = (int *)malloc(slots * sizeof(int));
+    c->hash = (int *)malloc(c->buckets * sizeof(int));
+    c->data = dev_alloc((size_t)slots * block_size);
+
+    if(c->block == NULL || c->ref == NULL || c->next == NULL ||
+       c->hash == NULL || c->data == NULL) {
+        cache_destroy(c);
+        return(NULL);
+    }
+
+    cache_clear(c);
+    return(c);
+}
+
+/* cache_clear(c)
+ *
+ *      forget every cached block
+ */
+void cache_clear(c)
+dr_cache *c;
+{
+    int i;
+
+    for(i = 0; i < c->buckets; ++ i)
+        c->hash[i] = NO_SLOT;
+
+    /* every slot starts out unused */
+    for(i = 0; i < c->slots; ++ i) {
+        c->block[i] = NO_BLOCK;
+        c->next[i] = NO_SLOT;
+        c->ref[i] = 0;
+    }
+    c->hand = 0;
+}
+
+/* cache_destroy(c)
+ *
+ */
+void cache_destroy(c)
+dr_cache *c;
+{
+    if(c == NULL)
+        return;
+
+    free(c->block);
+    free(c->ref);
+    free(c->next);
+    free(c->hash);
+    free(c->data);
+    free(c);
+}
+
+/* cache_bucket(c, block)
+ *
+ *      hash chain for "block"
+ */
+int *cache_bucket(c, block)
+dr_cache *c;
+zone_t block;
+{
+    return &c->hash[(block * 2654435761U) & (c->buckets - 1)];
+}
+
+/* cache_lookup(c, block)
+ *
+ *      return the cached copy of "block", or NULL on a miss.
+ */
+char *cache_lookup(c, block)
+dr_cache *c;
+zone_t block;
+{
+    int slot;
+
+    for(slot = *cache_bucket(c, block); slot != NO_SLOT; slot = c->next[slot]) {
+        if(c->block[slot] == block) {
+            c->ref[slot] = 1;
+            ++ c->hits;
+            return &c->data[(size_t)slot * c->block_size];
+        }
+    }
+
+    ++ c->misses;
+    return(NULL);
+}
+
+/* cache_insert(c, block)
+ *
+ *      pick a victim slot with the clock hand and hand it out for
+ *      "block". the caller fills the returned buffer.
+ */
+char *cache_insert(c, block)
+dr_cache *c;
+zone_t block;
+{
+    int slot;
+    int *p;
+
+    /* advance the hand past referenced slots, clearing their bits */
+    while(c->ref[c->hand]) {
+        c->ref[c->hand] = 0;
+        c->hand = (c->hand + 1) % c->slots;
+    }
+    slot = c->hand;
+    c->hand = (c->hand + 1) % c->slots;
+
+    /* unlink the victim from its hash chain */
+    if(c->block[slot] != NO_BLOCK) {
+        for(p = cache_bucket(c, c->block[slot]); *p != slot; p = &c->next[*p])
+            ;
+        *p = c->next[slot];
+    }
+
+    c->block[slot] = block;
+    p = cache_bucket(c, block);
+    c->next[slot] = *p;
+    *p = slot;
+
+    return &c->data[(size_t)slot * c->block_size];
+}
+
+/* cache_forget(c, block)
+ *
+ *      drop "block" from the cache, e.g. after its read failed
+ */
+void cache_forget(c, block)
+dr_cache *c;
+zone_t block;
+{
+    int *p;
+    int slot;
+
+    for(p = cache_bucket(c, block); *p != NO_SLOT; p = &c->next[*p]) {
+        slot = *p;
+        if(c->block[slot] == block) {
+            *p = c->next[slot];
+            c->block[slot] = NO_BLOCK;
+            c->ref[slot] = 0;
+            return;
+        }
+    }
+}
@@ -0,0 +1,647 @@
+//
+//  dr_carve.c
+//
+//      Carving deleted files out of free zones by their signatures.
+//
+//      When the directory entry or the i-node of a file has been
+//      reused there is nothing left to follow, but its data may still
+//      sit in free zones. Every free zone, according to the zone map,
+//      is read in large sequential pieces, two at a time so the next
+//      read is in flight while the current one is scanned. Files start
+//      at a zone, so headers are only looked for at zone starts; the
+//      end of a file is its footer, a size given in its header, the
+//      next header, or the end of the run of free zones.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <minix/config.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include <minix/const.h>
+#include <minix/type.h>
+#include "mfs/const.h"
+
+#include "drecover.h"
+
+/* signatures known without -s */
+static dr_sig builtin_sigs[] = {
+    { "jpg",    "\xff\xd8\xff", 3,                  "\xff\xd9", 2,              SIG_FOOTER, 64L << 20,   NULL },
+    { "png",    "\x89PNG\r\n\x1a\n", 8,             "IEND\xae\x42\x60\x82", 8,  SIG_FOOTER, 64L << 20,   NULL },
+    { "pdf",    "%PDF-", 5,                         "%%EOF", 5,                 SIG_FOOTER, 256L << 20,  NULL },
+    { "gz",     "\x1f\x8b\x08", 3,                  "", 0,                      SIG_OPEN,   256L << 20,  NULL },
+    { "sqlite", "SQLite format 3\0", 16,            "", 0,                      SIG_SQLITE, 1024L << 20, NULL },
+    { "elf",    "\x7f" "ELF", 4,                    "", 0,                      SIG_ELF,    256L << 20,  NULL },
+};
+
+#define NR_BUILTIN      (sizeof(builtin_sigs) / sizeof(builtin_sigs[0]))
+
+/* parse_hex(str, out, max)
+ *
+ *      convert the hex digits "str" into at most "max" bytes.
+ *      the number of bytes is returned, -1 on a bad string.
+ */
+int parse_hex(str, out, max)
+char *str;
+unsigned char *out;
+int max;
+{
+    int n = 0;
+    unsigned v;
+
+    while(str[0] != '\0') {
+        if(n == max || str[1] == '\0' || sscanf(str, "%2x", &v) != 1)
+            return(-1);
+        out[n ++] = (unsigned char)v;
+        str += 2;
+    }
+
+    return(n);
+}
+
+/* add_signature(st, spec)
+ *
+ *      add a user signature "ext:header[:footer]", header and
+ *      footer in hex, e.g. "zip:504b0304:504b0506".
+ */
+int add_signature(st, spec)
+dr_state *st;
+char *spec;
+{
+    char buf[MAX_STRING + 1];
+    char *head, *foot;
+    dr_sig *s;
+
+    strncpy(buf, spec, MAX_STRING);
+    buf[MAX_STRING] = '\0';
+
+    if((head = strchr(buf, ':')) == NULL || head == buf || head - buf >= (int)sizeof(s->ext)) {
+        dr_msg(st, DR_LOG_ERROR, "Bad signature %s, use ext:header[:footer]\n", spec);
+        return ERROR;
+    }
+    *head ++ = '\0';
+    if((foot = strchr(head, ':')) != NULL)
+        *foot ++ = '\0';
+
+    if((st->sigs = (dr_sig *)realloc(st->sigs, (st->sig_count + 1) * sizeof(dr_sig))) == NULL) {
+        dr_msg(st, DR_LOG_ERROR, "Out of memory\n");
+        return ERROR;
+    }
+    s = &st->sigs[st->sig_count];
+    memset(s, 0, sizeof(dr_sig));
+
+    strcpy(s->ext, buf);
+    s->head_len = parse_hex(head, s->head, MAX_SIG);
+    s->foot_len = foot == NULL ? 0 : parse_hex(foot, s->foot, MAX_SIG);
+    if(s->head_len <= 0 || s->foot_len < 0) {
+        dr_msg(st, DR_LOG_ERROR, "Bad signature %s, at most %d hex bytes each\n", spec, MAX_SIG);
+        return ERROR;
+    }
+    s->kind = s->foot_len > 0 ? SIG_FOOTER : SIG_OPEN;
+    s->max_size = CARVE_MAX;
+
+    ++ st->sig_count;
+    return OK;
+}
+
+/* carve_setup(st, c)
+ *
+ *      index the signatures by the first byte of their header and
+ *      allocate the read buffers. user signatures come first, so
+ *      they take precedence over built-in ones.
+ */
+int carve_setup(st, c)
+dr_state *st;
+dr_carve *c;
+{
+    dr_sig *s;
+    size_t len;
+    int i;
+
+    memset(c, 0, sizeof(dr_carve));
+    c->fd = -1;
+
+    for(i = NR_BUILTIN + st->sig_count - 1; i >= 0; -- i) {
+        s = i < st->sig_count ? &st->sigs[i] : &builtin_sigs[i - st->sig_count];
+        s->next = c->first[s->head[0]];
+        c->first[s->head[0]] = s;
+    }
+
+    /* a mapped image is scanned in place */
+    if(st->map != NULL)
+        return OK;
+
+    /* a piece is at least one zone */
+    len = st->zone_size > CARVE_BYTES ? (size_t)st->zone_size : CARVE_BYTES;
+    c->buf[0] = dev_alloc(len);
+    c->buf[1] = dev_alloc(len);
+    if(c->buf[0] == NULL || c->buf[1] == NULL) {
+        dr_msg(st, DR_LOG_ERROR, "Out of memory\n");
+        carve_cleanup(st, c);
+        return ERROR;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    if(st->direct == DIRECT_NONE)
+        posix_fadvise(st->device_d, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return OK;
+}
+
+/* carve_cleanup(st, c)
+ *
+ *      wait for reads still in flight and free the buffers
+ */
+void carve_cleanup(st, c)
+dr_state *st;
+dr_carve *c;
+{
+    int i;
+
+    for(i = 0; i < 2; ++ i) {
+        if(c->busy[i])
+            carve_wait(st, c, i, 0, 0);
+        free(c->buf[i]);
+        c->buf[i] = NULL;
+    }
+}
+
+/* carve_next(st, &bit, &zone, &count)
+ *
+ *      find the next piece of free zones from zone map bit "bit",
+ *      at most CARVE_BYTES long. 0 is returned when there are no
+ *      more free zones.
+ */
+int carve_next(st, bit, zone, count)
+dr_state *st;
+bit_t *bit;
+zone_t *zone;
+zone_t *count;
+{
+    bit_t per = CARVE_BYTES / st->zone_size > 0 ? CARVE_BYTES / st->zone_size : 1;
+    bit_t b, e;
+
+    if((b = find_bit(st, MAP_ZONE, *bit, st->zones_in_map, 0)) == st->zones_in_map)
+        return(0);
+
+    e = find_bit(st, MAP_ZONE, b, b + per < st->zones_in_map ? b + per : st->zones_in_map, 1);
+
+    *zone = (zone_t)(b + (st->first_data - 1));
+    *count = (zone_t)(e - b);
+    *bit = e;
+    return(1);
+}
+
+/* carve_start(st, c, i, zone, count)
+ *
+ *      start reading "count" zones from "zone" into buffer "i".
+ *      without asynchronous I/O the kernel is asked to read them
+ *      ahead instead, unless that would get around a throttle; then
+ *      carve_wait() reads them. a throttle is paid for a mapped
+ *      device here, with no read to time.
+ */
+int carve_start(st, c, i, zone, count)
+dr_state *st;
+dr_carve *c;
+int i;
+zone_t zone;
+zone_t count;
+{
+    off_t addr = (off_t)zone * st->zone_size;
+    size_t len = (size_t)count * st->zone_size;
+
+    if(st->map != NULL)
+        throttle_wait(st, (off_t)len, NULL);
+
+    if(st->map != NULL) {
+#ifdef POSIX_MADV_WILLNEED
+        off_t page = sysconf(_SC_PAGESIZE);
+
+        if(addr + (off_t)len <= st->map_size)
+            posix_madvise(st->map + addr / page * page, len + addr % page, POSIX_MADV_WILLNEED);
+#endif
+        return OK;
+    }
+
+    /* under O_DIRECT only what is aligned for it */
+    if(!dev_aligned(st, addr, c->buf[i], len))
+        return OK;
+
+#ifdef HAVE_AIO
+    memset(&c->cb[i], 0, sizeof(c->cb[i]));
+    c->cb[i].aio_fildes = st->device_d;
+    c->cb[i].aio_offset = addr;
+    c->cb[i].aio_buf = c->buf[i];
+    c->cb[i].aio_nbytes = len;
+    c->cb[i].aio_sigevent.sigev_notify = SIGEV_NONE;
+    gettimeofday(&c->start[i], NULL);
+    if(aio_read(&c->cb[i]) == 0) {
+        throttle_wait(st, (off_t)len, NULL);
+        ++ st->stats.reads;
+        st->stats.bytes_read += len;
+        c->busy[i] = 1;
+        return OK;
+    }
+#endif
+
+#ifdef POSIX_FADV_WILLNEED
+    if(st->direct == DIRECT_NONE && st->throttle == NULL)
+        posix_fadvise(st->device_d, addr, (off_t)len, POSIX_FADV_WILLNEED);
+#endif
+    return OK;
+}
+
+/* carve_wait(st, c, i, zone, count)
+ *
+ *      finish the read started into buffer "i" and return its
+ *      data, NULL on error.
+ */
+char *carve_wait(st, c, i, zone, count)
+dr_state *st;
+dr_carve *c;
+int i;
+zone_t zone;
+zone_t count;
+{
+    off_t addr = (off_t)zone * st->zone_size;
+    size_t len = (size_t)count * st->zone_size;
+
+    if(st->map != NULL) {
+        if(addr + (off_t)len > st->map_size) {
+            dr_msg(st, DR_LOG_INFO, "Error reading %s\n", st->device_name);
+            return(NULL);
+        }
+        return(st->map + addr);
+    }
+
+#ifdef HAVE_AIO
+    if(c->busy[i]) {
+        const struct aiocb *list[1];
+        int err;
+
+        list[0] = &c->cb[i];
+        while((err = aio_error(&c->cb[i])) == EINPROGRESS)
+            aio_suspend(list, 1, NULL);
+        c->busy[i] = 0;
+
+        if(err != 0 || aio_return(&c->cb[i]) != (ssize_t)c->cb[i].aio_nbytes) {
+            dr_msg(st, DR_LOG_INFO, "Error reading %s\n", st->device_name);
+            return(NULL);
+        }
+        throttle_done(st, &c->start[i]);
+        dev_drop(st, (off_t)c->cb[i].aio_offset, (off_t)c->cb[i].aio_nbytes);
+        return(c->buf[i]);
+    }
+#endif
+
+    if(dev_read(st, addr, c->buf[i], len) != OK)
+        return(NULL);
+    return(c->buf[i]);
+}
+
+/* carve_header(c, p)
+ *
+ *      the signature whose header starts at "p", or NULL
+ */
+dr_sig *carve_header(c, p)
+dr_carve *c;
+unsigned char *p;
+{
+    dr_sig *s;
+
+    for(s = c->first[p[0]]; s != NULL; s = s->next) {
+        if(memcmp(p, s->head, s->head_len) == 0)
+            return(s);
+    }
+
+    return(NULL);
+}
+
+/* get_num(p, len, big)
+ *
+ *      unsigned number of "len" bytes at "p", big endian if "big"
+ */
+off_t get_num(p, len, big)
+unsigned char *p;
+int len;
+int big;
+{
+    off_t v = 0;
+    int i;
+
+    for(i = 0; i < len; ++ i)
+        v = (v << 8) | p[big ? i : len - 1 - i];
+
+    return(v);
+}
+
+/* header_size(s, p)
+ *
+ *      size of the file starting at "p" as given by its header,
+ *      0 if it is not known.
+ */
+off_t header_size(s, p)
+dr_sig *s;
+unsigned char *p;
+{
+    off_t page;
+    int big = p[5] == 2;
+
+    switch(s->kind) {
+        case SIG_SQLITE:
+            /* page size at 16, 1 meaning 65536, page count at 28 */
+            page = get_num(p + 16, 2, 1);
+            return (page == 1 ? 65536 : page) * get_num(p + 28, 4, 1);
+        case SIG_ELF:
+            /* the section headers come last */
+            if(p[4] == 1)
+                return get_num(p + 0x20, 4, big) + get_num(p + 0x2e, 2, big) * get_num(p + 0x30, 2, big);
+            if(p[4] == 2)
+                return get_num(p + 0x28, 8, big) + get_num(p + 0x3a, 2, big) * get_num(p + 0x3c, 2, big);
+            return(0);
+        default:
+            return(0);
+    }
+}
+
+/* find_footer(p, len, foot, foot_len)
+ *
+ *      offset just past the first "foot" in the "len" bytes at "p",
+ *      -1 if there is none. memchr() finds the candidates.
+ */
+long find_footer(p, len, foot, foot_len)
+unsigned char *p;
+long len;
+unsigned char *foot;
+int foot_len;
+{
+    unsigned char *q = p;
+    unsigned char *end = p + len;
+
+    while(end - q >= foot_len && (q = (unsigned char *)memchr(q, foot[0], end - q - foot_len + 1)) != NULL) {
+        if(memcmp(q, foot, foot_len) == 0)
+            return (long)(q - p) + foot_len;
+        ++ q;
+    }
+
+    return(-1);
+}
+
+/* carve_open(st, c, s, p, zone)
+ *
+ *      start carving a file of signature "s" found at "p", the
+ *      start of "zone".
+ */
+void carve_open(st, c, s, p, zone)
+dr_state *st;
+dr_carve *c;
+dr_sig *s;
+char *p;
+zone_t zone;
+{
+    sprintf(c->name, "%s/carve-%lu.%s", st->out_dir, (unsigned long)zone, s->ext);
+
+    if((c->fd = open(c->name, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1) {
+        dr_msg(st, DR_LOG_ERROR, "Can not open file %s\n", c->name);
+        return;
+    }
+
+    c->sig = s;
+    c->zone = zone;
+    c->size = 0;
+    c->found = 0;
+    c->seam_len = 0;
+    c->out = p;
+
+    if((c->want = header_size(s, (unsigned char *)p)) > s->max_size)
+        c->want = s->max_size;
+}
+
+/* carve_flush(st, c, end)
+ *
+ *      write the data of the current file up to "end"
+ */
+int carve_flush(st, c, end)
+dr_state *st;
+dr_carve *c;
+char *end;
+{
+    size_t len = end - c->out;
+
+    c->out = end;
+    if(len == 0)
+        return OK;
+    
+    ++ st->stats.writes;
+    if(write(c->fd, end - len, len) != (ssize_t)len) {
+        dr_msg(st, DR_LOG_INFO, "Problem writing %s\n", c->name);
+        return ERROR;
+    }
+    st->stats.bytes_written += len;
+
+    return OK;
+}
+
+/* carve_close(st, c, end)
+ *
+ *      finish the current file, its data ending at "end", or
+ *      already written if "end" is NULL.
+ */
+void carve_close(st, c, end)
+dr_state *st;
+dr_carve *c;
+char *end;
+{
+    int r = OK;
+
+    if(end != NULL)
+        r = carve_flush(st, c, end);
+    if(close(c->fd) == -1)
+        r = ERROR;
+
+    if(r != OK)
+        unlink(c->name);
+    else {
+        dr_msg(st, DR_LOG_INFO, "Carved %s, %ld bytes%s\n", c->name, (long)c->size,
+               c->sig->kind == SIG_FOOTER && !c->found ? " (no footer)" : "");
+        ++ c->files;
+    }
+
+    c->sig = NULL;
+    c->fd = -1;
+}
+
+/* carve_end(c, p, len)
+ *
+ *      how many of the "len" bytes at "p", the next zone of the
+ *      current file, belong to it. c->found is set when the end of
+ *      the file is in them.
+ */
+long carve_end(c, p, len)
+dr_carve *c;
+unsigned char *p;
+long len;
+{
+    dr_sig *s = c->sig;
+    unsigned char seam[2 * MAX_SIG];
+    long skip = c->size == 0 ? s->head_len : 0;
+    long n;
+
+    if(c->want > 0) {
+        if(c->want - c->size <= len) {
+            c->found = 1;
+            return (long)(c->want - c->size);
+        }
+        return(len);
+    }
+
+    if(s->kind != SIG_FOOTER)
+        return(len);
+
+    /* a footer split over the previous zone and this one */
+    if(c->seam_len > 0) {
+        memcpy(seam, c->seam, c->seam_len);
+        memcpy(seam + c->seam_len, p, s->foot_len - 1);
+        if((n = find_footer(seam, (long)c->seam_len + s->foot_len - 1, s->foot, s->foot_len)) != -1) {
+            c->found = 1;
+            return n - c->seam_len;
+        }
+    }
+
+    if((n = find_footer(p + skip, len - skip, s->foot, s->foot_len)) != -1) {
+        c->found = 1;
+        return n + skip;
+    }
+
+    c->seam_len = s->foot_len - 1;
+    memcpy(c->seam, p + len - c->seam_len, c->seam_len);
+    return(len);
+}
+
+/* carve_zones(st, c, data, zone, count)
+ *
+ *      scan "count" free zones from "zone", read into "data"
+ */
+int carve_zones(st, c, data, zone, count)
+dr_state *st;
+dr_carve *c;
+char *data;
+zone_t zone;
+zone_t count;
+{
+    long bs = (long)st->zone_size;
+    dr_sig *s;
+    char *p;
+    long n;
+    zone_t i;
+
+    c->out = data;
+
+    for(i = 0; i < count; ++ i) {
+        p = data + (size_t)i * bs;
+        s = carve_header(c, (unsigned char *)p);
+
+        /* a file of unknown size ends where the next one starts */
+        if(c->sig != NULL && s != NULL && c->want == 0)
+            carve_close(st, c, p);
+
+        if(c->sig == NULL) {
+            if(s == NULL)
+                continue;
+            carve_open(st, c, s, p, zone + i);
+            if(c->sig == NULL)
+                continue;
+        }
+
+        n = carve_end(c, (unsigned char *)p, bs);
+        if(c->size + n >= c->sig->max_size)
+            n = (long)(c->sig->max_size - c->size);
+        c->size += n;
+
+        if(c->found || c->size >= c->sig->max_size)
+            carve_close(st, c, p + n);
+    }
+
+    if(c->sig != NULL && carve_flush(st, c, data + (size_t)count * bs) != OK) {
+        close(c->fd);
+        unlink(c->name);
+        c->sig = NULL;
+        return ERROR;
+    }
+
+    return OK;
+}
+
+/* carve_free(st)
+ *
+ *      carve files out of every free zone of the open device into
+ *      st->out_dir. the number of files carved is returned, -1 on error.
+ */
+int carve_free(st)
+dr_state *st;
+{
+    dr_carve c;
+    dr_timer t;
+    zone_t zone[2], count[2];
+    zone_t last = NO_ZONE;
+    bit_t bit = 1;
+    off_t scanned = 0;
+    struct timeval start;
+    double secs;
+    char *data;
+    int cur = 0;
+    int more;
+    int r = OK;
+
+    if(carve_setup(st, &c) != OK)
+        return(-1);
+
+    gettimeofday(&start, NULL);
+    timer_start(&t);
+
+    if((more = carve_next(st, &bit, &zone[cur], &count[cur])))
+        carve_start(st, &c, cur, zone[cur], count[cur]);
+
+    while(more) {
+        /* the next piece is read while this one is scanned */
+        if((more = carve_next(st, &bit, &zone[!cur], &count[!cur])))
+            carve_start(st, &c, !cur, zone[!cur], count[!cur]);
+
+        if((data = carve_wait(st, &c, cur, zone[cur], count[cur])) == NULL) {
+            r = ERROR;
+            break;
+        }
+
+        /* a file does not run on past the end of free zones */
+        if(c.sig != NULL && zone[cur] != last)
+            carve_close(st, &c, NULL);
+
+        if(carve_zones(st, &c, data, zone[cur], count[cur]) != OK) {
+            r = ERROR;
+            break;
+        }
+
+        scanned += (off_t)count[cur] * st->zone_size;
+        last = zone[cur] + count[cur];
+        cur = !cur;
+    }
+
+    if(c.sig != NULL)
+        carve_close(st, &c, NULL);
+    carve_cleanup(st, &c);
+    timer_stop(st, PH_COPY, &t);
+
+    secs = time_since(&start);
+    dr_msg(st, DR_LOG_INFO, "Carved %d files from %ld bytes of free zones in %.3f s (%.2f MB/s)\n", c.files,
+           (long)scanned, secs, secs > 0 ? scanned / secs / (1024 * 1024) : 0.0);
+
+    return r == OK ? c.files : -1;
+}
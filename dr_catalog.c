@@ -0,0 +1,769 @@
+//
+//  dr_catalog.c
+//
+//      A catalog of the deleted entries of a device.
+//
+//      Finding what can be recovered otherwise means guessing a path
+//      and reading directories for it. Built with -K, a catalog is
+//      one pass over the i-node table to find the live directories,
+//      one over the blocks of those directories, from the root down,
+//      collecting every deleted entry, and one over the i-nodes of
+//      those entries, in i-node order, to keep their size, mode, time
+//      and extents. With -L it is listed, and with -k the files of -r
+//      and -b are looked up in it, so only the catalog and the data
+//      extents are read; the zone map is still checked for the zones
+//      copied, since they may have been reused since the build.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <minix/config.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <minix/const.h>
+#include <minix/type.h>
+#include "mfs/const.h"
+#include "mfs/type.h"
+#include "mfs/mfsdir.h"
+
+#include "drecover.h"
+
+static char *state_names[] = { "ok", "reused", "lost" };
+
+/* catalog_build(st, cat)
+ *
+ *      catalog the deleted entries of the open device into "cat",
+ *      which is zeroed. its entries end up sorted by path.
+ */
+int catalog_build(st, cat)
+dr_state *st;
+dr_catalog *cat;
+{
+    char device[PATH_MAX + 1];
+    dr_cat_dir d;
+    dr_timer t;
+    long off;
+    int i;
+
+    cat->head.magic = CAT_MAGIC;
+    cat->head.block_size = st->block_size;
+    cat->head.zone_size = (uint32_t)st->zone_size;
+    cat->head.zones = st->zones;
+    cat->head.inodes = st->inodes;
+    cat->head.inode_start = st->inode_start;
+    cat->head.first_data = st->first_data;
+    cat->head.built = (uint32_t)time(NULL);
+
+    /* the device is found again from the catalog by its full name */
+    if((off = catalog_name(st, cat, NULL, realpath(st->device_name, device) != NULL ?
+                           device : st->device_name)) == -1L)
+        return ERROR;
+    cat->head.device = (uint32_t)off;
+
+    if(st->run == NULL && (st->run = dev_alloc(st->run_size)) == NULL) {
+        dr_msg(st, DR_LOG_INFO, "Not enough memory to read the i-node table\n");
+        return ERROR;
+    }
+
+    timer_start(&t);
+    i = catalog_dirs(st, cat);
+    timer_stop(st, PH_INODE, &t);
+    if(i != OK)
+        return ERROR;
+
+    /* directories are read from the root down, each adding its own */
+    if((off = catalog_name(st, cat, NULL, "")) == -1L ||
+       catalog_grow(st, (void **)&cat->dirs, &cat->dir_slots, 1, sizeof(dr_cat_dir)) != OK)
+        return ERROR;
+    cat->dirs[0].inode = ROOT_INODE;
+    cat->dirs[0].path = (uint32_t)off;
+    cat->dir_count = 1;
+    cat->is_dir[ROOT_INODE / CHAR_BIT] &= ~(1 << (ROOT_INODE % CHAR_BIT));
+
+    timer_start(&t);
+    for(i = 0; i < cat->dir_count; ++ i) {
+        d = cat->dirs[i];
+        if(catalog_dir(st, cat, &d) != OK)
+            break;
+    }
+    timer_stop(st, PH_DIR, &t);
+    if(i < cat->dir_count)
+        return ERROR;
+
+    timer_start(&t);
+    i = catalog_inodes(st, cat);
+    timer_stop(st, PH_INODE, &t);
+    if(i != OK)
+        return ERROR;
+
+    return catalog_sort(st, cat);
+}
+
+/* catalog_dirs(st, cat)
+ *
+ *      read the whole i-node table, RUN_BLOCKS at a time, and mark
+ *      the i-nodes of live directories in cat->is_dir.
+ */
+int catalog_dirs(st, cat)
+dr_state *st;
+dr_catalog *cat;
+{
+    unsigned per_run = st->run_size / st->inode_size;
+    unsigned ino, i, n;
+    u16_t mode;
+
+    if((cat->is_dir = (unsigned char *)calloc(st->inodes / CHAR_BIT + 1, 1)) == NULL) {
+        dr_msg(st, DR_LOG_INFO, "Not enough memory for %u i-nodes\n", st->inodes);
+        return ERROR;
+    }
+
+    for(ino = 1; ino <= st->inodes; ino += n) {
+        n = st->inodes - ino + 1 < per_run ? st->inodes - ino + 1 : per_run;
+        if(dev_read(st, inode_addr(st, ino), st->run, (size_t)n * st->inode_size) != OK)
+            return ERROR;
+
+        /* the mode comes first in V1 and V2 i-nodes alike */
+        for(i = 0; i < n; ++ i) {
+            memcpy(&mode, st->run + (size_t)i * st->inode_size, sizeof(mode));
+            if((mode & S_IFMT) == S_IFDIR && bit_test(st, MAP_INODE, (bit_t)(ino + i)))
+                cat->is_dir[(ino + i) / CHAR_BIT] |= 1 << ((ino + i) % CHAR_BIT);
+        }
+    }
+
+    return OK;
+}
+
+/* catalog_dir(st, cat, d)
+ *
+ *      read the blocks of directory "d", RUN_BLOCKS at a time as
+ *      scan_dir() does, and catalog each of its entries. a directory
+ *      that can not be read is left out.
+ */
+int catalog_dir(st, cat, d)
+dr_state *st;
+dr_catalog *cat;
+dr_cat_dir *d;
+{
+    zone_t blocks[RUN_BLOCKS];
+    char *buffers[RUN_BLOCKS];
+    int per_zone = 1 << st->log_zone_size;
+    zone_t *zones;
+    zone_t zone;
+    off_t size;
+    int count, total;
+    int entries;
+    int i, j, k, n;
+    int r = OK;
+
+    if((count = inode_zones(st, d->inode, &zones, &size)) == -1) {
+        dr_msg(st, DR_LOG_INFO, "Error reading directory %s/\n", cat->names + d->path);
+        return OK;
+    }
+    total = count * per_zone;
+
+    for(i = 0; i < total && size > 0 && r == OK; i += RUN_BLOCKS) {
+        for(j = n = 0; j < RUN_BLOCKS && i + j < total; ++ j) {
+            if((zone = zones[(i + j) >> st->log_zone_size]) == NO_ZONE)
+                continue;
+            blocks[n] = (zone << st->log_zone_size) + ((i + j) & (per_zone - 1));
+            buffers[n] = st->run + (size_t)n * st->block_size;
+            ++ n;
+        }
+
+        if(read_blocks(st, blocks, n, buffers) != OK) {
+            dr_msg(st, DR_LOG_INFO, "Error reading directory %s/\n", cat->names + d->path);
+            break;
+        }
+
+        for(j = n = 0; j < RUN_BLOCKS && i + j < total && size > 0 && r == OK; ++ j) {
+            entries = (size < st->block_size ? (int)size : st->block_size) / sizeof(struct direct);
+            if(zones[(i + j) >> st->log_zone_size] != NO_ZONE) {
+                for(k = 0; k < entries && r == OK; ++ k)
+                    r = catalog_entry(st, cat, buffers[n] + k * sizeof(struct direct), d);
+                ++ n;
+            }
+            size -= st->block_size;
+        }
+    }
+
+    free(zones);
+    return(r);
+}
+
+/* catalog_entry(st, cat, entry, d)
+ *
+ *      add the directory entry at "entry" of directory "d": a
+ *      deleted entry to the catalog, a live directory to the ones
+ *      still to be read. ERROR is returned only if out of memory.
+ */
+int catalog_entry(st, cat, entry, d)
+dr_state *st;
+dr_catalog *cat;
+char *entry;
+dr_cat_dir *d;
+{
+    struct direct *dp = (struct direct *)entry;
+    char name[MFS_DIRSIZ + 1];
+    dr_cat_dir *sub;
+    dr_cat_ent *e;
+    u32_t inode;
+    long off;
+
+    if(dp->mfs_d_ino != 0) {
+        /* each directory is read once, its bit is cleared when it is queued */
+        inode = dp->mfs_d_ino;
+        if(inode > st->inodes || !(cat->is_dir[inode / CHAR_BIT] & (1 << (inode % CHAR_BIT))))
+            return OK;
+        cat->is_dir[inode / CHAR_BIT] &= ~(1 << (inode % CHAR_BIT));
+        strncpy(name, dp->mfs_d_name, MFS_DIRSIZ);
+        name[MFS_DIRSIZ] = '\0';
+    }
+    else {
+        /* an entry never used is all zeros */
+        if(dp->mfs_d_name[0] == '\0')
+            return OK;
+        memcpy(&inode, &dp->mfs_d_name[MFS_DIRSIZ - sizeof(u32_t)], sizeof(inode));
+        if(inode < 1 || inode > st->inodes)
+            return OK;
+        strncpy(name, dp->mfs_d_name, MFS_DIRSIZ - sizeof(u32_t));
+        name[MFS_DIRSIZ - sizeof(u32_t)] = '\0';
+    }
+
+    if(strlen(cat->names + d->path) + 1 + strlen(name) > MAX_STRING) {
+        dr_msg(st, DR_LOG_INFO, "Path of %s in %s/ is too long, not cataloged\n", name, cat->names + d->path);
+        return OK;
+    }
+
+    if((off = catalog_name(st, cat, cat->names + d->path, name)) == -1L)
+        return ERROR;
+
+    if(dp->mfs_d_ino != 0) {
+        if(catalog_grow(st, (void **)&cat->dirs, &cat->dir_slots, cat->dir_count + 1, sizeof(dr_cat_dir)) != OK)
+            return ERROR;
+        sub = &cat->dirs[cat->dir_count ++];
+        sub->inode = (ino_t)inode;
+        sub->path = (uint32_t)off;
+        return OK;
+    }
+
+    if(catalog_grow(st, (void **)&cat->ents, &cat->ent_slots, cat->head.entries + 1, sizeof(dr_cat_ent)) != OK)
+        return ERROR;
+    e = &cat->ents[cat->head.entries ++];
+    memset(e, 0, sizeof(dr_cat_ent));
+    e->inode = inode;
+    e->parent = (uint32_t)d->inode;
+    e->path = (uint32_t)off;
+    return OK;
+}
+
+/* catalog_inodes(st, cat)
+ *
+ *      fill in the i-node of every entry of "cat", going through
+ *      the entries in i-node order so the table is read forwards.
+ *      the zones of a free i-node are kept as extents, followed by
+ *      those of its indirect zones; whether it can be recovered, as
+ *      with all of them free, is put in its state.
+ */
+int catalog_inodes(st, cat)
+dr_state *st;
+dr_catalog *cat;
+{
+    dr_inode di;
+    dr_cat_ent *e;
+    dr_extent *x;
+    zone_t *zones, *ind;
+    off_t size;
+    uint32_t i;
+    int count, n, m;
+
+    if((ind = (zone_t *)malloc((2 + st->nr_indirects) * sizeof(zone_t))) == NULL) {
+        dr_msg(st, DR_LOG_INFO, "Not enough memory for a catalog\n");
+        return ERROR;
+    }
+
+    qsort(cat->ents, cat->head.entries, sizeof(dr_cat_ent), inode_compare);
+
+    for(i = 0; i < cat->head.entries; ++ i) {
+        e = &cat->ents[i];
+        e->state = CAT_LOST;
+
+        st->address = inode_addr(st, e->inode);
+        if(read_block(st, st->buffer) == NULL)
+            continue;
+
+        if(bit_test(st, MAP_INODE, (bit_t)e->inode)) {
+            e->state = CAT_REUSED;
+            continue;
+        }
+
+        st->layout->inode(&st->bp[st->offset], &di);
+        e->mode = (uint16_t)di.mode;
+        e->mtime = (uint32_t)di.mtime;
+        if(di.size < 0)
+            continue;
+        e->size = (uint64_t)di.size;
+
+        if((count = inode_zones(st, e->inode, &zones, &size)) == -1)
+            continue;
+        if((m = indirect_zones(st, &di, ind)) == -1) {
+            free(zones);
+            continue;
+        }
+
+        if(catalog_grow(st, (void **)&cat->exts, &cat->ext_slots, cat->head.extents + count + m + 1,
+                        sizeof(dr_extent)) != OK) {
+            free(zones);
+            free(ind);
+            return ERROR;
+        }
+
+        x = cat->exts + cat->head.extents;
+        n = zone_runs(st, zones, count, x);
+        free(zones);
+        if(n == -1 || (m = zone_runs(st, ind, m, x + n)) == -1)
+            continue;
+
+        e->extent = cat->head.extents;
+        e->count = n;
+        e->indirects = m;
+        cat->head.extents += n + m;
+
+        if(extents_free(st, x, n + m))
+            e->state = CAT_OK;
+    }
+
+    free(ind);
+    return OK;
+}
+
+/* catalog_name(st, cat, dir, name)
+ *
+ *      add "dir/name", or "name" if "dir" is NULL, to the names of
+ *      "cat". "dir" may itself be in the names, which can move.
+ *      return its offset, -1L if out of memory.
+ */
+long catalog_name(st, cat, dir, name)
+dr_state *st;
+dr_catalog *cat;
+char *dir;
+char *name;
+{
+    char path[PATH_MAX + 1];
+    int len;
+
+    if(dir == NULL)
+        len = snprintf(path, sizeof(path), "%s", name);
+    else
+        len = snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if(len < 0 || len > PATH_MAX) {
+        dr_msg(st, DR_LOG_INFO, "Name %s is too long\n", name);
+        return(-1L);
+    }
+
+    if(catalog_grow(st, (void **)&cat->names, &cat->name_slots, cat->head.names + len + 1, 1) != OK)
+        return(-1L);
+
+    memcpy(cat->names + cat->head.names, path, len + 1);
+    cat->head.names += len + 1;
+    return (long)(cat->head.names - len - 1);
+}
+
+/* catalog_grow(st, &p, &slots, need, size)
+ *
+ *      make the array "p" of "slots" elements of "size" bytes
+ *      hold at least "need", doubling it.
+ */
+int catalog_grow(st, p, slots, need, size)
+dr_state *st;
+void **p;
+int *slots;
+int need;
+size_t size;
+{
+    void *q;
+    int n = *slots;
+
+    if(need <= n)
+        return OK;
+
+    for(n = n ? n : 64; n < need; n *= 2)
+        ;
+    if((q = realloc(*p, (size_t)n * size)) == NULL) {
+        dr_msg(st, DR_LOG_INFO, "Out of memory for the catalog\n");
+        return ERROR;
+    }
+
+    *p = q;
+    *slots = n;
+    return OK;
+}
+
+/* catalog_sort(st, cat)
+ *
+ *      sort the entries of "cat" by path, and by i-node for a
+ *      name deleted more than once.
+ */
+int catalog_sort(st, cat)
+dr_state *st;
+dr_catalog *cat;
+{
+    dr_cat_key *keys;
+    uint32_t i;
+
+    if((keys = (dr_cat_key *)malloc((cat->head.entries + 1) * sizeof(dr_cat_key))) == NULL) {
+        dr_msg(st, DR_LOG_INFO, "Out of memory for the catalog\n");
+        return ERROR;
+    }
+
+    for(i = 0; i < cat->head.entries; ++ i) {
+        keys[i].path = cat->names + cat->ents[i].path;
+        keys[i].ent = cat->ents[i];
+    }
+    qsort(keys, cat->head.entries, sizeof(dr_cat_key), path_compare);
+    for(i = 0; i < cat->head.entries; ++ i)
+        cat->ents[i] = keys[i].ent;
+
+    free(keys);
+    return OK;
+}
+
+/* inode_compare(a, b)
+ *
+ *      qsort(3) order of two catalog entries by i-node
+ */
+int inode_compare(a, b)
+const void *a;
+const void *b;
+{
+    uint32_t x = ((const dr_cat_ent *)a)->inode;
+    uint32_t y = ((const dr_cat_ent *)b)->inode;
+
+    return x < y ? -1 : x > y;
+}
+
+/* path_compare(a, b)
+ *
+ *      qsort(3) order of two catalog keys by path, then i-node
+ */
+int path_compare(a, b)
+const void *a;
+const void *b;
+{
+    const dr_cat_key *x = (const dr_cat_key *)a;
+    const dr_cat_key *y = (const dr_cat_key *)b;
+    int r;
+
+    if((r = strcmp(x->path, y->path)) != 0)
+        return(r);
+    return inode_compare(&x->ent, &y->ent);
+}
+
+/* catalog_states(st, cat)
+ *
+ *      recheck the entries of "cat" against the zone map as it is
+ *      now. an entry is ok or lost by whether its zones are free;
+ *      entries reused or lost for another reason, which have no
+ *      extents, stay as they are. the number of entries whose state
+ *      changed is returned.
+ */
+int catalog_states(st, cat)
+dr_state *st;
+dr_catalog *cat;
+{
+    dr_cat_ent *e;
+    uint16_t state;
+    uint32_t i;
+    int changed = 0;
+
+    for(i = 0; i < cat->head.entries; ++ i) {
+        e = &cat->ents[i];
+        if(e->state == CAT_REUSED || (e->state == CAT_LOST && e->count == 0))
+            continue;
+        state = extents_free(st, cat->exts + e->extent, (int)(e->count + e->indirects)) ? CAT_OK : CAT_LOST;
+        if(state != e->state) {
+            e->state = state;
+            ++ changed;
+        }
+    }
+    return(changed);
+}
+
+/* catalog_write(st, cat, name)
+ *
+ *      write "cat" to the file "name"
+ */
+int catalog_write(st, cat, name)
+dr_state *st;
+dr_catalog *cat;
+char *name;
+{
+    FILE *f;
+    int r = OK;
+
+    if((f = fopen(name, "w")) == NULL) {
+        dr_msg(st, DR_LOG_ERROR, "Can not create catalog %s\n", name);
+        return ERROR;
+    }
+
+    if(fwrite(&cat->head, sizeof(dr_cat_head), 1, f) != 1 ||
+       fwrite(cat->ents, sizeof(dr_cat_ent), cat->head.entries, f) != cat->head.entries ||
+       fwrite(cat->exts, sizeof(dr_extent), cat->head.extents, f) != cat->head.extents ||
+       fwrite(cat->names, 1, cat->head.names, f) != cat->head.names)
+        r = ERROR;
+
+    if(fclose(f) != 0)
+        r = ERROR;
+
+    if(r != OK) {
+        dr_msg(st, DR_LOG_ERROR, "Problem writing catalog %s\n", name);
+        unlink(name);
+    }
+    return(r);
+}
+
+/* catalog_read(st, name)
+ *
+ *      read the catalog in the file "name". NULL is returned if it
+ *      can not be read or is damaged.
+ */
+dr_catalog *catalog_read(st, name)
+dr_state *st;
+char *name;
+{
+    dr_catalog *cat;
+    dr_cat_ent *e;
+    FILE *f;
+    uint32_t i;
+    int r = ERROR;
+
+    if((f = fopen(name, "r")) == NULL) {
+        dr_msg(st, DR_LOG_ERROR, "Can not open catalog %s\n", name);
+        return(NULL);
+    }
+
+    if((cat = (dr_catalog *)calloc(1, sizeof(dr_catalog))) == NULL) {
+        dr_msg(st, DR_LOG_ERROR, "Out of memory\n");
+        fclose(f);
+        return(NULL);
+    }
+
+    if(fread(&cat->head, sizeof(dr_cat_head), 1, f) != 1 || cat->head.magic != CAT_MAGIC ||
+       cat->head.names == 0)
+        goto done;
+
+    if((cat->ents = (dr_cat_ent *)malloc((cat->head.entries + 1) * sizeof(dr_cat_ent))) == NULL ||
+       (cat->exts = (dr_extent *)malloc((cat->head.extents + 1) * sizeof(dr_extent))) == NULL ||
+       (cat->names = (char *)malloc(cat->head.names)) == NULL)
+        goto done;
+
+    if(fread(cat->ents, sizeof(dr_cat_ent), cat->head.entries, f) != cat->head.entries ||
+       fread(cat->exts, sizeof(dr_extent), cat->head.extents, f) != cat->head.extents ||
+       fread(cat->names, 1, cat->head.names, f) != cat->head.names || getc(f) != EOF)
+        goto done;
+
+    /* everything must point into the catalog */
+    if(cat->names[cat->head.names - 1] != '\0' || cat->head.device >= cat->head.names)
+        goto done;
+    for(i = 0; i < cat->head.entries; ++ i) {
+        e = &cat->ents[i];
+        if(e->path >= cat->head.names || e->state > CAT_LOST || e->extent > cat->head.extents ||
+           e->count > cat->head.extents - e->extent || e->indirects > cat->head.extents - e->extent - e->count)
+            goto done;
+    }
+    r = OK;
+
+done:
+    fclose(f);
+    if(r != OK) {
+        dr_msg(st, DR_LOG_ERROR, "Catalog %s is damaged\n", name);
+        catalog_free(cat);
+        return(NULL);
+    }
+    return(cat);
+}
+
+/* catalog_list(st, cat)
+ *
+ *      print the entries of "cat", one per line
+ */
+void catalog_list(st, cat)
+dr_state *st;
+dr_catalog *cat;
+{
+    char when[32];
+    time_t mtime;
+    dr_cat_ent *e;
+    uint64_t bytes = 0;
+    uint32_t i;
+    int ok = 0;
+    
+    dr_msg(st, DR_LOG_INFO, "%-6s %10s %12s %-16s %7s %s\n", "state", "i-node", "size", "modified", "extents", "path");
+    for(i = 0; i < cat->head.entries; ++ i) {
+        e = &cat->ents[i];
+        mtime = (time_t)e->mtime;
+        if(e->state == CAT_REUSED || strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&mtime)) == 0)
+            strcpy(when, "-");
+        dr_msg(st, DR_LOG_INFO, "%-6s %10lu %12llu %-16s %7lu %s\n", catalog_state(e->state), (unsigned long)e->inode,
+               (unsigned long long)e->size, when, (unsigned long)e->count, cat->names + e->path);
+        if(e->state == CAT_OK) {
+            bytes += e->size;
+            ++ ok;
+        }
+    }
+    
+    mtime = (time_t)cat->head.built;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&mtime));
+    dr_msg(st, DR_LOG_INFO, "%lu deleted entries, %d recoverable (%llu bytes), on %s as of %s\n",
+           (unsigned long)cat->head.entries, ok, (unsigned long long)bytes,
+           cat->names + cat->head.device, when);
+}
+
+/* catalog_free(cat)
+ *
+ */
+void catalog_free(cat)
+dr_catalog *cat;
+{
+    if(cat == NULL)
+        return;
+
+    free(cat->ents);
+    free(cat->exts);
+    free(cat->names);
+    free(cat->is_dir);
+    free(cat->dirs);
+    free(cat);
+}
+
+/* catalog_state(state)
+ *
+ *      name of an entry state CAT_*
+ */
+char *catalog_state(state)
+int state;
+{
+    return state_names[state];
+}
+
+/* catalog_check(st)
+ *
+ *      make sure the catalog in use was built from the device
+ *      whose super block has just been read.
+ */
+int catalog_check(st)
+dr_state *st;
+{
+    dr_cat_head *h = &st->catalog->head;
+
+    if(h->block_size != (uint32_t)st->block_size || h->zone_size != (uint32_t)st->zone_size ||
+       h->zones != st->zones || h->inodes != st->inodes ||
+       h->inode_start != st->inode_start || h->first_data != st->first_data) {
+        dr_msg(st, DR_LOG_ERROR, "The catalog is not of the file system on %s\n", st->device_name);
+        return ERROR;
+    }
+
+    return OK;
+}
+
+/* catalog_find(st, cat, path, found, max)
+ *
+ *      put up to "max" entries for "path" in "found", by a binary
+ *      search of the sorted entries. return the number found.
+ */
+int catalog_find(st, cat, path, found, max)
+dr_state *st;
+dr_catalog *cat;
+char *path;
+dr_cat_ent **found;
+int max;
+{
+    uint32_t lo = 0, hi = cat->head.entries, mid;
+    int n = 0;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(strcmp(cat->names + cat->ents[mid].path, path) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for(; lo < cat->head.entries && n < max && strcmp(cat->names + cat->ents[lo].path, path) == 0; ++ lo)
+        found[n ++] = &cat->ents[lo];
+
+    if(n == 0)
+        dr_msg(st, DR_LOG_INFO, "%s is not in the catalog\n", path);
+    return(n);
+}
+
+/* catalog_recover(st, e, &size)
+ *
+ *      recover the file of catalog entry "e" into st->file_name
+ *      from its extents, returning its size in "size". its zones
+ *      must still be free, or DR_EINUSE is returned; DR_EIO if
+ *      it could not be copied, DR_ECHANGED if they were allocated
+ *      while it was.
+ */
+int catalog_recover(st, e, size)
+dr_state *st;
+dr_cat_ent *e;
+off_t *size;
+{
+    dr_extent *x = st->catalog->exts + e->extent;
+    off_t file_size = (off_t)e->size;
+    dr_timer t;
+    uint32_t i;
+    int r = 1;
+
+    if(e->state != CAT_OK) {
+        dr_msg(st, DR_LOG_ERROR, "Recover aborted: i-node %lu was %s when cataloged\n",
+                (unsigned long)e->inode, catalog_state(e->state));
+        return DR_EINUSE;
+    }
+
+    if(!extents_free(st, x, (int)(e->count + e->indirects))) {
+        dr_msg(st, DR_LOG_ERROR, "Recover aborted: zones of i-node %lu are in use now\n", (unsigned long)e->inode);
+        return DR_EINUSE;
+    }
+
+    if(!st->out.stream && access(st->file_name, F_OK) == 0) {
+        dr_msg(st, DR_LOG_ERROR, "Will not overwrite file %s\n", st->file_name);
+        return ERROR;
+    }
+
+    if(out_open(st) != OK)
+        return ERROR;
+
+    timer_start(&t);
+    out_prealloc(st, file_size);
+    for(i = 0; i < e->count && file_size > 0 && r; ++ i)
+        r = copy_extent(st, &x[i], &file_size);
+    r = r && file_size == 0 && (st->async == NULL || async_drain(st) == OK);
+    timer_stop(st, PH_COPY, &t);
+
+    if(!r) {
+        if(st->async != NULL)
+            async_drain(st);
+        out_abort(st);
+        dr_msg(st, DR_LOG_ERROR, "Recover aborted: recover block error!\n");
+        return DR_EIO;
+    }
+
+    if(out_close(st) != OK) {
+        dr_msg(st, DR_LOG_ERROR, "Problem writing %s\n", st->file_name);
+        return DR_EIO;
+    }
+
+    *size = (off_t)e->size;
+    if(st->out.stream)
+        dr_msg(st, DR_LOG_INFO, "Recovered %ld bytes, written to the output stream\n", *size);
+    else
+        dr_msg(st, DR_LOG_INFO, "Recovered %ld bytes, written to file %s\n", *size, st->file_name);
+    return copy_verify(st, x, (int)(e->count + e->indirects));
+}
@@ -0,0 +1,598 @@
+//
+//  dr_daemon.c
+//
+//      A daemon that keeps one device open and serves its deleted
+//      entries over a Unix domain socket.
+//
+//      The super block, the bit maps, the catalog of deleted entries
+//      and the block cache are read once, before any client, and stay
+//      warm. Each client is served by a child forked from that state,
+//      so clients run at once and none of them pays for the setup.
+//      Between clients the bit maps are read again; blocks that changed
+//      are taken in and what was cached for them is forgotten.
+//
+//      Requests and replies are lines of text:
+//
+//          LIST                    the catalog
+//          RECOVER /path_name      the file, written to a descriptor
+//                                  sent with the request (SCM_RIGHTS)
+//
+//      A reply is any number of message lines, "- text" or "! text"
+//      for an error, ending in "OK value" or "ERR code", code being
+//      one of DR_E*. A client waits for the reply before its next
+//      request.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <minix/config.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+
+#include <minix/const.h>
+#include <minix/type.h>
+#include "mfs/const.h"
+
+#include "drecover.h"
+
+/* daemon_serve(st, name)
+ *
+ *      serve the device of "st" on the socket "name" until the
+ *      process is killed. ERROR is returned if it can not start.
+ */
+int daemon_serve(st, name)
+dr_state *st;
+char *name;
+{
+    dr_daemon d;
+    struct pollfd p;
+    pid_t pid;
+    int conn;
+    int r;
+
+    memset(&d, 0, sizeof(d));
+    d.name = name;
+    d.fd = -1;
+
+    if(st->device_path == NULL) {
+        dr_msg(st, DR_LOG_ERROR, "The daemon needs a device, given with -d or -k\n");
+        return ERROR;
+    }
+    st->device_name = st->device_path;
+    if(open_device(st) != OK)
+        return ERROR;
+
+    if(daemon_warm(st, &d) != OK || daemon_listen(st, &d) != OK) {
+        close_device(st);
+        return ERROR;
+    }
+
+    /* a client that goes away is an error on its connection, not a signal */
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    dr_msg(st, DR_LOG_INFO, "Serving %lu deleted entries of %s on %s\n",
+           (unsigned long)st->catalog->head.entries, st->device_name, name);
+
+    for(;;) {
+        p.fd = d.fd;
+        p.events = POLLIN;
+        if((r = poll(&p, 1, DAEMON_CHECK * 1000)) == -1 && errno != EINTR)
+            break;
+        daemon_reap(&d, 0);
+
+        /* a client gets the maps as of at most a second ago */
+        if(r <= 0 || time(NULL) != d.checked)
+            daemon_check(st, &d);
+        if(r <= 0 || (conn = accept(d.fd, NULL, NULL)) == -1)
+            continue;
+
+        while(d.clients >= DAEMON_CLIENTS)
+            daemon_reap(&d, 1);
+
+        fflush(stdout);
+        fflush(stderr);
+        if((pid = fork()) == 0) {
+            close(d.fd);
+            daemon_client(st, conn);
+            _exit(0);
+        }
+        if(pid == -1)
+            dr_msg(st, DR_LOG_ERROR, "Can not start a process for a client\n");
+        else
+            ++ d.clients;
+        close(conn);
+    }
+
+    dr_msg(st, DR_LOG_ERROR, "Error waiting for clients on %s\n", name);
+    close(d.fd);
+    unlink(name);
+    close_device(st);
+    return ERROR;
+}
+
+/* daemon_warm(st, d)
+ *
+ *      read everything the clients share: all of the bit maps and
+ *      the catalog, built now unless one was given with -k. building
+ *      it leaves the directory blocks in the cache.
+ */
+int daemon_warm(st, d)
+dr_state *st;
+dr_daemon *d;
+{
+    struct stat sb;
+
+    d->checked = time(NULL);
+    if(fstat(st->device_d, &sb) == 0)
+        d->mtime = sb.st_mtime;
+
+    if(load_bit_map(st) != OK) {
+        dr_msg(st, DR_LOG_ERROR, "Can not read the bit maps of %s\n", st->device_name);
+        return ERROR;
+    }
+
+    if(st->catalog != NULL) {
+        catalog_states(st, st->catalog);
+        return OK;
+    }
+    return daemon_catalog(st);
+}
+
+/* daemon_listen(st, d)
+ *
+ *      listen on the socket d->name. a socket left there by a daemon
+ *      that is gone is taken over, one still answering is not.
+ */
+int daemon_listen(st, d)
+dr_state *st;
+dr_daemon *d;
+{
+    struct sockaddr_un sa;
+    struct stat sb;
+    int fd;
+
+    if(strlen(d->name) >= sizeof(sa.sun_path)) {
+        dr_msg(st, DR_LOG_ERROR, "Socket name %s is too long\n", d->name);
+        return ERROR;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, d->name);
+
+    if(lstat(d->name, &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+        if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1 &&
+           connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+            dr_msg(st, DR_LOG_ERROR, "A daemon is already serving %s\n", d->name);
+            close(fd);
+            return ERROR;
+        }
+        if(fd != -1)
+            close(fd);
+        unlink(d->name);
+    }
+
+    if((d->fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+       bind(d->fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+       listen(d->fd, DAEMON_CLIENTS) == -1) {
+        dr_msg(st, DR_LOG_ERROR, "Can not listen on %s\n", d->name);
+        if(d->fd != -1)
+            close(d->fd);
+        d->fd = -1;
+        return ERROR;
+    }
+    return OK;
+}
+
+/* daemon_reap(d, wait)
+ *
+ *      collect the children that have finished, waiting for one if
+ *      "wait" is set
+ */
+void daemon_reap(d, wait)
+dr_daemon *d;
+int wait;
+{
+    while(d->clients > 0 && waitpid(-1, NULL, wait ? 0 : WNOHANG) > 0) {
+        -- d->clients;
+        wait = 0;
+    }
+}
+
+/* daemon_check(st, d)
+ *
+ *      take in the changes to the bit maps since the last check. an
+ *      image file not modified since then is not read at all. a
+ *      changed i-node map may mean new deleted entries, so the
+ *      catalog is built again; a change to the zone map only is
+ *      enough to recheck the entries already cataloged.
+ */
+int daemon_check(st, d)
+dr_state *st;
+dr_daemon *d;
+{
+    struct stat sb;
+    long inodes, zones;
+    int changed;
+
+    if(fstat(st->device_d, &sb) == -1)
+        sb.st_mode = 0;
+    else if(S_ISREG(sb.st_mode) && sb.st_mtime == d->mtime && d->mtime < d->checked) {
+        d->checked = time(NULL);
+        return OK;
+    }
+
+    /* a write during the reads below is caught by the next check */
+    d->checked = time(NULL);
+    if(S_ISREG(sb.st_mode))
+        d->mtime = sb.st_mtime;
+
+    if(reload_bit_map(st, &inodes, &zones) != OK)
+        return ERROR;
+    if(inodes == 0 && zones == 0)
+        return OK;
+
+    if(inodes > 0) {
+        dr_msg(st, DR_LOG_INFO, "%ld i-nodes changed, cataloging %s again\n", inodes, st->device_name);
+        return daemon_catalog(st);
+    }
+
+    changed = catalog_states(st, st->catalog);
+    dr_msg(st, DR_LOG_INFO, "%ld zones changed, %d entries changed state\n", zones, changed);
+    return OK;
+}
+
+/* daemon_catalog(st)
+ *
+ *      catalog the device again. the old catalog is kept if that
+ *      fails.
+ */
+int daemon_catalog(st)
+dr_state *st;
+{
+    dr_catalog *cat;
+
+    if((cat = (dr_catalog *)calloc(1, sizeof(dr_catalog))) == NULL) {
+        dr_msg(st, DR_LOG_ERROR, "Not enough memory for a catalog\n");
+        return ERROR;
+    }
+    if(catalog_build(st, cat) != OK) {
+        dr_msg(st, DR_LOG_ERROR, "Can not catalog %s\n", st->device_name);
+        catalog_free(cat);
+        return ERROR;
+    }
+
+    catalog_free(st->catalog);
+    st->catalog = cat;
+    return OK;
+}
+
+/* daemon_client(st, conn)
+ *
+ *      serve the requests of one client, in a child of the daemon.
+ *      messages go to the client.
+ */
+void daemon_client(st, conn)
+dr_state *st;
+int conn;
+{
+    char line[DAEMON_LINE];
+    off_t size;
+    int fd;
+    int r;
+
+    st->log = daemon_log;
+    st->log_arg = &conn;
+
+    while(daemon_read(conn, line, sizeof(line), &fd) == OK) {
+        if(strcmp(line, "LIST") == 0) {
+            catalog_list(st, st->catalog);
+            r = daemon_send(conn, "OK %lu\n", (unsigned long)st->catalog->head.entries);
+        }
+        else if(strncmp(line, "RECOVER ", 8) == 0 && fd != -1) {
+            if((r = daemon_recover(st, line + 8, fd, &size)) == OK)
+                r = daemon_send(conn, "OK %lld\n", (long long)size);
+            else
+                r = daemon_send(conn, "ERR %d\n", r);
+        }
+        else
+            r = daemon_send(conn, "ERR %d\n", DR_EINVAL);
+
+        if(fd != -1)
+            close(fd);
+        if(r != OK)
+            break;
+    }
+
+    close(conn);
+}
+
+/* daemon_recover(st, path, fd, &size)
+ *
+ *      write the file deleted as "path" to "fd". of several entries
+ *      for it the first that can be recovered is taken.
+ *      a DR_E* code is returned on failure.
+ */
+int daemon_recover(st, path, fd, size)
+dr_state *st;
+char *path;
+int fd;
+off_t *size;
+{
+    dr_cat_ent *ents[DEL_MATCHES];
+    int count, i;
+    int r;
+
+    if((count = catalog_find(st, st->catalog, path, ents, DEL_MATCHES)) == 0)
+        return DR_ENOENT;
+    for(i = 0; i < count - 1 && ents[i]->state != CAT_OK; ++ i)
+        ;
+
+    if(out_fd(st, fd) != OK)
+        return DR_EINVAL;
+    snprintf(st->file_name, sizeof(st->file_name), "%s", path);
+
+    r = catalog_recover(st, ents[i], size);
+    st->out.stream = 0;
+    st->out.pipe = 0;
+    return(r);
+}
+
+/* daemon_log(arg, level, msg)
+ *
+ *      dr_msg() callback of a child, sending the message to the
+ *      client on the connection "arg" points to
+ */
+void daemon_log(arg, level, msg)
+void *arg;
+int level;
+const char *msg;
+{
+    daemon_send(*(int *)arg, "%c %s\n", level == DR_LOG_ERROR ? '!' : '-', msg);
+}
+
+/* daemon_send(conn, fmt, ...)
+ *
+ *      write a line to the other end of "conn"
+ */
+int daemon_send(int conn, char *fmt, ...)
+{
+    char line[DAEMON_LINE];
+    va_list ap;
+    ssize_t n;
+    size_t len, done;
+
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    len = strlen(line);
+    for(done = 0; done < len; done += n) {
+        if((n = write(conn, line + done, len - done)) <= 0)
+            return ERROR;
+    }
+    return OK;
+}
+
+/* daemon_read(conn, line, size, &fd)
+ *
+ *      read a request into "line", without its newline, and the
+ *      descriptor sent with it into "fd", -1 if there is none.
+ *      the client sends nothing more until it has the reply, so
+ *      the request is all there is to read.
+ *      ERROR is returned at the end of the connection.
+ */
+int daemon_read(conn, line, size, fd)
+int conn;
+char *line;
+size_t size;
+int *fd;
+{
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct cmsghdr *c;
+    struct msghdr m;
+    struct iovec v;
+    size_t len = 0;
+    ssize_t n;
+
+    *fd = -1;
+    while(len < size - 1) {
+        memset(&m, 0, sizeof(m));
+        v.iov_base = line + len;
+        v.iov_len = size - 1 - len;
+        m.msg_iov = &v;
+        m.msg_iovlen = 1;
+        m.msg_control = ctl.buf;
+        m.msg_controllen = sizeof(ctl.buf);
+        if((n = recvmsg(conn, &m, 0)) <= 0)
+            break;
+
+        for(c = CMSG_FIRSTHDR(&m); c != NULL; c = CMSG_NXTHDR(&m, c)) {
+            if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && *fd == -1)
+                memcpy(fd, CMSG_DATA(c), sizeof(int));
+        }
+
+        len += n;
+        if(line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+            return OK;
+        }
+    }
+
+    if(*fd != -1)
+        close(*fd);
+    *fd = -1;
+    return ERROR;
+}
+
+/* daemon_connect(st, name)
+ *
+ *      connect to the daemon on the socket "name".
+ *      -1 is returned if there is none.
+ */
+int daemon_connect(st, name)
+dr_state *st;
+char *name;
+{
+    struct sockaddr_un sa;
+    int fd;
+
+    if(strlen(name) >= sizeof(sa.sun_path)) {
+        dr_msg(st, DR_LOG_ERROR, "Socket name %s is too long\n", name);
+        return -1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, name);
+
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+       connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+        dr_msg(st, DR_LOG_ERROR, "No daemon is serving %s\n", name);
+        if(fd != -1)
+            close(fd);
+        return -1;
+    }
+    return(fd);
+}
+
+/* daemon_request(st, name, count, paths)
+ *
+ *      as a client of the daemon on "name", recover "paths" into
+ *      st->out_dir, or list the catalog if "count" is 0. the number
+ *      of files recovered is returned, or for a list 0 on success,
+ *      -1 on failure.
+ */
+int daemon_request(st, name, count, paths)
+dr_state *st;
+char *name;
+int count;
+char **paths;
+{
+    char request[DAEMON_LINE];
+    char dir_name[MAX_STRING + 1];
+    char file_name[MAX_STRING + 1];
+    char out_name[PATH_MAX];
+    long long size;
+    FILE *replies;
+    int recovered = 0;
+    int conn, fd;
+    int i, r;
+
+    if((conn = daemon_connect(st, name)) == -1)
+        return -1;
+    if((fd = dup(conn)) == -1 || (replies = fdopen(fd, "r")) == NULL) {
+        dr_msg(st, DR_LOG_ERROR, "Can not read from %s\n", name);
+        close(conn);
+        return -1;
+    }
+
+    if(count == 0)
+        recovered = daemon_ask(st, conn, replies, "LIST", -1, &size) == OK ? 0 : -1;
+
+    for(i = 0; i < count; ++ i) {
+        if(strlen(paths[i]) + 8 >= sizeof(request) || !split_dir_file(st, paths[i], dir_name, file_name))
+            continue;
+
+        /* the file is created by the client, as its user */
+        if(snprintf(out_name, sizeof(out_name), "%s/%s", st->out_dir, file_name) >= (int)sizeof(out_name)) {
+            dr_msg(st, DR_LOG_ERROR, "Output file name for %s too long\n", paths[i]);
+            continue;
+        }
+        if((fd = open(out_name, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1) {
+            dr_msg(st, DR_LOG_ERROR, "Will not overwrite file %s\n", out_name);
+            continue;
+        }
+
+        snprintf(request, sizeof(request), "RECOVER %s", paths[i]);
+        /* a file whose zones were reallocated meanwhile is kept, with its warning */
+        if((r = daemon_ask(st, conn, replies, request, fd, &size)) == OK || r == DR_ECHANGED) {
+            dr_msg(st, DR_LOG_INFO, "Written to file %s\n", out_name);
+            ++ recovered;
+        }
+        else {
+            dr_msg(st, DR_LOG_ERROR, "Recover of %s aborted: %s\n", paths[i], dr_strerror(r));
+            unlink(out_name);
+        }
+        close(fd);
+        if(r == DR_EIO)
+            break;
+    }
+
+    fclose(replies);
+    close(conn);
+    return(recovered);
+}
+
+/* daemon_ask(st, conn, replies, request, fd, &value)
+ *
+ *      send "request" on "conn", with the descriptor "fd" unless it
+ *      is -1, and pass on the messages of the reply read from
+ *      "replies". the value of an "OK" reply is put in "value".
+ *      its DR_E* code is returned if the request failed.
+ */
+int daemon_ask(st, conn, replies, request, fd, value)
+dr_state *st;
+int conn;
+FILE *replies;
+char *request;
+int fd;
+long long *value;
+{
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    char line[DAEMON_LINE];
+    struct cmsghdr *c;
+    struct msghdr m;
+    struct iovec v;
+    size_t len;
+
+    len = (size_t)snprintf(line, sizeof(line), "%s\n", request);
+    memset(&m, 0, sizeof(m));
+    v.iov_base = line;
+    v.iov_len = len;
+    m.msg_iov = &v;
+    m.msg_iovlen = 1;
+    if(fd != -1) {
+        m.msg_control = ctl.buf;
+        m.msg_controllen = sizeof(ctl.buf);
+        c = CMSG_FIRSTHDR(&m);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    }
+    if(sendmsg(conn, &m, 0) != (ssize_t)len) {
+        dr_msg(st, DR_LOG_ERROR, "Can not send the request to the daemon\n");
+        return DR_EIO;
+    }
+
+    while(fgets(line, sizeof(line), replies) != NULL) {
+        if(line[0] == '-' && line[1] == ' ')
+            dr_msg(st, DR_LOG_INFO, "%s", line + 2);
+        else if(line[0] == '!' && line[1] == ' ')
+            dr_msg(st, DR_LOG_ERROR, "%s", line + 2);
+        else if(sscanf(line, "OK %lld", value) == 1)
+            return OK;
+        else if(strncmp(line, "ERR ", 4) == 0)
+            return atoi(line + 4) < 0 ? atoi(line + 4) : DR_EFAIL;
+    }
+
+    dr_msg(st, DR_LOG_ERROR, "The daemon closed the connection\n");
+    return DR_EIO;
+}
@@ -0,0 +1,127 @@
+//
+//  dr_devidx.c
+//
+//      Index of the block devices in /dev by device number.
+//
+//      Finding the device that holds a file used to mean reading /dev
+//      and calling stat() on every node, for every file. The index is
+//      built once, sorted by device number, and then searched for the
+//      rest of the session.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <minix/config.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <string.h>
+#include <dirent.h>
+
+#include <minix/const.h>
+#include <minix/type.h>
+#include "mfs/const.h"
+
+#include "drecover.h"
+
+/* devidx_compare(a, b)
+ *
+ *      qsort() and bsearch() order of index entries
+ */
+int devidx_compare(a, b)
+const void *a;
+const void *b;
+{
+    dev_t x = ((const dr_devent *)a)->rdev;
+    dev_t y = ((const dr_devent *)b)->rdev;
+
+    return x < y ? -1 : x > y;
+}
+
+/* devidx_create()
+ *
+ *      index the block devices in DEV. NULL is returned if DEV
+ *      can not be read or there is not enough memory.
+ */
+dr_devidx *devidx_create(st)
+dr_state *st;
+{
+    dr_devidx *idx;
+    dr_devent *e;
+    struct dirent *entry;
+    struct stat dstat;
+    DIR *dir;
+    int slots = 0;
+
+    if((dir = opendir(DEV)) == NULL) {
+        dr_msg(st, DR_LOG_ERROR, "Can not read %s\n", DEV);
+        return(NULL);
+    }
+
+    if((idx = (dr_devidx *)calloc(1, sizeof(dr_devidx))) == NULL) {
+        closedir(dir);
+        return(NULL);
+    }
+
+    while((entry = readdir(dir)) != NULL) {
+        if(entry->d_name[0] == '.' || strlen(entry->d_name) > NAME_MAX)
+            continue;
+
+        if(idx->count == slots) {
+            slots = slots ? slots * 2 : 64;
+            if((e = (dr_devent *)realloc(idx->ents, slots * sizeof(dr_devent))) == NULL) {
+                closedir(dir);
+                devidx_destroy(idx);
+                return(NULL);
+            }
+            idx->ents = e;
+        }
+
+        e = &idx->ents[idx->count];
+        strcpy(e->name, DEV);
+        strcat(e->name, "/");
+        strcat(e->name, entry->d_name);
+
+        if(stat(e->name, &dstat) == -1 || (dstat.st_mode & S_IFMT) != S_IFBLK)
+            continue;
+
+        e->rdev = dstat.st_rdev;
+        ++ idx->count;
+    }
+
+    closedir(dir);
+
+    qsort(idx->ents, idx->count, sizeof(dr_devent), devidx_compare);
+    return(idx);
+}
+
+/* devidx_destroy(idx)
+ *
+ */
+void devidx_destroy(idx)
+dr_devidx *idx;
+{
+    if(idx == NULL)
+        return;
+
+    free(idx->ents);
+    free(idx);
+}
+
+/* devidx_lookup(idx, dev)
+ *
+ *      the name of block device "dev", NULL if it is not in the index
+ */
+char *devidx_lookup(idx, dev)
+dr_devidx *idx;
+dev_t dev;
+{
+    dr_devent key;
+    dr_devent *e;
+
+    key.rdev = dev;
+    if((e = (dr_devent *)bsearch(&key, idx->ents, idx->count, sizeof(dr_devent), devidx_compare)) == NULL)
+        return(NULL);
+
+    return(e->name);
+}
@@ -7,14 +7,20 @@
 //
 //
 
+#define _GNU_SOURCE                 /* copy_file_range(), O_DIRECT */
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <minix/config.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <limits.h>
 #include <string.h>
 #include <dirent.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include <minix/const.h>
 #include <minix/type.h>
@@ -26,31 +32,500 @@
 
 #include "drecover.h"
 
+/* dev_map(state)
+ *      map a device that is a regular file (a disk image) into
+ *      memory. blocks are then used in place instead of being
+ *      read. real block devices keep using pread().
+ */
+void dev_map(st)
+dr_state *st;
+{
+    struct stat dstat;
+    void *map;
+    
+    st->map = NULL;
+    
+    if(fstat(st->device_d, &dstat) == -1 || (dstat.st_mode & S_IFMT) != S_IFREG ||
+       dstat.st_size == 0 || (off_t)(size_t)dstat.st_size != dstat.st_size)
+        return;
+    
+    if((map = mmap(NULL, (size_t)dstat.st_size, PROT_READ, MAP_SHARED, st->device_d, 0)) == MAP_FAILED)
+        return;
+    
+    st->map = (char *)map;
+    st->map_size = dstat.st_size;
+}
+
+/* dev_unmap(state)
+ *
+ */
+void dev_unmap(st)
+dr_state *st;
+{
+    if(st->map != NULL)
+        munmap(st->map, (size_t)st->map_size);
+    st->map = NULL;
+}
+
+/* dev_open(state)
+ *      open the device. with st->uncached it is opened with
+ *      O_DIRECT, so what is read does not push the data of
+ *      everything else out of the page cache. where the file
+ *      system refuses O_DIRECT, the pages read are dropped
+ *      with posix_fadvise() instead, see dev_drop().
+ */
+int dev_open(st)
+dr_state *st;
+{
+    st->direct = DIRECT_NONE;
+    
+#ifdef O_DIRECT
+    if(st->uncached && (st->device_d = open(st->device_name, st->device_mode | O_DIRECT)) != -1) {
+        st->direct = DIRECT_IO;
+        return OK;
+    }
+#endif
+    
+    if((st->device_d = open(st->device_name, st->device_mode)) == -1)
+        return ERROR;
+    
+    if(st->uncached) {
+        st->direct = DIRECT_DROP;
+        dr_msg(st, DR_LOG_INFO, "Can not read %s with O_DIRECT, dropping what is read from the cache\n",
+               st->device_name);
+#ifdef POSIX_FADV_RANDOM
+        /* pages read ahead would not be dropped */
+        posix_fadvise(st->device_d, 0, 0, POSIX_FADV_RANDOM);
+#endif
+    }
+    return OK;
+}
+
+/* dev_alloc(size)
+ *      allocate a buffer of "size" bytes for reads from the
+ *      device, aligned for O_DIRECT. it is released with free().
+ *      NULL is returned if there is not enough memory.
+ */
+char *dev_alloc(size)
+size_t size;
+{
+    void *p;
+    
+    if(posix_memalign(&p, DIRECT_ALIGN, size) != 0)
+        return(NULL);
+    return (char *)p;
+}
+
+/* dev_aligned(state, addr, buffer, len)
+ *      non zero if a read of "len" bytes at "addr" into "buffer"
+ *      can be made as it is, which under O_DIRECT needs all
+ *      three aligned.
+ */
+int dev_aligned(st, addr, buffer, len)
+dr_state *st;
+off_t addr;
+char *buffer;
+size_t len;
+{
+    if(st->direct != DIRECT_IO)
+        return(1);
+    return (addr % DIRECT_ALIGN) == 0 && (len % DIRECT_ALIGN) == 0 &&
+           ((unsigned long)buffer % DIRECT_ALIGN) == 0;
+}
+
+/* dev_direct(state, addr, buffer, len)
+ *      read "len" bytes at "addr" into "buffer" under O_DIRECT
+ *      when they are not aligned for it: the aligned blocks
+ *      around them are read into st->bounce, a piece at a
+ *      time, and copied out.
+ *      ERROR is returned if the read fails.
+ */
+int dev_direct(st, addr, buffer, len)
+dr_state *st;
+off_t addr;
+char *buffer;
+size_t len;
+{
+    off_t start, end;
+    size_t n, skip;
+    
+    if(st->bounce == NULL && (st->bounce = dev_alloc(DIRECT_BOUNCE + 2 * DIRECT_ALIGN)) == NULL)
+        return ERROR;
+    
+    while(len > 0) {
+        n = len > DIRECT_BOUNCE ? DIRECT_BOUNCE : len;
+        skip = (size_t)(addr % DIRECT_ALIGN);
+        start = addr - (off_t)skip;
+        end = (addr + (off_t)n + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+        
+        /* the last piece of a device may end short of the alignment */
+        if(pread(st->device_d, st->bounce, (size_t)(end - start), start) < (ssize_t)(skip + n))
+            return ERROR;
+        memcpy(buffer, st->bounce + skip, n);
+        
+        addr += n;
+        buffer += n;
+        len -= n;
+    }
+    
+    return OK;
+}
+
+/* dev_drop(state, addr, len)
+ *      drop "len" bytes at "addr" from the page cache after they
+ *      were read, when the device could not be opened O_DIRECT.
+ *      the pages they start and end in are dropped whole, or the
+ *      kernel would keep them.
+ */
+void dev_drop(st, addr, len)
+dr_state *st;
+off_t addr;
+off_t len;
+{
+#ifdef POSIX_FADV_DONTNEED
+    off_t page = getpagesize();
+    off_t start = addr / page * page;
+    
+    /* a length of 0 would drop the whole device */
+    if(st->direct == DIRECT_DROP && len > 0)
+        posix_fadvise(st->device_d, start, (addr + len + page - 1) / page * page - start, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/* dev_read(state, addr, buffer, len)
+ *      read "len" bytes at "addr" straight from the device,
+ *      bypassing the block cache. the read is positional, so
+ *      the file offset of st->device_d is never used.
+ *      under O_DIRECT an unaligned read goes through dev_direct().
+ *      ERROR is returned if the read fails.
+ */
+int dev_read(st, addr, buffer, len)
+dr_state *st;
+off_t addr;
+char *buffer;
+size_t len;
+{
+    struct timeval start;
+    
+    if(st->map != NULL) {
+        if(addr < 0 || addr + (off_t)len > st->map_size) {
+            dr_msg(st, DR_LOG_INFO, "Error reading %s\n", st->device_name);
+            return ERROR;
+        }
+        throttle_wait(st, (off_t)len, &start);
+        memcpy(buffer, st->map + addr, len);
+        throttle_done(st, &start);
+        st->stats.bytes_read += len;
+        return OK;
+    }
+    
+    ++ st->stats.reads;
+    throttle_wait(st, (off_t)len, &start);
+    if(dev_aligned(st, addr, buffer, len) ? pread(st->device_d, buffer, len, addr) != (ssize_t)len
+                                          : dev_direct(st, addr, buffer, len) != OK) {
+        dr_msg(st, DR_LOG_INFO, "Error reading %s\n", st->device_name);
+        return ERROR;
+    }
+    throttle_done(st, &start);
+    dev_drop(st, addr, (off_t)len);
+    st->stats.bytes_read += len;
+    
+    return OK;
+}
+
+/* read_blocks(state, blocks, count, buffers)
+ *      read the "count" blocks numbered in "blocks" into
+ *      "buffers". runs of consecutive block numbers are
+ *      read with a single preadv(), or a single pread()
+ *      when their buffers are consecutive as well. under
+ *      O_DIRECT, a run with a buffer that is not aligned is
+ *      read a block at a time.
+ */
+int read_blocks(st, blocks, count, buffers)
+dr_state *st;
+zone_t *blocks;
+int count;
+char **buffers;
+{
+    int i, j, n;
+    int contig;
+#ifdef HAVE_PREADV
+    struct iovec iov[IOV_MAX];
+    struct timeval start;
+#endif
+    
+    for(i = 0; i < count; i += n) {
+        /* find the run starting at block i */
+        contig = 1;
+        for(n = 1; i + n < count && n < IOV_MAX && blocks[i + n] == blocks[i] + n; ++ n) {
+            if(buffers[i + n] != buffers[i] + n * st->block_size)
+                contig = 0;
+        }
+        
+        if(contig) {
+            if(dev_read(st, (off_t)blocks[i] * st->block_size, buffers[i], (size_t)n * st->block_size) != OK)
+                return ERROR;
+            continue;
+        }
+        
+#ifdef HAVE_PREADV
+        for(j = 0; j < n && dev_aligned(st, (off_t)(blocks[i] + j) * st->block_size,
+                                        buffers[i + j], st->block_size); ++ j) {
+            iov[j].iov_base = buffers[i + j];
+            iov[j].iov_len = st->block_size;
+        }
+        if(j == n) {
+            ++ st->stats.reads;
+            throttle_wait(st, (off_t)n * st->block_size, &start);
+            if(preadv(st->device_d, iov, n, (off_t)blocks[i] * st->block_size) != (ssize_t)n * st->block_size) {
+                dr_msg(st, DR_LOG_INFO, "Error reading %s\n", st->device_name);
+                return ERROR;
+            }
+            throttle_done(st, &start);
+            dev_drop(st, (off_t)blocks[i] * st->block_size, (off_t)n * st->block_size);
+            st->stats.bytes_read += (off_t)n * st->block_size;
+            continue;
+        }
+#endif
+        for(j = 0; j < n; ++ j) {
+            if(dev_read(st, (off_t)(blocks[i] + j) * st->block_size, buffers[i + j], st->block_size) != OK)
+                return ERROR;
+        }
+    }
+    
+    return OK;
+}
+
+/* copy_range(state, addr, len)
+ *      copy "len" bytes at "addr" on the device to the end
+ *      of the output file. when streaming into a pipe, the data
+ *      is spliced into it. a mapped device is handed to the
+ *      output writer straight from the mapping. otherwise, where
+ *      the kernel supports it, the data is copied with
+ *      copy_file_range() and never enters user space, or else
+ *      it is read into st->run in large chunks, which is also
+ *      the only way under O_DIRECT, as the kernel's copies
+ *      would go through the page cache. under a throttle
+ *      every way copies at most st->run_size per call.
+ */
+int copy_range(st, addr, len)
+dr_state *st;
+off_t addr;
+off_t len;
+{
+    size_t chunk;
+    ssize_t n;
+    struct timeval start;
+#ifdef HAVE_COPY_FILE_RANGE
+    loff_t in;
+    loff_t out;
+#endif
+#ifdef HAVE_SPLICE
+    loff_t from;
+    struct iovec iov;
+#endif
+    
+    if(st->map != NULL && (addr < 0 || addr + len > st->map_size))
+        return ERROR;
+    
+#ifdef HAVE_SPLICE
+    if(len > 0 && st->out.pipe && out_flush(st) != OK)
+        return ERROR;
+    while(len > 0 && st->out.pipe && st->direct != DIRECT_IO) {
+        chunk = (size_t)throttle_chunk(st, len);
+        throttle_wait(st, (off_t)chunk, &start);
+        if(st->map != NULL) {
+            /* the mapping is never written, so its pages can be lent */
+            iov.iov_base = st->map + addr;
+            iov.iov_len = chunk;
+            ++ st->stats.writes;
+            n = vmsplice(st->file_d, &iov, 1, 0);
+        }
+        else {
+            from = addr;
+            ++ st->stats.copies;
+            n = splice(st->device_d, &from, st->file_d, NULL, chunk, SPLICE_F_MORE);
+        }
+        if(n > 0) {
+            throttle_done(st, &start);
+            dev_drop(st, addr, (off_t)n);
+            st->stats.bytes_written += n;
+            st->out.pos += n;
+            addr += n;
+            len -= n;
+            continue;
+        }
+        if(n == 0 || (errno != EINVAL && errno != ENOSYS))
+            return ERROR;
+        
+        /* not for this device, write from now on */
+        st->out.pipe = 0;
+    }
+#endif
+    
+    while(st->map != NULL && len > 0) {
+        chunk = (size_t)throttle_chunk(st, len);
+        throttle_wait(st, (off_t)chunk, &start);
+        if(out_write(st, st->map + addr, (off_t)chunk) != OK)
+            return ERROR;
+        throttle_done(st, &start);
+        addr += chunk;
+        len -= chunk;
+    }
+    if(st->map != NULL)
+        return OK;
+    
+#ifdef HAVE_COPY_FILE_RANGE
+    in = addr;
+    if(len > 0 && !st->no_copy_range && !st->out.stream && st->direct != DIRECT_IO && out_flush(st) != OK)
+        return ERROR;
+    while(len > 0 && !st->no_copy_range && !st->out.stream && st->direct != DIRECT_IO) {
+        ++ st->stats.copies;
+        out = st->out.pos;
+        chunk = (size_t)throttle_chunk(st, len);
+        throttle_wait(st, (off_t)chunk, &start);
+        if((n = copy_file_range(st->device_d, &in, st->file_d, &out, chunk, 0)) > 0) {
+            throttle_done(st, &start);
+            dev_drop(st, in - n, (off_t)n);
+            st->stats.bytes_written += n;
+            st->out.pos = out;
+            if(st->out.written < out)
+                st->out.written = out;
+            len -= n;
+            continue;
+        }
+        if(n == 0 || (errno != EINVAL && errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP))
+            return ERROR;
+        
+        /* not for this device or output, use the copy loop from now on */
+        st->no_copy_range = 1;
+    }
+    addr = in;
+#endif
+    
+    if(len > 0 && st->run == NULL && (st->run = dev_alloc(st->run_size)) == NULL)
+        return ERROR;
+    
+    while(len > 0) {
+        chunk = len > (off_t)st->run_size ? st->run_size : (size_t)len;
+        if(dev_read(st, addr, st->run, chunk) != OK || out_write(st, st->run, (off_t)chunk) != OK)
+            return ERROR;
+        addr += chunk;
+        len -= chunk;
+    }
+    
+    return OK;
+}
+
+/* dev_prefetch(state, zones, count)
+ *      tell the kernel the first blocks of the "count" zones
+ *      numbered in "zones", e.g. indirect blocks, will be read
+ *      soon, so their reads are all issued at once. holes
+ *      (NO_ZONE) are skipped. this is only a hint, and it is
+ *      not given under a throttle, which the reads ahead would
+ *      get around, nor when reads are kept out of the cache.
+ */
+void dev_prefetch(st, zones, count)
+dr_state *st;
+zone_t *zones;
+int count;
+{
+    int i, n;
+    off_t addr, len;
+    
+    if(st->throttle != NULL || st->direct != DIRECT_NONE)
+        return;
+    
+    for(i = 0; i < count; i += n) {
+        for(n = 1; i + n < count && zones[i + n] == zones[i] + n; ++ n)
+            ;
+        if(zones[i] == NO_ZONE)
+            continue;
+        
+        addr = (off_t)zones[i] * st->zone_size;
+        len = (off_t)(n - 1) * st->zone_size + st->block_size;
+        if(st->map != NULL) {
+#ifdef MADV_WILLNEED
+            if(addr + len <= st->map_size)
+                madvise(st->map + (addr & ~((off_t)getpagesize() - 1)),
+                        (size_t)(addr & ((off_t)getpagesize() - 1)) + (size_t)len, MADV_WILLNEED);
+#endif
+            continue;
+        }
+#ifdef POSIX_FADV_WILLNEED
+        posix_fadvise(st->device_d, addr, len, POSIX_FADV_WILLNEED);
+#endif
+    }
+}
+
 /* read_disk(state, block_addr, buffer)
- *      read a 4K block at "block_addr" into buffer.
+ *      read a block at "block_addr" into buffer.
+ *      block aligned reads go through the block cache.
+ *      the block is returned, in place in the mapping if
+ *      the device is mapped, otherwise in "buffer".
+ *      NULL is returned if the read fails.
+ *      with a latency histogram every call is timed.
  */
-void read_disk(st, block_addr, buffer)
+char *read_disk(st, block_addr, buffer)
 dr_state *st;
 off_t block_addr;
 char *buffer;
 {
+    struct timeval start;
+    char *data;
+    
+    if(!st->stats.histogram)
+        return disk_block(st, block_addr, buffer);
+    
+    gettimeofday(&start, NULL);
+    data = disk_block(st, block_addr, buffer);
+    stats_latency(st, &start);
+    return(data);
+}
+
+/* disk_block(state, block_addr, buffer)
+ *      the work of read_disk()
+ */
+char *disk_block(st, block_addr, buffer)
+dr_state *st;
+off_t block_addr;
+char *buffer;
+{
+    zone_t block;
+    char *data;
+    
     //printf("RD: block_addr = %lu\nst->device_d = %d\nst->block_size = %d\n", block_addr, st->device_d, st->block_size);
     
-    if(lseek(st->device_d, block_addr, SEEK_SET) == -1) {
-        printf("Error seeking %s\n", st->device_name);
-        exit(1);
+    if(st->map != NULL) {
+        if(block_addr < 0 || block_addr + st->block_size > st->map_size) {
+            dr_msg(st, DR_LOG_INFO, "Error reading %s\n", st->device_name);
+            return(NULL);
+        }
+        return st->map + block_addr;
     }
-    if(read(st->device_d, buffer, st->block_size) != st->block_size) {
-        printf("Error reading %s\n", st->device_name);
-        exit(1);
+    
+    if(st->cache == NULL || block_addr % st->block_size != 0)
+        return dev_read(st, block_addr, buffer, st->block_size) == OK ? buffer : NULL;
+    
+    block = (zone_t)(block_addr / st->block_size);
+    if((data = cache_lookup(st->cache, block)) == NULL) {
+        data = cache_insert(st->cache, block);
+        if(dev_read(st, block_addr, data, st->block_size) != OK) {
+            cache_forget(st->cache, block);
+            return(NULL);
+        }
     }
+    memcpy(buffer, data, st->block_size);
+    return(buffer);
 }
 
 /* read_block(state, buffer)
- *      read a 4K block from st->address into buffer
+ *      read the block holding st->address into buffer
  *      checks address and updates blocks and offset
+ *      st->bp is set to the block, see read_disk()
+ *      NULL is returned if the read fails.
  */
-void read_block(st, buffer)
+char *read_block(st, buffer)
 dr_state *st;
 char *buffer;
 {
@@ -75,45 +550,44 @@ char *buffer;
     
     /* adjust address */
     st->address &= ~1L;
-    printf("Adjusted address is: %ld\n", st->address);
+    DR_TRACE(("Adjusted address is: %ld\n", st->address));
     
-    block_addr = st->address & K_MASK;
-    printf("Block address is %ld\n", block_addr);
+    block_addr = st->address - st->address % st->block_size;
+    DR_TRACE(("Block address is %ld\n", block_addr));
     
-    st->block = (zone_t)(block_addr >> K_SHIFT);
+    st->block = (zone_t)(block_addr / st->block_size);
     st->offset = (unsigned)(st->address - block_addr);
     
-    printf("current block: %u\n", st->block);
-    printf("offset is: %u\n", st->offset);
+    DR_TRACE(("current block: %u\n", st->block));
+    DR_TRACE(("offset is: %u\n", st->offset));
 
     //printf("block_addr = %ld\n", block_addr);
-    read_disk(st, block_addr, buffer);
+    return st->bp = read_disk(st, block_addr, buffer);
 }
 
 /* read_super_block(state, buffer)
  *      read and check super block
+ *      ERROR is returned if it is not a usable file system
  */
-void read_super_block(st)
+int read_super_block(st)
 dr_state *st;
 {
     struct super_block *super = (struct super_block *)st->sbuf;
     unsigned inodes_per_block;
     block_t offset;
+    int i;
     //off_t size;
     
-    st->block_size = K;
-    read_disk(st, (long) SUPER_BLOCK_BYTES, st->sbuf);
+    st->block_size = _MIN_BLOCK_SIZE;
+    if(dev_read(st, (long) SUPER_BLOCK_BYTES, st->sbuf, sizeof(st->sbuf)) != OK)
+        return ERROR;
     
     st->magic = super->s_magic;
     if(st->magic == SUPER_MAGIC) {
         st->is_fs = TRUE;
         st->v1 = TRUE;
-        st->inode_size = V1_INODE_SIZE;
-        inodes_per_block = V1_INODES_PER_BLOCK;
-        st->nr_indirects = V1_INDIRECTS;
-        st->zone_num_size = V1_ZONE_NUM_SIZE;
+        st->layout = &v1_layout;
         st->zones = super->s_nzones;
-        st->ndzones = V1_NR_DZONES;
         st->block_size = _STATIC_BLOCK_SIZE;
     }
     else if(st->magic == SUPER_V2 || st->magic == SUPER_V3) {
@@ -123,63 +597,86 @@ dr_state *st;
             st->block_size = _STATIC_BLOCK_SIZE;
         st->is_fs = TRUE;
         st->v1 = FALSE;
-        st->inode_size = V2_INODE_SIZE;
-        inodes_per_block = V2_INODES_PER_BLOCK(st->block_size);
-        st->nr_indirects = V2_INDIRECTS(st->block_size);
-        st->zone_num_size = V2_ZONE_NUM_SIZE;
+        st->layout = &v2_layout;
         st->zones = super->s_zones;
-        st->ndzones = V2_NR_DZONES;
     }
     else {
         if(super->s_magic == SUPER_REV)
-            printf("V1-bytes-swapped file system (?)\n");
+            dr_msg(st, DR_LOG_INFO, "V1-bytes-swapped file system (?)\n");
         else if (super->s_magic == SUPER_V2_REV)
-            printf("V2-bytes-swapped file system (?)\n");
+            dr_msg(st, DR_LOG_INFO, "V2-bytes-swapped file system (?)\n");
         else
-            printf("Not a Minix file system");
-        printf("The file system features will not be available\n");
+            dr_msg(st, DR_LOG_INFO, "Not a Minix file system");
+        dr_msg(st, DR_LOG_INFO, "The file system features will not be available\n");
         st->zones = 100000L;
-        return;
+        st->is_fs = FALSE;
+        return ERROR;
     }
     
+    if(st->block_size < _MIN_BLOCK_SIZE || st->block_size > MAX_BLOCK_SIZE ||
+       (st->block_size & (st->block_size - 1)) != 0) {
+        dr_msg(st, DR_LOG_ERROR, "Can not handle block size %d\n", st->block_size);
+        return ERROR;
+    }
+    
+    /* a zone is 2^s_log_zone_size blocks, read as one; the bound
+     * is checked before anything is shifted by it */
+    st->log_zone_size = super->s_log_zone_size;
+    for(i = 0; ((off_t)st->block_size << i) < MAX_ZONE_SIZE; ++ i)
+        ;
+    if(st->log_zone_size < 0 || st->log_zone_size > i) {
+        dr_msg(st, DR_LOG_ERROR, "Can not handle a log2 zone size of %d\n", st->log_zone_size);
+        return ERROR;
+    }
+    st->zone_size = (off_t)st->block_size << st->log_zone_size;
+    
+    /* the rest of the layout follows from the block size */
+    st->inode_size = st->layout->inode_size;
+    st->zone_num_size = st->layout->zone_num_size;
+    st->ndzones = st->layout->ndzones;
+    st->nr_indirects = st->block_size / st->zone_num_size;
+    inodes_per_block = st->block_size / st->inode_size;
+    
     st->inodes = super->s_ninodes;
     st->inode_maps = bitmapsize((bit_t)st->inodes + 1, st->block_size);
     
-    printf("s_block_size = %d\n", super->s_block_size);
-    printf("inodes_per_block = %d\n", inodes_per_block);
-    printf("st->inodes = %d\n", st->inodes);
-    printf("st->inode_maps = %d\n", st->inode_maps);
+    DR_TRACE(("s_block_size = %d\n", super->s_block_size));
+    DR_TRACE(("inodes_per_block = %d\n", inodes_per_block));
+    DR_TRACE(("st->inodes = %d\n", st->inodes));
+    DR_TRACE(("st->inode_maps = %d\n", st->inode_maps));
     
     if(st->inode_maps != super->s_imap_blocks) {
         if (st->inode_maps > super->s_imap_blocks) {
-            fprintf(stderr, "Corrupted inode map count or inode count in super block\n");
-            exit(1);
+            dr_msg(st, DR_LOG_ERROR, "Corrupted inode map count or inode count in super block\n");
+            return ERROR;
         }
         else
-            printf("Count of inode map blocks in super block suspiciously high\n");
+            dr_msg(st, DR_LOG_INFO, "Count of inode map blocks in super block suspiciously high\n");
         st->inode_maps = super->s_imap_blocks;
     }
     
     st->zone_maps = bitmapsize((bit_t)st->zones, st->block_size);
     
-    printf("st->zone_maps = %d\n", st->zone_maps);
+    DR_TRACE(("st->zone_maps = %d\n", st->zone_maps));
     
     if(st->zone_maps != super->s_zmap_blocks) {
         if(st->zone_maps > super->s_zmap_blocks) {
-            fprintf(stderr, "Corrupted zone map count or zone count in super block\n");
-            exit(1);
+            dr_msg(st, DR_LOG_ERROR, "Corrupted zone map count or zone count in super block\n");
+            return ERROR;
         }
         else
-            printf("Count of zone map blocks in super block suspiciously high\n");
+            dr_msg(st, DR_LOG_INFO, "Count of zone map blocks in super block suspiciously high\n");
         st->zone_maps = super->s_zmap_blocks;
     }
     
     st->inode_blocks = (st->inodes + inodes_per_block - 1) / inodes_per_block;
-    st->first_data = 2 + st->inode_maps + st->zone_maps + st->inode_blocks;
+    st->inode_start = START_BLOCK + st->inode_maps + st->zone_maps;
+    offset = st->inode_start + st->inode_blocks;
+    st->first_data = (offset + (1 << st->log_zone_size) - 1) >> st->log_zone_size;
     
-    printf("st->inode_blocks = %d\n", st->inode_blocks);
-    printf("st->first_data = %d\n", st->first_data);
-    printf("data zones = %u\n", ((super->s_zones - super->s_firstdatazone) << super->s_log_zone_size));
+    DR_TRACE(("st->inode_blocks = %d\n", st->inode_blocks));
+    DR_TRACE(("st->first_data = %d\n", st->first_data));
+    DR_TRACE(("data zones = %u\n", ((super->s_zones - super->s_firstdatazone) << super->s_log_zone_size)));
     //printf("super->s_firstdatazone_old = %d\n", super->s_firstdatazone_old);
     
     /* For even larger disks, a similar problem occurs with s_firstdatazone.
@@ -188,7 +685,7 @@ dr_state *st;
      */
     if (super->s_firstdatazone_old == 0) {
         offset = START_BLOCK + super->s_imap_blocks + super->s_zmap_blocks;
-        offset += (super->s_ninodes + super->s_inodes_per_block - 1) / super->s_inodes_per_block;
+        offset += (super->s_ninodes + inodes_per_block - 1) / inodes_per_block;
         
         super->s_firstdatazone = (offset + (1 << super->s_log_zone_size) - 1) >> super->s_log_zone_size;
     }
@@ -198,11 +695,11 @@ dr_state *st;
     
     if(st->first_data != super->s_firstdatazone) {
         if(st->first_data > super->s_firstdatazone) {
-            fprintf(stderr, "Corrupted first data zone offset or inode count in super block\n");
-            exit(1);
+            dr_msg(st, DR_LOG_ERROR, "Corrupted first data zone offset or inode count in super block\n");
+            return ERROR;
         }
         else
-            printf("First data zone in super block suspiciously high\n");
+            dr_msg(st, DR_LOG_INFO, "First data zone in super block suspiciously high\n");
         st->first_data = super->s_firstdatazone;
     }
     
@@ -216,37 +713,450 @@ dr_state *st;
      Warning( "Zone count does not equal device size" );
      */
     
-    st->device_size = st->zones;
+    st->device_size = st->zones << st->log_zone_size;
     
-    st->isearch = super->s_isearch;
-    st->zsearch = super->s_zsearch;
+    return OK;
+}
+
+/* read_bit_map(st)
+ *
+ *      set up the inode and zone bit maps of the specified
+ *      file system device. they are sized from the super block
+ *      and a map block is only read the first time map_chunk()
+ *      needs it, so small images cost little and large volumes
+ *      have no fixed limit.
+ *      ERROR is returned if there is not enough memory.
+ */
+int read_bit_map(st)
+dr_state *st;
+{
+    st->inode_map = (bitchunk_t *)dev_alloc((size_t)st->inode_maps * st->block_size);
+    st->zone_map = (bitchunk_t *)dev_alloc((size_t)st->zone_maps * st->block_size);
+    st->imap_loaded = (unsigned char *)calloc(st->inode_maps + 1, 1);
+    st->zmap_loaded = (unsigned char *)calloc(st->zone_maps + 1, 1);
     
-    if(super->s_log_zone_size != 0) {
-        fprintf(stderr, "Can not handle multiple blocks per zone\n");
-        exit(1);
+    if(st->inode_map == NULL || st->zone_map == NULL ||
+       st->imap_loaded == NULL || st->zmap_loaded == NULL) {
+        dr_msg(st, DR_LOG_INFO, "Not enough memory for %u bit map blocks\n", st->inode_maps + st->zone_maps);
+        return ERROR;
     }
+    
+    return OK;
 }
 
-/* read_bit_map(st)
+/* load_bit_map(st)
  *
- *      read in the inode and zone bit maps form the
- *      specified file system device.
+ *      read every map block not read yet, e.g. before the state
+ *      is shared with worker processes. the zone maps follow the
+ *      inode maps, so this is a single run of reads.
+ *      ERROR is returned if the read fails.
  */
-void read_bit_map(st)
+int load_bit_map(st)
 dr_state *st;
 {
+    zone_t *blocks;
+    char **buffers;
+    dr_timer t;
+    int n = 0;
     int i;
     
-    if(st->inode_maps > I_MAP_SLOTS || st->zone_maps > Z_MAP_SLOTS) {
-        printf("Super block specifies too many bit map blocks!\n");
-        return;
+    blocks = (zone_t *)malloc((st->inode_maps + st->zone_maps) * sizeof(zone_t));
+    buffers = (char **)malloc((st->inode_maps + st->zone_maps) * sizeof(char *));
+    if(blocks == NULL || buffers == NULL) {
+        free(blocks);
+        free(buffers);
+        return ERROR;
     }
     
     for(i = 0; i < st->inode_maps; ++ i) {
-        read_disk(st, (long)(2 + i) * K, (char *)&st->inode_map[i * K / sizeof (bitchunk_t)]);
+        if(st->imap_loaded[i])
+            continue;
+        blocks[n] = 2 + i;
+        buffers[n ++] = (char *)st->inode_map + (size_t)i * st->block_size;
     }
     
     for(i = 0; i < st->zone_maps; ++ i) {
-        read_disk(st, (long)(2 + st->inode_maps + i) * K, (char *)&st->zone_map[i * K / sizeof (bitchunk_t)]);
+        if(st->zmap_loaded[i])
+            continue;
+        blocks[n] = 2 + st->inode_maps + i;
+        buffers[n ++] = (char *)st->zone_map + (size_t)i * st->block_size;
+    }
+    
+    timer_start(&t);
+    if(read_blocks(st, blocks, n, buffers) == OK) {
+        memset(st->imap_loaded, 1, st->inode_maps);
+        memset(st->zmap_loaded, 1, st->zone_maps);
+        n = OK;
+    }
+    else
+        n = ERROR;
+    timer_stop(st, PH_MAPS, &t);
+    
+    free(blocks);
+    free(buffers);
+    return(n);
+}
+
+/* reload_bit_map(st, &inodes, &zones)
+ *
+ *      read the map blocks loaded so far again and take those that
+ *      changed on the device, putting the number of bits that
+ *      changed in each map in "inodes" and "zones". cached blocks of
+ *      the zones that changed are forgotten. a changed i-node means
+ *      a directory may have changed in place, so then the whole cache
+ *      is dropped.
+ *      ERROR is returned if a read fails.
+ */
+int reload_bit_map(st, inodes, zones)
+dr_state *st;
+long *inodes;
+long *zones;
+{
+    if((*inodes = map_reload(st, MAP_INODE)) == -1L ||
+       (*zones = map_reload(st, MAP_ZONE)) == -1L)
+        return ERROR;
+    
+    if(*inodes > 0 && st->cache != NULL)
+        cache_clear(st->cache);
+    return OK;
+}
+
+/* map_reload(st, mode)
+ *
+ *      the work of reload_bit_map() for one map. blocks are read
+ *      RUN_BLOCKS at a time into st->run and compared word by word.
+ *      the number of changed bits is returned, -1L on error.
+ */
+long map_reload(st, mode)
+dr_state *st;
+int mode;
+{
+    bit_t per_block = (bit_t)st->block_size * CHAR_BIT;
+    unsigned maps = mode == MAP_INODE ? st->inode_maps : st->zone_maps;
+    unsigned char *loaded = mode == MAP_INODE ? st->imap_loaded : st->zmap_loaded;
+    char *map = (char *)(mode == MAP_INODE ? st->inode_map : st->zone_map);
+    zone_t first = mode == MAP_INODE ? 2 : 2 + st->inode_maps;
+    uint64_t *old, *cur, diff;
+    long changed = 0;
+    unsigned b, i, n;
+    bit_t bit;
+    zone_t z, k;
+    int w;
+    
+    if(st->run == NULL && (st->run = dev_alloc(st->run_size)) == NULL)
+        return -1L;
+    
+    for(b = 0; b < maps; b += n) {
+        n = maps - b < RUN_BLOCKS ? maps - b : RUN_BLOCKS;
+        if(dev_read(st, (off_t)(first + b) * st->block_size, st->run, (size_t)n * st->block_size) != OK)
+            return -1L;
+        
+        for(i = 0; i < n; ++ i) {
+            old = (uint64_t *)(map + (size_t)(b + i) * st->block_size);
+            cur = (uint64_t *)(st->run + (size_t)i * st->block_size);
+            if(!loaded[b + i] || memcmp(old, cur, st->block_size) == 0)
+                continue;
+            
+            for(w = 0; w < st->block_size / 8; ++ w) {
+                if((diff = old[w] ^ cur[w]) == 0)
+                    continue;
+                changed += popcount(diff);
+                
+                /* the zone a changed bit stands for may hold new data */
+                for(; mode == MAP_ZONE && st->cache != NULL && diff != 0; diff &= diff - 1) {
+                    bit = (b + i) * per_block + (bit_t)w * 64 + popcount((diff & -diff) - 1);
+                    z = (zone_t)(bit + st->first_data - 1);
+                    for(k = 0; k < (zone_t)1 << st->log_zone_size; ++ k)
+                        cache_forget(st->cache, (z << st->log_zone_size) + k);
+                }
+            }
+            memcpy(old, cur, st->block_size);
+        }
     }
+    
+    return(changed);
+}
+
+/* map_reread(st, x, n)
+ *
+ *      read the zone map blocks holding the "n" extents from "x"
+ *      again, each once, taking them in as they are on the device.
+ *      ERROR is returned if a read fails.
+ */
+int map_reread(st, x, n)
+dr_state *st;
+dr_extent *x;
+int n;
+{
+    bit_t per_block = (bit_t)st->block_size * CHAR_BIT;
+    unsigned char *seen;
+    bit_t bit, b, last;
+    int r = OK;
+    int i;
+    
+    if((seen = (unsigned char *)calloc(st->zone_maps + 1, 1)) == NULL)
+        return ERROR;
+    
+    for(i = 0; i < n && r == OK; ++ i) {
+        if(x[i].start == NO_ZONE)
+            continue;
+        bit = (bit_t)(x[i].start - (st->first_data - 1));
+        last = (bit + x[i].length - 1) / per_block;
+        for(b = bit / per_block; b <= last && b < st->zone_maps; ++ b) {
+            if(seen[b])
+                continue;
+            seen[b] = 1;
+            if(dev_read(st, (off_t)(2 + st->inode_maps + b) * st->block_size,
+                        (char *)st->zone_map + (size_t)b * st->block_size, st->block_size) != OK) {
+                st->zmap_loaded[b] = 0;
+                r = ERROR;
+                break;
+            }
+            st->zmap_loaded[b] = 1;
+        }
+    }
+    
+    free(seen);
+    return(r);
+}
+
+/* map_chunk(st, mode, bit)
+ *
+ *      return the chunk of the inode map (mode == MAP_INODE) or
+ *      zone map (mode == MAP_ZONE) holding "bit", reading its map
+ *      block first if needed.
+ *      NULL is returned if "bit" is past the map or the read fails.
+ */
+bitchunk_t *map_chunk(st, mode, bit)
+dr_state *st;
+int mode;
+bit_t bit;
+{
+    bit_t b = bit / ((bit_t)st->block_size * CHAR_BIT);
+    bitchunk_t *map;
+    unsigned char *loaded;
+    zone_t first;
+    dr_timer t;
+    
+    if(mode == MAP_INODE) {
+        if(b >= st->inode_maps)
+            return(NULL);
+        map = st->inode_map;
+        loaded = st->imap_loaded;
+        first = 2;
+    }
+    else {
+        if(b >= st->zone_maps)
+            return(NULL);
+        map = st->zone_map;
+        loaded = st->zmap_loaded;
+        first = 2 + st->inode_maps;
+    }
+    
+    if(!loaded[b]) {
+        timer_start(&t);
+        if(dev_read(st, (off_t)(first + b) * st->block_size,
+                    (char *)map + (size_t)b * st->block_size, st->block_size) != OK)
+            return(NULL);
+        timer_stop(st, PH_MAPS, &t);
+        loaded[b] = 1;
+    }
+    
+    return &map[bit / BITCHUNK_BITS];
+}
+
+/* alloc_buffers(st)
+ *
+ *      allocate the work buffers for the block size read from
+ *      the super block.
+ *      ERROR is returned if there is not enough memory.
+ */
+int alloc_buffers(st)
+dr_state *st;
+{
+    st->buffer = dev_alloc(st->block_size);
+    st->indir = dev_alloc(2 * st->block_size);
+    st->ptrs = (zone_t *)malloc(2 * st->nr_indirects * sizeof(zone_t));
+    st->extents = (dr_extent *)malloc(st->nr_indirects * sizeof(dr_extent));
+    st->run = NULL;
+    st->run_size = (size_t)RUN_BLOCKS * st->block_size;
+    
+    if(st->buffer == NULL || st->indir == NULL || st->ptrs == NULL || st->extents == NULL) {
+        dr_msg(st, DR_LOG_INFO, "Not enough memory for block size %d\n", st->block_size);
+        return ERROR;
+    }
+    
+    return OK;
+}
+
+/* free_buffers(st)
+ *
+ *      release the bit maps and work buffers
+ */
+void free_buffers(st)
+dr_state *st;
+{
+    free(st->inode_map);
+    free(st->zone_map);
+    free(st->imap_loaded);
+    free(st->zmap_loaded);
+    free(st->buffer);
+    free(st->indir);
+    free(st->ptrs);
+    free(st->extents);
+    free(st->run);
+    free(st->bounce);
+    free(st->copied);
+    out_free(st);
+    
+    st->inode_map = st->zone_map = NULL;
+    st->imap_loaded = st->zmap_loaded = NULL;
+    st->buffer = st->indir = st->run = st->bounce = NULL;
+    st->ptrs = NULL;
+    st->extents = NULL;
+    st->copied = NULL;
+    st->ncopied = st->copied_slots = 0;
+}
+
+/* dev_sync(st)
+ *
+ *      flush what was written to the device and is not on it yet,
+ *      so the super block and maps read next are current. only this
+ *      device is flushed: its own buffers with fsync(), and the file
+ *      system mounted from it, if st->sync_dir is on it, with syncfs().
+ *      an image file is read through the page cache and needs neither.
+ */
+void dev_sync(st)
+dr_state *st;
+{
+    struct stat dstat;
+#ifdef HAVE_SYNCFS
+    int fd;
+#endif
+    
+    if(fstat(st->device_d, &dstat) == -1 || !S_ISBLK(dstat.st_mode))
+        return;
+    
+#ifdef HAVE_SYNCFS
+    if(st->sync_dir != NULL && (fd = open(st->sync_dir, O_RDONLY)) != -1) {
+        syncfs(fd);
+        close(fd);
+    }
+#endif
+    fsync(st->device_d);
+}
+
+/* open_device(st)
+ *
+ *      open the device named by st->device_name, read its super
+ *      block and bit maps. this is done once per batch.
+ *      DR_EOPEN, DR_ENOTFS, DR_ECATALOG or DR_ENOMEM is returned
+ *      on failure.
+ */
+int open_device(st)
+dr_state *st;
+{
+    struct stat device_stat;
+    dr_timer t;
+    off_t size;
+    
+    DR_TRACE(("device_name: %s\n", st->device_name));
+    
+    /* open the device file */
+    if(stat(st->device_name, &device_stat) == -1) {
+        dr_msg(st, DR_LOG_ERROR, "Can not find file %s\n", st->device_name);
+        return DR_EOPEN;
+    }
+    
+    /*if((device_stat.st_mode & S_IFMT) != S_IFBLK &&
+       (device_stat.st_mode & S_IFMT) != S_IFREG) {
+        dr_msg(st, DR_LOG_ERROR, "Can only edit block special or regular files.\n");
+        exit(1);
+    }*/
+    
+    if(dev_open(st) != OK) {
+        dr_msg(st, DR_LOG_ERROR, "Can not open %s\n", st->device_name);
+        return DR_EOPEN;
+    }
+    
+    DR_TRACE(("device %s has been opened, st->device_d = %d\n", st->device_name, st->device_d));
+    
+    /* disk images are used in place through a mapping, which is
+     * made of page cache pages */
+    if(!st->no_map && st->direct == DIRECT_NONE)
+        dev_map(st);
+    
+    if((size = lseek(st->device_d, 0L, SEEK_END)) == -1) {
+        dr_msg(st, DR_LOG_ERROR, "Error seeking %s\n", st->device_name);
+        close_device(st);
+        return DR_EOPEN;
+    }
+    
+    /* initialize the rest of state record */
+    dev_sync(st);
+    
+    DR_TRACE(("Read super block...\n"));
+    timer_start(&t);
+    if(read_super_block(st) != OK) {
+        close_device(st);
+        return DR_ENOTFS;
+    }
+    timer_stop(st, PH_SUPER, &t);
+    
+    if(st->catalog != NULL && catalog_check(st) != OK) {
+        close_device(st);
+        return DR_ECATALOG;
+    }
+    
+    if(size % st->block_size != 0) {
+        dr_msg(st, DR_LOG_INFO, "Device size is not a multiple of %d\n", st->block_size);
+        dr_msg(st, DR_LOG_INFO, "The (partial) last block will not be accessible\n");
+    }
+    
+    if(alloc_buffers(st) != OK || read_bit_map(st) != OK) {
+        close_device(st);
+        return DR_ENOMEM;
+    }
+    st->address = 0L;
+    st->no_copy_range = 0;
+    
+    /* metadata reads go through a block cache for the rest of the session */
+    if(st->map == NULL && st->cache_blocks > 0 && (st->cache = cache_create(st->cache_blocks, st->block_size)) == NULL)
+        dr_msg(st, DR_LOG_INFO, "Not enough memory for a %d block cache, continuing without\n", st->cache_blocks);
+    
+    /* keep several data reads in flight; a mapped image needs no reads,
+     * and under O_DIRECT zones must be aligned for them */
+    if(st->map == NULL && st->queue_depth > 1 && st->direct == DIRECT_IO && st->block_size % DIRECT_ALIGN != 0)
+        dr_msg(st, DR_LOG_INFO, "Blocks of %d bytes can not be read asynchronously with O_DIRECT\n", st->block_size);
+    else if(st->map == NULL && st->queue_depth > 1 &&
+            (st->async = async_create(st->queue_depth, st->run_size)) == NULL)
+        dr_msg(st, DR_LOG_INFO, "Asynchronous I/O not available, reading synchronously\n");
+    
+    return OK;
+}
+
+/* close_device(st)
+ *
+ *      close the device and drop its cached blocks
+ */
+void close_device(st)
+dr_state *st;
+{
+    dev_unmap(st);
+    
+    if(st->device_d != -1)
+        close(st->device_d);
+    st->device_d = -1;
+    
+    if(st->cache != NULL) {
+        st->stats.cache_hits += st->cache->hits;
+        st->stats.cache_misses += st->cache->misses;
+    }
+    cache_destroy(st->cache);
+    st->cache = NULL;
+    
+    async_destroy(st->async);
+    st->async = NULL;
+    
+    free_buffers(st);
 }
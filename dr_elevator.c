@@ -0,0 +1,546 @@
+//
+//  dr_elevator.c
+//
+//      Recovery of a batch in disk order.
+//
+//      Copying each file in logical order, through its indirect
+//      blocks, sends a disk back and forth over a fragmented volume.
+//      With -e the whole map of every file of the batch is collected
+//      first: the i-nodes and indirect blocks are read, or the extents
+//      taken from the catalog, and cut into pieces of contiguous
+//      zones. The pieces of all the files are then sorted by zone and
+//      copied in one sweep up the disk, each written at its offset in
+//      its file. Pieces that follow on in the same file are appended
+//      in the output buffer as usual.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <minix/config.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <minix/const.h>
+#include <minix/type.h>
+#include "mfs/const.h"
+
+#include "drecover.h"
+
+/* elevator_batch(st, count, paths, sizes, secs)
+ *
+ *      recover "paths" in disk order, putting the size recovered
+ *      for each in "sizes", -1L on failure, and the time it was
+ *      done in "secs". paths on another device than the one before
+ *      are swept separately.
+ */
+int elevator_batch(st, count, paths, sizes, secs)
+dr_state *st;
+int count;
+char **paths;
+off_t *sizes;
+double *secs;
+{
+    dr_elevator el;
+    int i;
+
+    memset(&el, 0, sizeof(el));
+    gettimeofday(&el.start, NULL);
+
+    for(i = 0; i < count; ++ i)
+        sizes[i] = -1L;
+
+    for(i = 0; i < count; ++ i) {
+        if(elevator_device(st, &el, paths[i], sizes, secs) != OK ||
+           elevator_add(st, &el, paths[i], i) != OK)
+            dr_msg(st, DR_LOG_ERROR, "Recover of %s aborted!\n", paths[i]);
+    }
+    elevator_sweep(st, &el, sizes, secs);
+
+    free(el.files);
+    free(el.pieces);
+    return OK;
+}
+
+/* elevator_device(st, el, path, sizes, secs)
+ *
+ *      set up the device holding "path" as batch_device() does. if
+ *      it is not the open device, what is queued for that device
+ *      is copied first.
+ */
+int elevator_device(st, el, path, sizes, secs)
+dr_state *st;
+dr_elevator *el;
+char *path;
+off_t *sizes;
+double *secs;
+{
+    char dir_name[MAX_STRING + 1];
+    char file_name[MAX_STRING + 1];
+    char dev[DEV_NAME_MAX + 1];
+
+    if(st->device_path == NULL && st->device_d != -1 && el->nfiles > 0 &&
+       split_dir_file(st, path, dir_name, file_name) && file_device(st, dir_name, dev) != NULL &&
+       strcmp(dev, st->device_buf) != 0)
+        elevator_sweep(st, el, sizes, secs);
+
+    return batch_device(st, path);
+}
+
+/* elevator_add(st, el, path, index)
+ *
+ *      queue the deleted file "path", the "index"th of the batch,
+ *      naming its output as recover_file() does. ERROR is returned
+ *      if nothing could be queued for it.
+ */
+int elevator_add(st, el, path, index)
+dr_state *st;
+dr_elevator *el;
+char *path;
+int index;
+{
+    char dir_name[MAX_STRING + 1];
+    char file_name[MAX_STRING + 1];
+    char name[MAX_STRING + 1];
+    ino_t inodes[DEL_MATCHES];
+    dr_cat_ent *ents[DEL_MATCHES];
+    dr_timer t;
+    int count, added = 0;
+    int i, f, n, r, queued;
+
+    if(!split_dir_file(st, path, dir_name, file_name)) {
+        dr_msg(st, DR_LOG_ERROR, "Path name error!\n");
+        return ERROR;
+    }
+
+    timer_start(&t);
+    if(st->catalog != NULL)
+        count = catalog_find(st, st->catalog, path, ents, DEL_MATCHES);
+    else
+        count = find_del_entry(st, path, inodes, DEL_MATCHES);
+    timer_stop(st, PH_DIR, &t);
+
+    for(i = 0; i < count; ++ i) {
+        if(st->catalog != NULL)
+            inodes[i] = (ino_t)ents[i]->inode;
+
+        if(i == 0)
+            n = snprintf(name, sizeof(name), "%s/%s", st->out_dir, file_name);
+        else
+            n = snprintf(name, sizeof(name), "%s/%s.%lu", st->out_dir, file_name, (unsigned long)inodes[i]);
+        if(n >= (int)sizeof(name)) {
+            dr_msg(st, DR_LOG_ERROR, "Output file name for %s too long\n", path);
+            continue;
+        }
+
+        if((f = elevator_file(st, el, name, index)) == -1)
+            continue;
+
+        queued = el->npieces;
+        timer_start(&t);
+        r = st->catalog != NULL ? elevator_entry(st, el, f, ents[i]) : elevator_inode(st, el, f, inodes[i]);
+        timer_stop(st, PH_INODE, &t);
+
+        /* the file is dropped along with any of its pieces */
+        if(r != OK) {
+            -- el->nfiles;
+            el->npieces = queued;
+        }
+        else
+            ++ added;
+    }
+
+    return added > 0 ? OK : ERROR;
+}
+
+/* elevator_file(st, el, name, index)
+ *
+ *      add an output file "name" for the "index"th path. it is
+ *      created when its first piece is copied. return its number,
+ *      -1 on error.
+ */
+int elevator_file(st, el, name, index)
+dr_state *st;
+dr_elevator *el;
+char *name;
+int index;
+{
+    dr_elev_file *f;
+
+    if(access(name, F_OK) == 0) {
+        dr_msg(st, DR_LOG_ERROR, "Will not overwrite file %s\n", name);
+        return(-1);
+    }
+
+    if(catalog_grow(st, (void **)&el->files, &el->file_slots, el->nfiles + 1, sizeof(dr_elev_file)) != OK)
+        return(-1);
+
+    f = &el->files[el->nfiles];
+    memset(f, 0, sizeof(dr_elev_file));
+    strcpy(f->name, name);
+    f->fd = -1;
+    f->index = index;
+    return el->nfiles ++;
+}
+
+/* elevator_inode(st, el, file, inode)
+ *
+ *      queue the zones of the deleted i-node "inode" for "file".
+ *      the i-node and its zones must be free.
+ */
+int elevator_inode(st, el, file, inode)
+dr_state *st;
+dr_elevator *el;
+int file;
+ino_t inode;
+{
+    zone_t *zones;
+    dr_extent *x;
+    off_t size;
+    int count, n;
+    int r = ERROR;
+
+    st->address = inode_addr(st, inode);
+    if(read_block(st, st->buffer) == NULL) {
+        dr_msg(st, DR_LOG_ERROR, "Recover aborted: can not read i-node!\n");
+        return ERROR;
+    }
+
+    if(in_use((bit_t)inode, st, MAP_INODE)) {
+        dr_msg(st, DR_LOG_INFO, "i-node is in use\n");
+        return ERROR;
+    }
+
+    if((count = inode_zones(st, inode, &zones, &size)) == -1)
+        return ERROR;
+
+    if((x = (dr_extent *)malloc((count + 1) * sizeof(dr_extent))) == NULL)
+        dr_msg(st, DR_LOG_INFO, "Not enough memory for %d zones\n", count);
+    else if((n = zone_extents(st, zones, count, x)) != -1) {
+        el->files[file].size = size;
+        r = elevator_extents(st, el, file, x, n);
+    }
+
+    free(x);
+    free(zones);
+    return(r);
+}
+
+/* elevator_entry(st, el, file, e)
+ *
+ *      queue the extents of catalog entry "e" for "file". its zones
+ *      must still be free.
+ */
+int elevator_entry(st, el, file, e)
+dr_state *st;
+dr_elevator *el;
+int file;
+dr_cat_ent *e;
+{
+    dr_extent *x = st->catalog->exts + e->extent;
+    uint32_t i;
+
+    if(e->state != CAT_OK) {
+        dr_msg(st, DR_LOG_ERROR, "Recover aborted: i-node %lu was not free when cataloged\n", (unsigned long)e->inode);
+        return ERROR;
+    }
+
+    /* the indirect zones follow the data */
+    for(i = 0; i < e->count + e->indirects; ++ i) {
+        if(x[i].start != NO_ZONE &&
+           !range_free(st, MAP_ZONE, (bit_t)(x[i].start - (st->first_data - 1)), (bit_t)x[i].length)) {
+            dr_msg(st, DR_LOG_ERROR, "Recover aborted: zones of i-node %lu are in use now\n", (unsigned long)e->inode);
+            return ERROR;
+        }
+    }
+
+    el->files[file].size = (off_t)e->size;
+    return elevator_extents(st, el, file, x, (int)e->count);
+}
+
+/* elevator_extents(st, el, file, x, n)
+ *
+ *      queue a piece for each of the "n" extents "x" of "file", up
+ *      to its size. holes are left to be made by its final length.
+ */
+int elevator_extents(st, el, file, x, n)
+dr_state *st;
+dr_elevator *el;
+int file;
+dr_extent *x;
+int n;
+{
+    off_t size = el->files[file].size;
+    off_t off = 0, len;
+    dr_elev_piece *p;
+    int i;
+
+    for(i = 0; i < n && off < size; ++ i) {
+        len = (off_t)x[i].length * st->zone_size;
+        if(len > size - off)
+            len = size - off;
+
+        if(x[i].start == NO_ZONE)
+            st->stats.holes += x[i].length;
+        else {
+            if(catalog_grow(st, (void **)&el->pieces, &el->piece_slots, el->npieces + 1, sizeof(dr_elev_piece)) != OK)
+                return ERROR;
+            p = &el->pieces[el->npieces ++];
+            p->zone = x[i].start;
+            p->file = file;
+            p->offset = off;
+            p->len = len;
+            st->stats.blocks += x[i].length;
+        }
+        off += len;
+    }
+
+    return OK;
+}
+
+/* elevator_sweep(st, el, sizes, secs)
+ *
+ *      copy the queued pieces in zone order, closing each file
+ *      after its last piece, and empty the queue. no more than
+ *      ELEV_OPEN files are open at once, see elevator_open().
+ */
+void elevator_sweep(st, el, sizes, secs)
+dr_state *st;
+dr_elevator *el;
+off_t *sizes;
+double *secs;
+{
+    dr_elev_piece *p;
+    dr_elev_file *f;
+    dr_timer t;
+    int cur = -1;
+    int i;
+
+    timer_start(&t);
+    qsort(el->pieces, el->npieces, sizeof(dr_elev_piece), piece_compare);
+
+    for(i = 0; i < el->nfiles; ++ i)
+        el->files[i].last = -1;
+    for(i = 0; i < el->npieces; ++ i)
+        el->files[el->pieces[i].file].last = i;
+
+    for(i = 0; i < el->npieces; ++ i) {
+        p = &el->pieces[i];
+        f = &el->files[p->file];
+        if(f->failed)
+            continue;
+
+        /* a piece carrying on where the one before ended is just appended */
+        if(p->file != cur || st->out.pos + (off_t)st->out.fill != p->offset) {
+            if(cur != -1 && out_flush(st) != OK)
+                el->files[cur].failed = 1;
+            st->out.fill = 0;
+            cur = -1;
+
+            if(elevator_open(st, el, f, i) != OK) {
+                f->failed = 1;
+                continue;
+            }
+
+            cur = p->file;
+            st->file_d = f->fd;
+            st->out.pos = p->offset;
+        }
+
+        f->used = i;
+        if(copy_range(st, (off_t)p->zone * st->zone_size, p->len) != OK) {
+            dr_msg(st, DR_LOG_INFO, "Problem writing %s\n", f->name);
+            f->failed = 1;
+        }
+        else if(i == f->last && out_flush(st) != OK)
+            f->failed = 1;
+
+        if(f->failed || i == f->last) {
+            st->out.fill = 0;
+            cur = -1;
+            elevator_finish(st, el, f, sizes, secs);
+        }
+    }
+
+    /* the files without a piece, all holes or empty */
+    for(i = 0; i < el->nfiles; ++ i)
+        elevator_finish(st, el, &el->files[i], sizes, secs);
+    
+    elevator_verify(st, el);
+
+    el->nfiles = 0;
+    el->npieces = 0;
+    el->nopen = 0;
+    st->file_d = -1;
+    timer_stop(st, PH_COPY, &t);
+}
+
+/* elevator_open(st, el, f, piece)
+ *
+ *      open the output file "f" for its piece "piece", creating it
+ *      on its first piece. a sweep keeps at most ELEV_OPEN files
+ *      open: to make room the one written longest ago is closed,
+ *      and opened again when its next piece comes.
+ */
+int elevator_open(st, el, f, piece)
+dr_state *st;
+dr_elevator *el;
+dr_elev_file *f;
+int piece;
+{
+    dr_elev_file *g, *old = NULL;
+    int i;
+
+    if(f->fd != -1)
+        return OK;
+
+    if(el->nopen >= ELEV_OPEN) {
+        for(i = 0; i < el->nfiles; ++ i) {
+            g = &el->files[i];
+            if(g->fd != -1 && (old == NULL || g->used < old->used))
+                old = g;
+        }
+        if(old != NULL) {
+            if(close(old->fd) == -1)
+                old->failed = 1;
+            old->fd = -1;
+            -- el->nopen;
+        }
+    }
+
+    if(!f->created) {
+        strcpy(st->file_name, f->name);
+        if(out_open(st) != OK)
+            return ERROR;
+        f->created = 1;
+        f->fd = st->file_d;
+        out_prealloc(st, f->size);
+    }
+    else if((f->fd = open(f->name, O_WRONLY)) == -1) {
+        dr_msg(st, DR_LOG_ERROR, "Can not open file %s\n", f->name);
+        return ERROR;
+    }
+
+    ++ el->nopen;
+    f->used = piece;
+    return OK;
+}
+
+/* elevator_verify(st, el)
+ *
+ *      read the zone map again for all the pieces copied, once for
+ *      the sweep, and flag the files that had a zone reallocated
+ *      meanwhile, as copy_verify() does for a single file
+ */
+void elevator_verify(st, el)
+dr_state *st;
+dr_elevator *el;
+{
+    dr_elev_piece *p;
+    dr_elev_file *f;
+    dr_extent *x;
+    int i, n = 0;
+    int r;
+
+    if((x = (dr_extent *)malloc((el->npieces + 1) * sizeof(dr_extent))) == NULL) {
+        dr_msg(st, DR_LOG_ERROR, "Not enough memory to check the zones copied\n");
+        return;
+    }
+
+    for(i = 0; i < el->npieces; ++ i) {
+        p = &el->pieces[i];
+        if(el->files[p->file].failed)
+            continue;
+        x[n].start = p->zone;
+        x[n ++].length = (zone_t)((p->len + st->zone_size - 1) / st->zone_size);
+    }
+
+    r = map_reread(st, x, n);
+    for(i = 0, n = 0; i < el->npieces; ++ i) {
+        f = &el->files[el->pieces[i].file];
+        if(f->failed)
+            continue;
+        if(r != OK || !extents_free(st, &x[n], 1))
+            f->changed = 1;
+        ++ n;
+    }
+    free(x);
+
+    for(i = 0; i < el->nfiles; ++ i) {
+        f = &el->files[i];
+        if(!f->changed)
+            continue;
+        ++ st->stats.reallocated;
+        dr_msg(st, DR_LOG_ERROR, "Warning: zones of %s were reallocated while it was recovered, "
+               "it may hold other data\n", f->name);
+    }
+}
+
+/* elevator_finish(st, el, f, sizes, secs)
+ *
+ *      give the output file "f" its full length and close it, or
+ *      remove it if it failed.
+ */
+void elevator_finish(st, el, f, sizes, secs)
+dr_state *st;
+dr_elevator *el;
+dr_elev_file *f;
+off_t *sizes;
+double *secs;
+{
+    if(f->done)
+        return;
+    f->done = 1;
+
+    /* a file without a piece is created here, one closed to make
+     * room opened again */
+    if(!f->failed && f->fd == -1 && elevator_open(st, el, f, f->used) != OK) {
+        if(!f->created)
+            return;
+        f->failed = 1;
+    }
+
+    if(!f->failed && ftruncate(f->fd, f->size) == -1) {
+        dr_msg(st, DR_LOG_ERROR, "Problem writing %s\n", f->name);
+        f->failed = 1;
+    }
+
+    if(f->fd != -1) {
+        if(close(f->fd) == -1)
+            f->failed = 1;
+        f->fd = -1;
+        -- el->nopen;
+    }
+
+    if(f->failed) {
+        if(f->created)
+            unlink(f->name);
+        dr_msg(st, DR_LOG_ERROR, "Recover aborted: recover block error!\n");
+        return;
+    }
+
+    if(sizes[f->index] == -1L)
+        sizes[f->index] = 0;
+    sizes[f->index] += f->size;
+    secs[f->index] = time_since(&el->start);
+    dr_msg(st, DR_LOG_INFO, "Recovered %ld bytes, written to file %s\n", f->size, f->name);
+}
+
+/* piece_compare(a, b)
+ *
+ *      qsort(3) order of two pieces, by zone
+ */
+int piece_compare(a, b)
+const void *a;
+const void *b;
+{
+    const dr_elev_piece *x = (const dr_elev_piece *)a;
+    const dr_elev_piece *y = (const dr_elev_piece *)b;
+
+    if(x->zone != y->zone)
+        return x->zone < y->zone ? -1 : 1;
+    return x->file - y->file;
+}
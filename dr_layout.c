@@ -0,0 +1,72 @@
+//
+//  dr_layout.c
+//
+//      On-disk layouts of the file system versions.
+//
+//      V1 has 32 byte i-nodes and 16 bit zone numbers, V2 and V3 have
+//      64 byte i-nodes and 32 bit zone numbers. The code that depends
+//      on this, decoding an i-node and the pointers of an indirect
+//      block, is generated once for each layout by LAYOUT(), so its
+//      loops have a fixed element type and no test of the version.
+//      read_super_block() picks the layout of the device once, and
+//      the rest of the code calls through st->layout.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <minix/config.h>
+#include <sys/types.h>
+#include <string.h>
+#include <dirent.h>
+#include <minix/const.h>
+#include <minix/type.h>
+#include "mfs/const.h"
+#include "mfs/type.h"
+
+#include "drecover.h"
+
+/* LAYOUT(v, d, dinode, znum, nzones)
+ *
+ *      v_inode() and v_ptrs() for i-nodes of type "dinode", with
+ *      fields prefixed "d" and "nzones" zone numbers of type "znum".
+ */
+#define LAYOUT(v, d, dinode, znum, nzones)                                  \
+void v##_inode(p, ip)                                                       \
+char *p;                                                                    \
+dr_inode *ip;                                                               \
+{                                                                           \
+    dinode di;                                                              \
+    int i;                                                                  \
+                                                                            \
+    memcpy(&di, p, sizeof(di));                                             \
+    ip->mode = di.d##_mode;                                                 \
+    ip->size = di.d##_size;                                                 \
+    ip->mtime = di.d##_mtime;                                               \
+    for(i = 0; i < nzones; ++ i)                                            \
+        ip->zone[i] = di.d##_zone[i];                                       \
+    for(; i < V2_NR_TZONES; ++ i)                                           \
+        ip->zone[i] = NO_ZONE;                                              \
+}                                                                           \
+                                                                            \
+void v##_ptrs(bp, zones, count)                                             \
+char *bp;                                                                   \
+zone_t *zones;                                                              \
+int count;                                                                  \
+{                                                                           \
+    znum *p = (znum *)bp;                                                   \
+    int i;                                                                  \
+                                                                            \
+    for(i = 0; i < count; ++ i)                                             \
+        zones[i] = p[i];                                                    \
+}
+
+LAYOUT(v1, d1, d1_inode, zone1_t, V1_NR_TZONES)
+LAYOUT(v2, d2, d2_inode, zone_t, V2_NR_TZONES)
+
+dr_layout v1_layout = {
+    "V1", V1_INODE_SIZE, V1_ZONE_NUM_SIZE, V1_NR_DZONES, v1_inode, v1_ptrs
+};
+
+dr_layout v2_layout = {
+    "V2", V2_INODE_SIZE, V2_ZONE_NUM_SIZE, V2_NR_DZONES, v2_inode, v2_ptrs
+};
@@ -0,0 +1,310 @@
+//
+//  dr_lib.c
+//
+//      The library interface of libdrecover.h, and the messages.
+//
+//      A handle is a dr_state of its own, so the code under it is the
+//      code the command runs. Messages go through dr_msg(): the command
+//      prints them, a program using the library gets them through its
+//      log callback or not at all.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <minix/config.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <dirent.h>
+
+#include <minix/const.h>
+#include <minix/type.h>
+#include "mfs/const.h"
+
+#include "drecover.h"
+
+/* dr_msg(st, level, fmt, ...)
+ *
+ *      pass a message to the log callback of "st", or print it,
+ *      errors to stderr and the rest to stdout.
+ */
+void dr_msg(dr_state *st, int level, char *fmt, ...)
+{
+    char buf[PATH_MAX + MAX_STRING];
+    va_list ap;
+    size_t len;
+
+    va_start(ap, fmt);
+    if(st->log != NULL) {
+        vsnprintf(buf, sizeof(buf), fmt, ap);
+        len = strlen(buf);
+        if(len > 0 && buf[len - 1] == '\n')
+            buf[len - 1] = '\0';
+        st->log(st->log_arg, level, buf);
+    }
+    else if(!st->quiet)
+        vfprintf(level == DR_LOG_ERROR ? stderr : stdout, fmt, ap);
+    va_end(ap);
+}
+
+/* dr_open(device, log, log_arg, &h)
+ *
+ *      open "device" read-only into a new handle
+ */
+int dr_open(device, log, log_arg, h)
+const char *device;
+dr_log_fn log;
+void *log_arg;
+dr_handle **h;
+{
+    dr_state *st;
+    int r;
+
+    if(h == NULL)
+        return DR_EINVAL;
+    *h = NULL;
+    if(device == NULL)
+        return DR_EINVAL;
+
+    if((st = (dr_state *)calloc(1, sizeof(dr_state))) == NULL)
+        return DR_ENOMEM;
+    if((st->device_path = strdup(device)) == NULL) {
+        free(st);
+        return DR_ENOMEM;
+    }
+    st->device_name = st->device_path;
+    st->device_d = -1;
+    st->file_d = -1;
+    st->device_mode = O_RDONLY;
+    st->cache_blocks = CACHE_BLOCKS;
+    st->queue_depth = 1;
+    st->out_dir = TMP;
+    st->log = log;
+    st->log_arg = log_arg;
+    st->quiet = log == NULL;
+
+    if((r = open_device(st)) != OK) {
+        free(st->device_path);
+        free(st);
+        return r;
+    }
+
+    *h = st;
+    return DR_OK;
+}
+
+/* dr_use_catalog(h, catalog)
+ *
+ *      take the deleted entries from the catalog file "catalog",
+ *      which must have been written for this device
+ */
+int dr_use_catalog(h, catalog)
+dr_handle *h;
+const char *catalog;
+{
+    dr_catalog *cat;
+
+    if(h == NULL || catalog == NULL)
+        return DR_EINVAL;
+    if((cat = catalog_read(h, (char *)catalog)) == NULL)
+        return DR_ECATALOG;
+
+    catalog_free(h->catalog);
+    free(h->entries);
+    h->entries = NULL;
+    h->catalog = cat;
+
+    if(catalog_check(h) != OK) {
+        catalog_free(h->catalog);
+        h->catalog = NULL;
+        return DR_ECATALOG;
+    }
+    return DR_OK;
+}
+
+/* lib_entries(st)
+ *
+ *      the dr_entry array of the catalog of "st". its paths point
+ *      into the names of the catalog.
+ */
+int lib_entries(st)
+dr_state *st;
+{
+    dr_catalog *cat = st->catalog;
+    dr_cat_ent *e;
+    dr_entry *d;
+    uint32_t i;
+
+    if((st->entries = (dr_entry *)calloc(cat->head.entries + 1, sizeof(dr_entry))) == NULL)
+        return ERROR;
+
+    for(i = 0; i < cat->head.entries; ++ i) {
+        e = &cat->ents[i];
+        d = &st->entries[i];
+        d->path = cat->names + e->path;
+        d->inode = e->inode;
+        d->parent = e->parent;
+        d->size = e->size;
+        d->mode = e->mode;
+        d->mtime = (long)e->mtime;
+        d->state = e->state;
+    }
+    return OK;
+}
+
+/* dr_list(h, &entries, &count)
+ *
+ *      the deleted entries of the device, cataloged on the first call
+ *      unless a catalog file is in use
+ */
+int dr_list(h, entries, count)
+dr_handle *h;
+const dr_entry **entries;
+int *count;
+{
+    dr_catalog *cat;
+
+    if(h == NULL || entries == NULL || count == NULL)
+        return DR_EINVAL;
+
+    if(h->catalog == NULL) {
+        if((cat = (dr_catalog *)calloc(1, sizeof(dr_catalog))) == NULL)
+            return DR_ENOMEM;
+        if(catalog_build(h, cat) != OK) {
+            catalog_free(cat);
+            return DR_EIO;
+        }
+        h->catalog = cat;
+    }
+
+    if(h->entries == NULL && lib_entries(h) != OK)
+        return DR_ENOMEM;
+
+    *entries = h->entries;
+    *count = (int)h->catalog->head.entries;
+    return DR_OK;
+}
+
+/* dr_find(h, path, &index)
+ *
+ *      the index of the first entry for "path"
+ */
+int dr_find(h, path, index)
+dr_handle *h;
+const char *path;
+int *index;
+{
+    const dr_entry *entries;
+    dr_cat_ent *found;
+    int count;
+    int r;
+
+    if(path == NULL || index == NULL)
+        return DR_EINVAL;
+    if((r = dr_list(h, &entries, &count)) != DR_OK)
+        return r;
+
+    if(catalog_find(h, h->catalog, (char *)path, &found, 1) == 0)
+        return DR_ENOENT;
+    *index = (int)(found - h->catalog->ents);
+    return DR_OK;
+}
+
+/* dr_recover(h, index, fd, &size)
+ *
+ *      stream the file of entry "index" to "fd"
+ */
+int dr_recover(h, index, fd, size)
+dr_handle *h;
+int index;
+int fd;
+long long *size;
+{
+    dr_cat_ent *e;
+    off_t file_size;
+    int r;
+
+    if(h == NULL || h->catalog == NULL || index < 0 || (uint32_t)index >= h->catalog->head.entries)
+        return DR_EINVAL;
+    if(out_fd(h, fd) != OK)
+        return DR_EINVAL;
+
+    /* for the messages */
+    e = &h->catalog->ents[index];
+    snprintf(h->file_name, sizeof(h->file_name), "%s", h->catalog->names + e->path);
+
+    r = catalog_recover(h, e, &file_size);
+    h->out.stream = 0;
+    h->out.pipe = 0;
+
+    if((r == OK || r == DR_ECHANGED) && size != NULL)
+        *size = (long long)file_size;
+    return r;
+}
+
+/* dr_set_throttle(h, bytes, reads, latency_ms)
+ *
+ *      limit the rate of reads of "h", or stop limiting it
+ */
+int dr_set_throttle(h, bytes, reads, latency_ms)
+dr_handle *h;
+double bytes;
+double reads;
+double latency_ms;
+{
+    if(h == NULL || bytes < 0 || reads < 0 || latency_ms < 0)
+        return DR_EINVAL;
+
+    throttle_destroy(h->throttle);
+    h->throttle = NULL;
+    if(bytes == 0 && reads == 0 && latency_ms == 0)
+        return DR_OK;
+    if((h->throttle = throttle_create(bytes, reads, latency_ms / 1000)) == NULL)
+        return DR_ENOMEM;
+    return DR_OK;
+}
+
+/* dr_close(h)
+ *
+ *      close the device and free everything of "h"
+ */
+void dr_close(h)
+dr_handle *h;
+{
+    if(h == NULL)
+        return;
+
+    close_device(h);
+    out_free(h);
+    catalog_free(h->catalog);
+    free(h->entries);
+    devidx_destroy(h->devidx);
+    throttle_destroy(h->throttle);
+    free(h->device_path);
+    free(h);
+}
+
+/* dr_strerror(err)
+ *
+ *      a message for the error code "err"
+ */
+const char *dr_strerror(err)
+int err;
+{
+    switch(err) {
+        case DR_OK:         return "Success";
+        case DR_ENOMEM:     return "Out of memory";
+        case DR_EOPEN:      return "Device can not be opened";
+        case DR_ENOTFS:     return "Not a usable file system";
+        case DR_EIO:        return "Read or write error";
+        case DR_ENOENT:     return "No such deleted entry";
+        case DR_EINUSE:     return "The i-node or zones are in use again";
+        case DR_EINVAL:     return "Invalid argument";
+        case DR_ECATALOG:   return "Catalog damaged or of another device";
+        case DR_ECHANGED:   return "Zones were reallocated while the file was recovered";
+        default:            return "Recovery failed";
+    }
+}
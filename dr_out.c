@@ -0,0 +1,384 @@
+//
+//  dr_out.c
+//
+//      Writer for recovered files.
+//
+//      Data is gathered in a large aligned buffer and written with
+//      pwrite() at its offset, so small extents cost no more system
+//      calls than large ones. Holes, and data blocks that are all
+//      zero, only move the offset and are left as holes in the
+//      output; a hole at the end of the file is made with
+//      ftruncate(). Output files can be preallocated to their final
+//      size so they are not fragmented.
+//
+//      With -O the output is a stream instead: stdout or another open
+//      descriptor, written in order with holes filled with zeros. If
+//      it is a pipe, copy_range() splices data into it without copying.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <minix/config.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <dirent.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <minix/const.h>
+#include <minix/type.h>
+#include "mfs/const.h"
+
+#include "drecover.h"
+
+/* zero_block(p, len)
+ *
+ *      are the "len" bytes at "p" all zero? 64 bytes are tested at
+ *      a time with SSE2, so data is given up on at its first line.
+ */
+int zero_block(p, len)
+char *p;
+size_t len;
+{
+    uint64_t w;
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i v;
+
+    for(; i + 64 <= len; i += 64) {
+        v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((__m128i *)(p + i)),
+                                      _mm_loadu_si128((__m128i *)(p + i + 16))),
+                         _mm_or_si128(_mm_loadu_si128((__m128i *)(p + i + 32)),
+                                      _mm_loadu_si128((__m128i *)(p + i + 48))));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff)
+            return(0);
+    }
+#endif
+    for(; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(&w, p + i, sizeof(w));
+        if(w != 0)
+            return(0);
+    }
+    for(; i < len; ++ i) {
+        if(p[i] != 0)
+            return(0);
+    }
+
+    return(1);
+}
+
+/* out_stream(st, name)
+ *
+ *      stream recovered files to the open descriptor "name", or
+ *      to stdout if "name" is "-". when that is stdout, messages
+ *      are sent to stderr instead so they do not mix with the data.
+ */
+int out_stream(st, name)
+dr_state *st;
+char *name;
+{
+    char *end;
+    long fd = STDOUT_FILENO;
+
+    if(strcmp(name, "-") != 0) {
+        fd = strtol(name, &end, 10);
+        if(*name == '\0' || *end != '\0' || fd < 0 || fd > INT_MAX)
+            fd = -1;
+    }
+
+    if(fd == -1 || out_fd(st, (int)fd) != OK) {
+        dr_msg(st, DR_LOG_ERROR, "Can not stream to descriptor %s\n", name);
+        return ERROR;
+    }
+
+    if(fd == STDOUT_FILENO) {
+        fflush(stdout);
+        if((fd = dup(STDOUT_FILENO)) == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+            dr_msg(st, DR_LOG_ERROR, "Can not stream to stdout\n");
+            return ERROR;
+        }
+        st->out.stream_fd = fd;
+    }
+    return OK;
+}
+
+/* out_fd(st, fd)
+ *
+ *      stream recovered files to the open descriptor "fd", which
+ *      must be open for writing.
+ */
+int out_fd(st, fd)
+dr_state *st;
+int fd;
+{
+    dr_out *o = &st->out;
+    struct stat fd_stat;
+    int flags;
+
+    if(fstat(fd, &fd_stat) == -1 || (flags = fcntl(fd, F_GETFL)) == -1 || (flags & O_ACCMODE) == O_RDONLY)
+        return ERROR;
+
+    o->stream = 1;
+    o->stream_fd = fd;
+    o->pipe = S_ISFIFO(fd_stat.st_mode);
+    return OK;
+}
+
+/* out_open(st)
+ *
+ *      create st->file_name for a recovered file. it must not
+ *      exist already. when streaming, the file goes to the stream.
+ */
+int out_open(st)
+dr_state *st;
+{
+    dr_out *o = &st->out;
+
+    if(o->buf == NULL && posix_memalign((void **)&o->buf, OUT_ALIGN, OUT_BYTES) != 0) {
+        o->buf = NULL;
+        dr_msg(st, DR_LOG_ERROR, "Out of memory\n");
+        return ERROR;
+    }
+
+    if(o->stream)
+        st->file_d = o->stream_fd;
+    else if((st->file_d = open(st->file_name, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1) {
+        dr_msg(st, DR_LOG_ERROR, "Can not open file %s\n", st->file_name);
+        return ERROR;
+    }
+
+    o->fill = 0;
+    o->pos = 0;
+    o->written = 0;
+    return OK;
+}
+
+/* out_prealloc(st, size)
+ *
+ *      with -a, allocate "size" bytes for the output file at once.
+ *      this is only a hint; holes in it will read as zeros.
+ */
+void out_prealloc(st, size)
+dr_state *st;
+off_t size;
+{
+    if(st->prealloc && !st->out.stream && size > 0 && posix_fallocate(st->file_d, 0, size) == 0)
+        st->out.written = size;
+}
+
+/* out_put(st, data, len)
+ *
+ *      write "len" bytes at the output offset, or to the stream,
+ *      where a write may take only part of them.
+ */
+int out_put(st, data, len)
+dr_state *st;
+char *data;
+size_t len;
+{
+    dr_out *o = &st->out;
+    ssize_t n;
+
+    while(len > 0) {
+        ++ st->stats.writes;
+        if(o->stream)
+            n = write(st->file_d, data, len);
+        else
+            n = pwrite(st->file_d, data, len, o->pos);
+        if(n <= 0)
+            return ERROR;
+
+        st->stats.bytes_written += n;
+        o->pos += n;
+        data += n;
+        len -= n;
+    }
+
+    if(o->written < o->pos)
+        o->written = o->pos;
+    return OK;
+}
+
+/* out_flush(st)
+ *
+ *      write out the buffer
+ */
+int out_flush(st)
+dr_state *st;
+{
+    dr_out *o = &st->out;
+    size_t fill = o->fill;
+
+    if(fill == 0)
+        return OK;
+
+    o->fill = 0;
+    return out_put(st, o->buf, fill);
+}
+
+/* out_hole(st, len)
+ *
+ *      leave a hole of "len" bytes. a stream can not have holes,
+ *      so zeros are written to it. a negative length is an error.
+ */
+int out_hole(st, len)
+dr_state *st;
+off_t len;
+{
+    dr_out *o = &st->out;
+    size_t n;
+
+    if(len < 0 || out_flush(st) != OK)
+        return ERROR;
+
+    if(!o->stream) {
+        o->pos += len;
+        return OK;
+    }
+
+    memset(o->buf, 0, len < OUT_BYTES ? (size_t)len : OUT_BYTES);
+    for(; len > 0; len -= n) {
+        n = len < OUT_BYTES ? (size_t)len : OUT_BYTES;
+        if(out_put(st, o->buf, n) != OK)
+            return ERROR;
+    }
+
+    return OK;
+}
+
+/* out_data(st, data, len)
+ *
+ *      append "len" bytes, at most OUT_BYTES, of non zero data.
+ *      a full buffer of data is written from where it is, without
+ *      copying it.
+ */
+int out_data(st, data, len)
+dr_state *st;
+char *data;
+size_t len;
+{
+    dr_out *o = &st->out;
+
+    if(o->fill + len > OUT_BYTES && out_flush(st) != OK)
+        return ERROR;
+
+    if(o->fill == 0 && len == OUT_BYTES)
+        return out_put(st, data, len);
+
+    memcpy(o->buf + o->fill, data, len);
+    o->fill += len;
+    return o->fill == OUT_BYTES ? out_flush(st) : OK;
+}
+
+/* out_write(st, data, len)
+ *
+ *      append "len" bytes at "data" to the output file. blocks of
+ *      zeros become holes, except in a stream.
+ */
+int out_write(st, data, len)
+dr_state *st;
+char *data;
+off_t len;
+{
+    size_t bs = (size_t)st->block_size;
+    size_t run, n;
+
+    for(; len > 0 && st->out.stream; len -= run) {
+        run = len < OUT_BYTES ? (size_t)len : OUT_BYTES;
+        if(out_data(st, data, run) != OK)
+            return ERROR;
+        data += run;
+    }
+
+    while(len > 0) {
+        /* a run of zero blocks */
+        for(run = 0; run < (size_t)len; run += n) {
+            n = (size_t)len - run < bs ? (size_t)len - run : bs;
+            if(!zero_block(data + run, n))
+                break;
+        }
+        if(run > 0) {
+            if(out_hole(st, (off_t)run) != OK)
+                return ERROR;
+            data += run;
+            len -= run;
+            continue;
+        }
+
+        /* then a run of data blocks, up to a buffer full */
+        for(run = 0; run < (size_t)len && run < OUT_BYTES; run += n) {
+            n = (size_t)len - run < bs ? (size_t)len - run : bs;
+            if(run + n > OUT_BYTES)
+                n = OUT_BYTES - run;
+            if(run > 0 && zero_block(data + run, n))
+                break;
+        }
+        if(out_data(st, data, run) != OK)
+            return ERROR;
+        data += run;
+        len -= run;
+    }
+
+    return OK;
+}
+
+/* out_close(st)
+ *
+ *      finish the output file. if it ends in a hole, it is
+ *      extended to its full size. a stream is left open.
+ */
+int out_close(st)
+dr_state *st;
+{
+    dr_out *o = &st->out;
+    int r = OK;
+
+    if(out_flush(st) != OK)
+        r = ERROR;
+
+    /* the descriptor of a stream belongs to the caller */
+    if(o->stream) {
+        st->file_d = -1;
+        return(r);
+    }
+
+    if(r == OK && o->pos > o->written && ftruncate(st->file_d, o->pos) == -1)
+        r = ERROR;
+
+    if(close(st->file_d) == -1)
+        r = ERROR;
+
+    st->file_d = -1;
+    return(r);
+}
+
+/* out_abort(st)
+ *
+ *      remove a partly written output file. what went into a
+ *      stream can not be taken back.
+ */
+void out_abort(st)
+dr_state *st;
+{
+    if(!st->out.stream) {
+        close(st->file_d);
+        unlink(st->file_name);
+    }
+    st->file_d = -1;
+    st->out.fill = 0;
+}
+
+/* out_free(st)
+ *
+ */
+void out_free(st)
+dr_state *st;
+{
+    free(st->out.buf);
+    st->out.buf = NULL;
+}
@@ -30,17 +30,22 @@
 #include "drecover.h"
 
 /* split_dir_file()
- *      split "path_name" into a directory name and a file name
+ *      split "path_name" into a directory name and a file name,
+ *      both buffers of MAX_STRING + 1 bytes supplied by the caller
  *      0 is returned on error conditions
  */
-int split_dir_file(path_name, dir_name, file_name)
+int split_dir_file(st, path_name, directory, filename)
+dr_state *st;
 char *path_name;
-char **dir_name;
-char **file_name;
+char *directory;
+char *filename;
 {
     char *p;
-    static char directory[MAX_STRING + 1];
-    static char filename[MAX_STRING + 1];
+    
+    if(strlen(path_name) > MAX_STRING) {
+        dr_msg(st, DR_LOG_ERROR, "Path name too long!\n");
+        return(0);
+    }
     
     if((p = strrchr(path_name, '/')) == NULL) {
         strcpy(directory, ".");
@@ -56,172 +61,504 @@ char **file_name;
         strcpy(directory, "/");
     
     if(*filename == '\0') {
-        fprintf(stderr, "A file name must follow the directory name!\n");
+        dr_msg(st, DR_LOG_ERROR, "A file name must follow the directory name!\n");
         return(0);
     }
     
-    *dir_name = directory;
-    *file_name = filename;
-    
     return(1);
 }
 
-/* file_device(file_name)
+/* file_device(st, file_name, device_name)
  *
  *      return the name of the file system device containing the file.
  *      we have only been given a file name and need to determine which
- *      file system device to open.
+ *      file system device to open. the name is built in "device_name",
+ *      a buffer of DEV_NAME_MAX + 1 bytes supplied by the caller.
+ *      the devices are looked up in an index of DEV built on first
+ *      use and kept in "st".
  *
  *      NULL is returned on error conditions.
  */
-char *file_device(file_name)
+char *file_device(st, file_name, device_name)
+dr_state *st;
 char *file_name;
+char *device_name;
 {
     struct stat fstat;
-    struct stat dstat;
-    int dev_d;
-    struct direct entry;
-    static char device_name[NAME_MAX + 1];
+    char *name;
     
     if(access(file_name, R_OK) != 0) {
-        fprintf(stderr, "Can not find %s\n", file_name);
+        dr_msg(st, DR_LOG_ERROR, "Can not find %s\n", file_name);
         return(NULL);
     }
     
     if(stat(file_name, &fstat) == -1) {
-        fprintf(stderr, "Can not stat %s\n", file_name);
+        dr_msg(st, DR_LOG_ERROR, "Can not stat %s\n", file_name);
         return(NULL);
     }
     
-    /* open /dev for reading */
-    if((dev_d = open(DEV, O_RDONLY)) == -1) {
-        fprintf(stderr, "Can not read %s", DEV);
+    if(st->devidx == NULL && (st->devidx = devidx_create(st)) == NULL)
         return(NULL);
-    }
     
-    while(read(dev_d, (char *)&entry, sizeof(struct direct)) == sizeof(struct direct)) {
-        if(entry.mfs_d_ino == 0)
-            continue;
-        
-        strcpy(device_name, DEV);
-        strcat(device_name, "/");
-        strncat(device_name, entry.mfs_d_name, NAME_MAX);
-        
-        //printf("construct device_name: %s\n", device_name);
-        
-        if(stat(device_name, &dstat) == -1) {
-            fprintf(stderr, "device name: %s cannot be stated!\n", device_name);
-            continue;
-        }
-        
-        if((dstat.st_mode & S_IFMT) != S_IFBLK) {
-            continue;
-        }
-        
-        if(fstat.st_dev == dstat.st_rdev) {
-            close(dev_d);
-            return(device_name);
-        }
+    if((name = devidx_lookup(st->devidx, fstat.st_dev)) == NULL) {
+        dr_msg(st, DR_LOG_ERROR, "The device containing file %s is not in %s\n", file_name, DEV);
+        return(NULL);
     }
     
-    close(dev_d);
-    
-    //printf("device number that contain the file is: %d\n", fstat.st_dev);
-    
-    fprintf(stderr, "The device containing file %s is not in %s", file_name, DEV);
-    return(NULL);
+    strcpy(device_name, name);
+    return(device_name);
 }
 
-/* find_del_entry(st, path_name)
+/* find_del_entry(st, path_name, inodes, max)
  *
  *      step 1. split "path_name" into a directory name and a file name
- *      step 2. search the directory for a entry that would match the file name
+ *      step 2. search the directory for entries that would match the file name
  *      note: deleted entries have a zero i-node number, but original i-node number
  *      is placed at the end od the file name
- *      return i-node number iff successfully find the entry
- *      else return 0
+ *      the directory blocks are read straight from the device, so a
+ *      name deleted more than once is found every time. up to "max"
+ *      i-node numbers are put in "inodes".
+ *      return the number of matching entries, 0 if there are none
  */
 
-ino_t find_del_entry(st, path_name)
+int find_del_entry(st, path_name, inodes, max)
 dr_state *st;
 char *path_name;
+ino_t *inodes;
+int max;
 {
-    char *dir_name;
-    char *file_name;
+    char dir_name[MAX_STRING + 1];
+    char file_name[MAX_STRING + 1];
     
     ino_t dir_ino;
-    struct stat dir_stat;
     
-    int dir_d;
+    zone_t *zones;
+    off_t size;
     int count;
-    struct direct entry;
+    int found;
     
-    ino_t inode;                    /* inode for the demaged file */
+    /* split the path_name into a directory and a file name */
+    if(!split_dir_file(st, path_name, dir_name, file_name)) {
+        dr_msg(st, DR_LOG_ERROR, "File path: %s error!\n", path_name);
+        return 0;
+    }
     
-    /* check if the file exist */
-    if(access(path_name, F_OK) == 0) {
-        printf("File has not been damaged!\n");
-        //return 0;
+    DR_TRACE(("File path: %s build OK!\n", path_name));
+    
+    /* the i-node number is kept in the last bytes of the name */
+    if(strlen(file_name) > MFS_DIRSIZ - sizeof(u32_t)) {
+        dr_msg(st, DR_LOG_INFO, "File name %s is too long to be recovered\n", file_name);
+        return 0;
     }
     
-    /* split the path_name into a directory and a file name */
-    if(!split_dir_file(path_name, &dir_name, &file_name)) {
-        fprintf(stderr, "File path: %s error!\n", path_name);
+    /* a device given on the command line need not be mounted */
+    if(st->device_path != NULL) {
+        if((dir_ino = path_inode(st, dir_name)) == 0)
+            return 0;
+    }
+    else if((dir_ino = mounted_dir(st, path_name, dir_name)) == 0)
+        return 0;
+    
+    DR_TRACE(("Corresponding inode to the directory %s is %ld\n", dir_name, dir_ino));
+    
+    /* search the blocks of the directory for the lost file name */
+    if((count = inode_zones(st, dir_ino, &zones, &size)) == -1) {
+        dr_msg(st, DR_LOG_INFO, "Error reading directory %s\n", dir_name);
         return 0;
     }
     
-    printf("File path: %s build OK!\n", path_name);
+    found = scan_dir(st, zones, count, size, file_name, 1, inodes, max);
+    free(zones);
+    
+    if(found == 0)
+        dr_msg(st, DR_LOG_INFO, "Cannot find a damaged entry for %s\n", file_name);
+    return found;
+}
+
+/* mounted_dir(st, path_name, dir_name)
+ *
+ *      the i-node number of directory "dir_name" of the mounted
+ *      device, 0 if it is not on the device.
+ */
+ino_t mounted_dir(st, path_name, dir_name)
+dr_state *st;
+char *path_name;
+char *dir_name;
+{
+    struct stat dir_stat;
+    ino_t dir_ino;
+    
+    /* check if the file exist */
+    if(access(path_name, F_OK) == 0) {
+        dr_msg(st, DR_LOG_INFO, "File has not been damaged!\n");
+        //return 0;
+    }
     
     /* check to make sure that the directory can be accessed */
     if(access(dir_name, R_OK) != 0) {
-        printf("Cannot access directory: %s\n", dir_name);
+        dr_msg(st, DR_LOG_INFO, "Cannot access directory: %s\n", dir_name);
         return 0;
     }
     
     /* make sure "dir_name" is really a directory */
     if(stat(dir_name, &dir_stat) == -1 || (dir_stat.st_mode & S_IFMT) != S_IFDIR) {
-        printf("Cannot find directory: %s\n", dir_name);
+        dr_msg(st, DR_LOG_INFO, "Cannot find directory: %s\n", dir_name);
         return 0;
     }
     
     /* make sure the directory is on the current file system device */
     if((dir_ino = find_inode(st, dir_name)) == 0) {
-        printf("Directory: %s cannot be found on the device!\n", dir_name);
+        dr_msg(st, DR_LOG_INFO, "Directory: %s cannot be found on the device!\n", dir_name);
         return 0;
     }
     
-    printf("Path: %s check finished! OK!\n", path_name);
-    printf("Corresponding inode to the directory %s is %ld\n", dir_name, dir_ino);
+    DR_TRACE(("Path: %s check finished! OK!\n", path_name));
+    return dir_ino;
+}
+
+/* path_inode(st, path_name)
+ *
+ *      the i-node number of "path_name", looked up on the device
+ *      itself from the root directory, 0 if it is not found.
+ */
+ino_t path_inode(st, path_name)
+dr_state *st;
+char *path_name;
+{
+    char name[MAX_STRING + 1];
+    char *p, *q;
+    ino_t inode = ROOT_INODE;
+    ino_t found;
+    zone_t *zones;
+    off_t size;
+    int count;
     
-    /* open the directory and search for the lost file name */
-    if((dir_d = open(dir_name, O_RDONLY)) == -1) {
-        printf("Cannot read directory %s\n", dir_name);
-        return 0;
+    strncpy(name, path_name, MAX_STRING);
+    name[MAX_STRING] = '\0';
+    
+    for(p = strtok_r(name, "/", &q); p != NULL; p = strtok_r(NULL, "/", &q)) {
+        if((count = inode_zones(st, inode, &zones, &size)) == -1)
+            return 0;
+        
+        found = 0;
+        if(strlen(p) > MFS_DIRSIZ || scan_dir(st, zones, count, size, p, 0, &found, 1) == 0) {
+            dr_msg(st, DR_LOG_INFO, "Cannot find %s in %s on %s\n", p, path_name, st->device_name);
+            free(zones);
+            return 0;
+        }
+        free(zones);
+        inode = found;
+    }
+    
+    return inode;
+}
+
+/* scan_dir(st, zones, count, size, file_name, deleted, inodes, max)
+ *
+ *      look for entries named "file_name", deleted ones if "deleted"
+ *      is non zero, in the "size" bytes of directory held in the
+ *      "count" zones of "zones". the blocks of the zones are read
+ *      RUN_BLOCKS at a time. return the number of i-node numbers put
+ *      in "inodes", at most "max".
+ */
+int scan_dir(st, zones, count, size, file_name, deleted, inodes, max)
+dr_state *st;
+zone_t *zones;
+int count;
+off_t size;
+char *file_name;
+int deleted;
+ino_t *inodes;
+int max;
+{
+    zone_t blocks[RUN_BLOCKS];
+    char *buffers[RUN_BLOCKS];
+    uint64_t key, mask;
+    int per_zone = 1 << st->log_zone_size;
+    int total = count * per_zone;
+    zone_t zone;
+    int entries;
+    int found = 0;
+    int i, j, n;
+    
+    if(st->run == NULL && (st->run = dev_alloc(st->run_size)) == NULL) {
+        dr_msg(st, DR_LOG_INFO, "Not enough memory to read directory\n");
+        return(0);
+    }
+    
+    entry_key(file_name, deleted, &key, &mask);
+    
+    for(i = 0; i < total && size > 0 && found < max; i += RUN_BLOCKS) {
+        /* read the next batch of directory blocks, skipping holes */
+        for(j = n = 0; j < RUN_BLOCKS && i + j < total; ++ j) {
+            if((zone = zones[(i + j) >> st->log_zone_size]) == NO_ZONE)
+                continue;
+            blocks[n] = (zone << st->log_zone_size) + ((i + j) & (per_zone - 1));
+            buffers[n] = st->run + (size_t)n * st->block_size;
+            ++ n;
+        }
+        
+        if(read_blocks(st, blocks, n, buffers) != OK)
+            break;
+        
+        for(j = n = 0; j < RUN_BLOCKS && i + j < total && size > 0; ++ j) {
+            entries = (size < st->block_size ? (int)size : st->block_size) / sizeof(struct direct);
+            if(zones[(i + j) >> st->log_zone_size] != NO_ZONE)
+                found += match_entries(st, buffers[n ++], entries, file_name, deleted,
+                                       key, mask, inodes + found, max - found);
+            size -= st->block_size;
+        }
+    }
+    
+    return(found);
+}
+
+/* entry_key(file_name, deleted, &key, &mask)
+ *
+ *      the first 8 bytes of a deleted entry for "file_name" are
+ *      a zero i-node number and the start of the name. they are
+ *      built in "key", "mask" selecting the bytes to compare. for
+ *      a live entry only the name is compared.
+ */
+void entry_key(file_name, deleted, key, mask)
+char *file_name;
+int deleted;
+uint64_t *key;
+uint64_t *mask;
+{
+    unsigned char k[sizeof(uint64_t)];
+    unsigned char m[sizeof(uint64_t)];
+    size_t len = strlen(file_name) + 1;
+    size_t i;
+    
+    memset(k, 0, sizeof(k));
+    memset(m, 0, sizeof(k));
+    if(deleted)
+        memset(m, 0xff, sizeof(u32_t));
+    for(i = 0; i < len && sizeof(u32_t) + i < sizeof(k); ++ i) {
+        k[sizeof(u32_t) + i] = (unsigned char)file_name[i];
+        m[sizeof(u32_t) + i] = 0xff;
+    }
+    
+    memcpy(key, k, sizeof(k));
+    memcpy(mask, m, sizeof(m));
+}
+
+/* match_entries(st, block, entries, file_name, deleted, key, mask, inodes, max)
+ *
+ *      find the entries for "file_name" among the first "entries"
+ *      entries of directory "block", deleted ones if "deleted" is
+ *      non zero. every entry is first checked with one masked
+ *      compare of its first 8 bytes, and only those that pass have
+ *      their names compared.
+ *      return the number of i-node numbers put in "inodes".
+ */
+int match_entries(st, block, entries, file_name, deleted, key, mask, inodes, max)
+dr_state *st;
+char *block;
+int entries;
+char *file_name;
+int deleted;
+uint64_t key;
+uint64_t mask;
+ino_t *inodes;
+int max;
+{
+    unsigned char hit[MAX_BLOCK_SIZE / sizeof(struct direct)];
+    struct direct *entry;
+    uint64_t w;
+    u32_t inode;
+    int found = 0;
+    int i;
+    
+    for(i = 0; i < entries; ++ i) {
+        memcpy(&w, block + i * sizeof(struct direct), sizeof(w));
+        hit[i] = (w & mask) == key;
     }
     
-    while((count = read(dir_d, (char *)&entry, sizeof(struct direct))) == sizeof(struct direct)) {
-        if( entry.mfs_d_ino == 0 && strncmp(file_name, entry.mfs_d_name, NAME_MAX - sizeof(ino_t)) == 0) {
-            printf("Deleted file name: %s\n", entry.mfs_d_name);
-            inode = *((ino_t *)&entry.mfs_d_name[MFS_DIRSIZ - sizeof(ino_t)]);
-            //inode = entry.mfs_d_ino;
-            close(dir_d);
-            
-            if(inode < 1 || inode > st->inodes) {
-                printf("Illegal i-node number: %ld\n", inode);
-                return 0;
-            }
-            
-            return inode;
+    for(i = 0; i < entries && found < max; ++ i) {
+        if(!hit[i])
+            continue;
+        
+        entry = (struct direct *)(block + i * sizeof(struct direct));
+        if(!deleted) {
+            if(entry->mfs_d_ino != 0 && strncmp(file_name, entry->mfs_d_name, MFS_DIRSIZ) == 0)
+                inodes[found ++] = (ino_t)entry->mfs_d_ino;
+            continue;
         }
+        
+        if(strncmp(file_name, entry->mfs_d_name, MFS_DIRSIZ - sizeof(u32_t)) != 0)
+            continue;
+        
+        memcpy(&inode, &entry->mfs_d_name[MFS_DIRSIZ - sizeof(u32_t)], sizeof(inode));
+        DR_TRACE(("Deleted file name: %s, i-node %lu\n", file_name, (unsigned long)inode));
+        
+        if(inode < 1 || inode > st->inodes) {
+            dr_msg(st, DR_LOG_INFO, "Illegal i-node number: %lu\n", (unsigned long)inode);
+            continue;
+        }
+        
+        inodes[found ++] = (ino_t)inode;
+    }
+    
+    return(found);
+}
+
+/* inode_addr(st, inode)
+ *
+ *      address of i-node "inode" on the device
+ */
+off_t inode_addr(st, inode)
+dr_state *st;
+ino_t inode;
+{
+    return (off_t)st->inode_start * st->block_size + (off_t)(inode - 1) * st->inode_size;
+}
+
+/* inode_zones(st, inode, &zones, &size)
+ *
+ *      collect the zone numbers of i-node "inode" up to its size,
+ *      including those reached through its indirect blocks. the
+ *      list is allocated in "zones" and freed by the caller; holes
+ *      are NO_ZONE. the size of the file is put in "size".
+ *      return the number of zones, -1 on error.
+ */
+int inode_zones(st, inode, zones, size)
+dr_state *st;
+ino_t inode;
+zone_t **zones;
+off_t *size;
+{
+    dr_inode di;
+    zone_t *iz = di.zone;
+    zone_t *list;
+    off_t zones_needed;
+    int count, n, i;
+    
+    st->address = inode_addr(st, inode);
+    if(read_block(st, st->buffer) == NULL)
+        return(-1);
+    
+    /* the block may leave the cache, it is decoded at once */
+    st->layout->inode(&st->bp[st->offset], &di);
+    *size = di.size;
+    
+    if(*size < 0) {
+        dr_msg(st, DR_LOG_INFO, "Negative size for i-node %lu\n", (unsigned long)inode);
+        return(-1);
+    }
+    
+    /* counted as an off_t, a corrupt size could overflow an int */
+    zones_needed = *size / st->zone_size + (*size % st->zone_size != 0);
+    if(zones_needed > st->ndzones + (off_t)st->nr_indirects * (st->nr_indirects + 1)) {
+        dr_msg(st, DR_LOG_INFO, "File too big for i-node %lu\n", (unsigned long)inode);
+        return(-1);
+    }
+    count = (int)zones_needed;
+    
+    if((list = (zone_t *)malloc((count + 1) * sizeof(zone_t))) == NULL) {
+        dr_msg(st, DR_LOG_INFO, "Not enough memory for %d zones\n", count);
+        return(-1);
+    }
+    
+    n = count < st->ndzones ? count : st->ndzones;
+    memcpy(list, iz, n * sizeof(zone_t));
+    
+    if(n < count && zone_ptrs(st, iz[st->ndzones], list + n, count - n, st->indir) != OK)
+        goto err;
+    n += st->nr_indirects;
+    
+    if(n < count) {
+        if(zone_ptrs(st, iz[st->ndzones + 1], st->ptrs, st->nr_indirects,
+                     &st->indir[st->block_size]) != OK)
+            goto err;
+        
+        for(i = 0; n < count; ++ i, n += st->nr_indirects) {
+            if(zone_ptrs(st, st->ptrs[i], list + n,
+                         count - n < st->nr_indirects ? count - n : st->nr_indirects, st->indir) != OK)
+                goto err;
+        }
+    }
+    
+    *zones = list;
+    return(count);
+    
+err:
+    free(list);
+    return(-1);
+}
+
+/* zone_ptrs(st, block, zones, count, buffer)
+ *
+ *      put the first "count" zone pointers of indirect block "block"
+ *      into "zones", reading it into "buffer". a NO_ZONE block gives
+ *      NO_ZONE pointers.
+ */
+int zone_ptrs(st, block, zones, count, buffer)
+dr_state *st;
+zone_t block;
+zone_t *zones;
+int count;
+char *buffer;
+{
+    char *bp;
+    int i;
+    
+    if(block == NO_ZONE) {
+        for(i = 0; i < count; ++ i)
+            zones[i] = NO_ZONE;
+        return OK;
     }
     
-    close(dir_d);
+    if(block < st->first_data || block >= st->zones) {
+        dr_msg(st, DR_LOG_INFO, "Illegal block number\n");
+        return ERROR;
+    }
+    
+    if((bp = read_disk(st, (off_t)block * st->zone_size, buffer)) == NULL)
+        return ERROR;
+    
+    st->layout->ptrs(bp, zones, count);
+    return OK;
+}
+
+/* indirect_zones(st, di, zones)
+ *
+ *      put the indirect zones the file of i-node "di" uses up to its
+ *      size into "zones", which holds 2 + st->nr_indirects of them:
+ *      the single, the double and the ones the double points to.
+ *      its size must have passed inode_zones(). return how many
+ *      there are, -1 on error.
+ */
+int indirect_zones(st, di, zones)
+dr_state *st;
+dr_inode *di;
+zone_t *zones;
+{
+    off_t count = di->size / st->zone_size + (di->size % st->zone_size != 0);
+    zone_t *ptrs;
+    int n = 0, i, k;
+    
+    count -= st->ndzones;
+    if(count > 0 && di->zone[st->ndzones] != NO_ZONE)
+        zones[n ++] = di->zone[st->ndzones];
+    
+    count -= st->nr_indirects;
+    if(count <= 0 || di->zone[st->ndzones + 1] == NO_ZONE)
+        return(n);
+    zones[n ++] = di->zone[st->ndzones + 1];
+    
+    k = (int)((count + st->nr_indirects - 1) / st->nr_indirects);
+    ptrs = zones + n;
+    if(zone_ptrs(st, di->zone[st->ndzones + 1], ptrs, k, &st->indir[st->block_size]) != OK)
+        return(-1);
     
-    if(count == 0)
-        printf("Cannot find a damaged entry for %s\n", file_name);
-    else
-        printf("Error reading directory %s\n", dir_name);
-    return 0;
+    /* holes need no zone */
+    for(i = 0; i < k; ++ i) {
+        if(ptrs[i] != NO_ZONE)
+            zones[n ++] = ptrs[i];
+    }
+    return(n);
 }
 
 /* find_inode(st, filename)
@@ -237,8 +574,8 @@ char *filename;
     ino_t inode;
     
     if(fstat(st->device_d, &device_stat) == -1) {
-        fprintf(stderr, "Can not fstat(2) file system device\n" );
-        exit(1);
+        dr_msg(st, DR_LOG_ERROR, "Can not fstat(2) file system device\n" );
+        return 0;
     }
     
 #ifdef S_IFLNK
@@ -247,19 +584,19 @@ char *filename;
     if(stat(filename, &file_stat) == -1)
 #endif
     {
-        printf("Can not find file %s\n", filename);
+        dr_msg(st, DR_LOG_INFO, "Can not find file %s\n", filename);
         return 0;
     }
     
     if(device_stat.st_rdev != file_stat.st_dev) {
-        printf("File is not on device %s\n", st->device_name);
+        dr_msg(st, DR_LOG_INFO, "File is not on device %s\n", st->device_name);
         return 0;
     }
     
     inode = file_stat.st_ino;
     
     if(inode < 1  || inode > st->inodes) {
-        printf("Illegal i-node number!\n");
+        dr_msg(st, DR_LOG_INFO, "Illegal i-node number!\n");
         return 0;
     }
     
@@ -285,156 +622,300 @@ char *filename;
 off_t recover_blocks(st)
 dr_state *st;
 {
-    //struct inode core_inode;
-    //d1_inode *dip1;
-    //d2_inode *dip2;
-    //struct inode *inode = &core_inode;
-    struct inode *inode;
-    bit_t node = (st->address - (st->first_data - st->inode_blocks) * K) / st->inode_size + 1;
+    dr_inode core_inode;
+    dr_inode *inode = &core_inode;
+    bit_t node = (st->address - (off_t)st->inode_start * st->block_size) / st->inode_size + 1;
     
     //printf("node = %d\n", node);
     
-    //printf("size of d1_inode: %d\n", sizeof(d1_inode));
-    //printf("size of d2_inode: %d\n", sizeof(d2_inode));
-    
-    //printf("buffer size is: %d\n", sizeof(st->buffer));
-    
-    //printf("buffer1 address is: %d\n",(st->offset & ~ 0x1f));
-    //printf("buffer2 address is: %d\n",(st->offset & ~ 0x1f & ~ (V2_INODE_SIZE-1)));
+    /* decoded for the layout of the device */
+    st->layout->inode(&st->bp[st->offset], inode);
     
-    //dip1 = (d1_inode *)&st->buffer[st->offset & ~ 0x1f];
-    //dip2 = (d2_inode *)&st->buffer[st->offset & ~ 0x1f & ~ (V2_INODE_SIZE-1)];
-    
-    //printf("d1_size = %d\n", dip1->d1_size);
-    //printf("d2_size = %d\n", dip2->d2_size);
-    
-    //conv_inode(inode, dip1, dip2, READING, st->magic);
-
-    inode = (struct inode *)&st->buffer[st->offset];
-    
-    if(st->block < st->first_data - st->inode_blocks || st->block >= st->first_data) {
-        printf("Not in an inode block");
+    if(st->block < st->inode_start || st->block >= st->inode_start + st->inode_blocks) {
+        dr_msg(st, DR_LOG_INFO, "Not in an inode block");
         return(-1L);
     }
 
     /*  Is this a valid, but free i-node?  */
     if(node > st->inodes) {
-        printf("Not an inode");
+        dr_msg(st, DR_LOG_INFO, "Not an inode");
         return(-1L);
     }
     
-    if(in_use(node, st, 1)) {
-        printf("i-node is in use\n");
+    if(in_use(node, st, MAP_INODE)) {
+        dr_msg(st, DR_LOG_INFO, "i-node is in use\n");
         return(-1L);
     }
     
-    printf("Recovering start...\n");
+    if(inode->size < 0) {
+        dr_msg(st, DR_LOG_INFO, "i-node has a negative size\n");
+        return(-1L);
+    }
+    
+    DR_TRACE(("Recovering start...\n"));
 
-    off_t file_size = inode->i_size;
-    int i;
+    off_t file_size = inode->size;
 
-    printf("i_size = %ld\n", file_size);
+    DR_TRACE(("i_size = %ld\n", file_size));
+    out_prealloc(st, file_size);
         
     /*  Up to st->ndzones pointers are stored in the i-node.  */
-    for(i = 0; i < st->ndzones; ++i) {
-        if(file_size == 0)
-            return(inode->i_size);
-            
-        if (!data_block(st, inode->i_zone[i], &file_size))
-            return(-1L);
-    }
+    if(!data_blocks(st, inode->zone, st->ndzones, &file_size))
+        return(-1L);
         
     if(file_size == 0)
-        return(inode->i_size);
+        return(inode->size);
         
     /*  An indirect block can contain up to inode->i_indirects more blk ptrs.  */
-    if(!indirect(st, inode->i_zone[st->ndzones], &file_size, 0))
+    if(!indirect(st, inode->zone[st->ndzones], &file_size, 0))
         return(-1L);
         
     if(file_size == 0)
-        return(inode->i_size);
+        return(inode->size);
         
     /*  A double indirect block can contain up to inode->i_indirects blk ptrs. */
-    if(!indirect(st, inode->i_zone[st->ndzones+1], &file_size, 1))
+    if(!indirect(st, inode->zone[st->ndzones+1], &file_size, 1))
         return(-1L);
         
     if(file_size == 0)
-        return(inode->i_size);
+        return(inode->size);
         
-    fprintf(stderr, "Internal fault (file_size != 0)\n");
+    dr_msg(st, DR_LOG_ERROR, "Internal fault (file_size != 0)\n");
     
     /* NOTREACHED */
     return(-1L);
 }
 
-/* in_use(bit, map)
+/* in_use(bit, st, mode)
  *      
- *      is the bit set in map?
+ *      is the bit set in the inode (mode == MAP_INODE) or zone
+ *      (mode == MAP_ZONE) map?
  */
 int in_use(bit, st, mode)
 bit_t bit;
 dr_state *st;
-int mode;                   /* mode == 1 --> in_use for inode; mode == 0 --> in_use for zone */
+int mode;
 {
-    if(mode == 1) {
-        if(bit < st->isearch)
-            return 1;
+    return bit_test(st, mode, bit);
+}
+
+/* data_blocks(st, zones, count, &file_size)
+ *
+ *      Recover up to "count" data zones from the list "zones",
+ *      stopping when "file_size" reaches 0. The zones are first
+ *      coalesced into extents, so physically contiguous zones
+ *      are copied with a single read and write.
+ */
+int data_blocks(st, zones, count, file_size)
+dr_state *st;
+zone_t *zones;
+int count;
+off_t *file_size;
+{
+    int needed;
+    int n;
+    int i;
+    
+    /* zone pointers past the end of the file are not looked at */
+    needed = (int)((*file_size + st->zone_size - 1) / st->zone_size);
+    if(count > needed)
+        count = needed;
+    
+    if((n = zone_extents(st, zones, count, st->extents)) == -1)
+        return(0);
+    
+    for(i = 0; i < n; ++ i) {
+        if(copied_add(st, &st->extents[i]) != OK || !copy_extent(st, &st->extents[i], file_size))
+            return(0);
     }
-    else {
-        if(bit < st->zsearch)
-            return 1;
+    
+    return(1);
+}
+
+/* zone_extents(st, zones, count, extents)
+ *
+ *      Turn "count" zone pointers into extents of physically
+ *      contiguous zones. Runs of NO_ZONE pointers become hole
+ *      extents. Every data zone must be legal and free.
+ *
+ *      On error -1 is returned, otherwise the number of extents.
+ */
+int zone_extents(st, zones, count, extents)
+dr_state *st;
+zone_t *zones;
+int count;
+dr_extent *extents;
+{
+    int i, n;
+    
+    if((n = zone_runs(st, zones, count, extents)) == -1) {
+        dr_msg(st, DR_LOG_INFO, "Illegal block number\n");
+        return(-1);
     }
     
-    return 0;
-    //return(map[(int)(bit / (CHAR_BIT * sizeof(bitchunk_t)))] & (1 << ((unsigned)bit % (CHAR_BIT * sizeof (bitchunk_t)))));
+    /* each run of zones is checked against the zone map at once */
+    for(i = 0; i < n; ++ i) {
+        if(extents[i].start != NO_ZONE &&
+           !range_free(st, MAP_ZONE, (bit_t)(extents[i].start - (st->first_data - 1)),
+                       (bit_t)extents[i].length)) {
+            dr_msg(st, DR_LOG_INFO, "Encountered an \"in use\" data block\n");
+            return(-1);
+        }
+    }
+    
+    return(n);
 }
 
-/* data_block(st, block, &file_size)
+/* zone_runs(st, zones, count, extents)
  *
- *      If "block" is free then write  Min(file_size, k)
- *      bytes from it onto the current output file.
- *      If "block" is zero, this means that a 1k "hole"
- *      is in the file. The recovered file maintains
- *      the reduced size by not allocating the block.
- *      The file size is decremented accordingly.
+ *      coalesce "count" zone pointers into "extents", without
+ *      looking at the zone map. -1 is returned if a zone is
+ *      illegal, otherwise the number of extents.
  */
-int data_block(st, block, file_size)
+int zone_runs(st, zones, count, extents)
 dr_state *st;
-zone_t block;
-off_t *file_size;
+zone_t *zones;
+int count;
+dr_extent *extents;
 {
-    char buffer[K];
-    off_t block_size = *file_size > K ? K : *file_size;
+    dr_extent *x = extents - 1;
+    zone_t zone;
+    int i;
     
-    /*  Check for a "hole".  */
-    if (block == NO_ZONE) {
-        if(block_size < K) {
-            printf("File has a hole at the end\n");
-            return(0);
+    for(i = 0; i < count; ++ i) {
+        zone = zones[i];
+        if(zone != NO_ZONE && (zone < st->first_data || zone >= st->zones))
+            return(-1);
+        
+        if(i > 0 && (zone == NO_ZONE ? x->start == NO_ZONE :
+                     x->start != NO_ZONE && zone == x->start + x->length)) {
+            ++ x->length;
+            continue;
         }
         
-        if(fseek(st->file_f, block_size, SEEK_CUR) == -1) {
-            printf("Problem seeking %s\n", st->file_name);
+        ++ x;
+        x->start = zone;
+        x->length = 1;
+    }
+    
+    return (int)(x + 1 - extents);
+}
+
+/* copy_extent(st, extent, &file_size)
+ *
+ *      Write Min(file_size, extent length) bytes of "extent"
+ *      onto the current output file. A hole extent is kept
+ *      as a hole, also at the end of the file. The file size
+ *      is decremented accordingly.
+ */
+int copy_extent(st, x, file_size)
+dr_state *st;
+dr_extent *x;
+off_t *file_size;
+{
+    off_t len = (off_t)x->length * st->zone_size;
+    
+    if(len > *file_size)
+        len = *file_size;
+    
+    /*  Check for a "hole".  */
+    if(x->start == NO_ZONE) {
+        st->stats.holes += x->length;
+        if(!skip_hole(st, len))
             return(0);
-        }
         
-        *file_size -= block_size;
+        *file_size -= len;
         return(1);
     }
-
-    /*  Block is not a "hole". Copy it to output file, if not in use.  */
-    printf("Block is not a hole!\n");
-    if(!free_block(st, block))
+    
+    /*  Extent is not a "hole". Copy it to output file, or queue it.  */
+    st->stats.blocks += x->length;
+    if(st->async != NULL ? async_queue(st, (off_t)x->start * st->zone_size, len) != OK :
+                           copy_range(st, (off_t)x->start * st->zone_size, len) != OK) {
+        dr_msg(st, DR_LOG_INFO, "Problem writing %s\n", st->file_name);
         return(0);
+    }
     
-    read_disk(st, (long)block << K_SHIFT, buffer);
+    *file_size -= len;
+    return(1);
+}
+
+/* copied_add(st, x)
+ *
+ *      note that the file being recovered was copied from the zones
+ *      of extent "x", for copy_verify(). holes are left out.
+ */
+int copied_add(st, x)
+dr_state *st;
+dr_extent *x;
+{
+    dr_extent *last = st->ncopied > 0 ? &st->copied[st->ncopied - 1] : NULL;
+    dr_extent *p;
+    int slots;
+    
+    if(x->start == NO_ZONE)
+        return OK;
+    if(last != NULL && last->start + last->length == x->start) {
+        last->length += x->length;
+        return OK;
+    }
+    
+    if(st->ncopied == st->copied_slots) {
+        slots = st->copied_slots ? 2 * st->copied_slots : 64;
+        if((p = (dr_extent *)realloc(st->copied, slots * sizeof(dr_extent))) == NULL) {
+            dr_msg(st, DR_LOG_ERROR, "Not enough memory to note the zones copied\n");
+            return ERROR;
+        }
+        st->copied = p;
+        st->copied_slots = slots;
+    }
+    st->copied[st->ncopied ++] = *x;
+    return OK;
+}
+
+/* copy_verify(st, x, n)
+ *
+ *      the file just recovered into st->file_name was copied from
+ *      the "n" extents from "x" while they were free. the zone map is
+ *      read again to see if any of them was allocated meanwhile, as
+ *      then the copy may hold new data. the maps are not locked or
+ *      flushed for each file; this check after the copy takes their
+ *      place. DR_ECHANGED is returned if a zone was reallocated or
+ *      the maps can not be read.
+ */
+int copy_verify(st, x, n)
+dr_state *st;
+dr_extent *x;
+int n;
+{
+    if(map_reread(st, x, n) == OK && extents_free(st, x, n))
+        return OK;
     
-    if(fwrite(buffer, 1, (size_t)block_size, st->file_f) != (size_t)block_size) {
-        printf("Problem writing %s\n", st->file_name);
+    ++ st->stats.reallocated;
+    dr_msg(st, DR_LOG_ERROR, "Warning: zones of %s were reallocated while it was recovered, "
+           "it may hold other data\n", st->file_name);
+    return DR_ECHANGED;
+}
+
+/* skip_hole(st, len)
+ *
+ *      Leave a hole of "len" bytes in the output file, in
+ *      order with any reads still in the pipeline.
+ */
+int skip_hole(st, len)
+dr_state *st;
+off_t len;
+{
+    if(len < 0) {
+        dr_msg(st, DR_LOG_INFO, "Bad hole of %ld bytes\n", (long)len);
+        return(0);
+    }
+
+    if(st->async != NULL ? async_queue(st, (off_t)-1, len) != OK : out_hole(st, len) != OK) {
+        dr_msg(st, DR_LOG_INFO, "Problem writing %s\n", st->file_name);
         return(0);
     }
     
-    *file_size -= block_size;
     return(1);
 }
 
@@ -448,12 +929,12 @@ dr_state *st;
 zone_t block;
 {
     if (block < st->first_data || block >= st->zones) {
-        printf("Illegal block number\n");
+        dr_msg(st, DR_LOG_INFO, "Illegal block number\n");
         return(0);
     }
 
-    if(in_use((bit_t)(block - (st->first_data - 1)), st, 0)) {
-        printf("Encountered an \"in use\" data block\n");
+    if(in_use((bit_t)(block - (st->first_data - 1)), st, MAP_ZONE)) {
+        dr_msg(st, DR_LOG_INFO, "Encountered an \"in use\" data block\n");
         return(0);
     }
     
@@ -467,8 +948,8 @@ zone_t block;
  *      then "block" is a double-indirect block pointing to
  *      V*_INDIRECTS indirect blocks.
  *
- *      If a "hole" is encountered, then just seek ahead in the
- *      output file.
+ *      If a "hole" is encountered, then just leave a hole in
+ *      the output file.
  */
 int indirect(st, block, file_size, dblind)
 dr_state *st;
@@ -476,27 +957,25 @@ zone_t block;
 off_t *file_size;
 int dblind;
 {
-    union {
-        zone1_t ind1[V1_INDIRECTS];
-        zone_t ind2[V2_INDIRECTS(_MAX_BLOCK_SIZE)];
-    }indir;
+    char *buffer = &st->indir[dblind * st->block_size];    /* one per level */
+    zone_t *zones = &st->ptrs[dblind * st->nr_indirects];
+    dr_extent x;
+    char *bp;
+    off_t span;
     
-    int i;
-    zone_t zone;
+    int i, n;
     
-    /* Check for a "hole". */
+    /* Check for a "hole", which may run to the end of the file. */
     if(block == NO_ZONE) {
-        off_t skip = (off_t)st->nr_indirects * K;
+        off_t skip = (off_t)st->nr_indirects * st->zone_size;
         
-        if(*file_size < skip || dblind) {
-            printf("File has a hole at the end\n");
-            return(0);
-        }
+        if(dblind)
+            skip *= st->nr_indirects;
+        if(skip > *file_size)
+            skip = *file_size;
         
-        if(fseek( st->file_f, skip, SEEK_CUR) == -1 ) {
-            printf( "Problem seeking %s\n", st->file_name );
+        if(!skip_hole(st, skip))
             return(0);
-        }
         
         *file_size -= skip;
         return( 1 );
@@ -506,22 +985,70 @@ int dblind;
     if(!free_block(st, block))
         return(0);
     
-    read_disk(st, (long)block << K_SHIFT, (char *)&indir);
+    x.start = block;
+    x.length = 1;
+    if(copied_add(st, &x) != OK || (bp = read_disk(st, (off_t)block * st->zone_size, buffer)) == NULL)
+        return(0);
     
-    for(i = 0; i < st->nr_indirects; ++i) {
-        if(*file_size == 0)
-            return(1);
-        
-        zone = (st->v1 ? indir.ind1[i] : indir.ind2[i]);
-        if (dblind) {
-            if (!indirect(st, zone, file_size, 0))
-                return(0);
-        }
-        else {
-            if (!data_block(st, zone, file_size))
-                return(0);
-        }
+    /* only the pointers this file still needs are decoded */
+    span = dblind ? (off_t)st->nr_indirects * st->zone_size : st->zone_size;
+    n = (int)((*file_size + span - 1) / span);
+    if(n > st->nr_indirects)
+        n = st->nr_indirects;
+    st->layout->ptrs(bp, zones, n);
+    
+    if(!dblind)
+        return data_blocks(st, zones, n, file_size);
+    
+    /* ask for all the indirect blocks this file still needs at once */
+    dev_prefetch(st, zones, n);
+    
+    for(i = 0; i < n && *file_size > 0; ++i) {
+        if (!indirect(st, zones[i], file_size, 0))
+            return(0);
     }
     
     return(1);
 }
+
+/* batch_device(st, path)
+ *
+ *      make sure the device holding "path" is the one open in "st",
+ *      setting it up if it is not. a device given with -d is opened
+ *      once and used for every path.
+ */
+int batch_device(st, path)
+dr_state *st;
+char *path;
+{
+    char dir_name[MAX_STRING + 1];
+    char file_name[MAX_STRING + 1];
+    char dev[DEV_NAME_MAX + 1];
+    int r;
+    
+    if(st->device_path != NULL) {
+        if(st->device_d != -1)
+            return OK;
+        st->device_name = st->device_path;
+        return open_device(st);
+    }
+    
+    if(!split_dir_file(st, path, dir_name, file_name))
+        return ERROR;
+    
+    /* find the device holding the directory */
+    if(file_device(st, dir_name, dev) == NULL)
+        return ERROR;
+    
+    if(st->device_d != -1 && strcmp(dev, st->device_buf) == 0)
+        return OK;
+    
+    close_device(st);
+    strcpy(st->device_buf, dev);
+    
+    /* the directory is on the device, so its file system is flushed */
+    st->sync_dir = dir_name;
+    r = open_device(st);
+    st->sync_dir = NULL;
+    return(r);
+}
@@ -0,0 +1,185 @@
+//
+//  dr_stats.c
+//
+//      Phase timers, I/O counters and the report of a session.
+//
+//      Each phase (super block, bit maps, directory scan, i-node
+//      read, data copy) accumulates wall and CPU time. The I/O layer
+//      counts system calls, bytes and blocks, and with -H the time
+//      of every read_disk() goes into a histogram of power of two
+//      microsecond buckets. The totals can be written out as JSON.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <minix/config.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+
+#include <minix/const.h>
+#include <minix/type.h>
+#include "mfs/const.h"
+
+#include "drecover.h"
+
+static char *phase_names[NR_PHASES] = {
+    "super_block", "bit_maps", "directory", "inode", "copy"
+};
+
+/* timer_start(t)
+ *
+ */
+void timer_start(t)
+dr_timer *t;
+{
+    gettimeofday(&t->wall, NULL);
+    t->cpu = clock();
+}
+
+/* timer_stop(st, phase, t)
+ *
+ *      add the time since timer_start(t) to "phase"
+ */
+void timer_stop(st, phase, t)
+dr_state *st;
+int phase;
+dr_timer *t;
+{
+    st->stats.wall[phase] += time_since(&t->wall);
+    st->stats.cpu[phase] += (double)(clock() - t->cpu) / CLOCKS_PER_SEC;
+    ++ st->stats.calls[phase];
+}
+
+/* stats_latency(st, start)
+ *
+ *      count a read_disk() call that began at "start" in the
+ *      latency histogram. bucket i holds calls that took from
+ *      2^(i-1) up to 2^i microseconds.
+ */
+void stats_latency(st, start)
+dr_state *st;
+struct timeval *start;
+{
+    double us = time_since(start) * 1e6;
+    int i;
+
+    for(i = 0; i < HIST_BUCKETS - 1 && us >= 1.0; ++ i)
+        us /= 2;
+
+    ++ st->stats.hist[i];
+}
+
+/* stats_merge(to, from)
+ *
+ *      add the figures of a worker to those of the session
+ */
+void stats_merge(to, from)
+dr_stats *to;
+dr_stats *from;
+{
+    int i;
+
+    for(i = 0; i < NR_PHASES; ++ i) {
+        to->wall[i] += from->wall[i];
+        to->cpu[i] += from->cpu[i];
+        to->calls[i] += from->calls[i];
+    }
+
+    to->reads += from->reads;
+    to->writes += from->writes;
+    to->seeks += from->seeks;
+    to->copies += from->copies;
+    to->bytes_read += from->bytes_read;
+    to->bytes_written += from->bytes_written;
+    to->blocks += from->blocks;
+    to->holes += from->holes;
+    to->reallocated += from->reallocated;
+    to->throttled += from->throttled;
+    to->throttled_secs += from->throttled_secs;
+    to->cache_hits += from->cache_hits;
+    to->cache_misses += from->cache_misses;
+
+    for(i = 0; i < HIST_BUCKETS; ++ i)
+        to->hist[i] += from->hist[i];
+}
+
+/* stats_report(st, name, files, bytes, secs)
+ *
+ *      write the figures of a session that recovered "files" files
+ *      of "bytes" bytes in "secs" seconds as JSON to the file
+ *      "name", or to stdout if "name" is "-".
+ */
+int stats_report(st, name, files, bytes, secs)
+dr_state *st;
+char *name;
+int files;
+off_t bytes;
+double secs;
+{
+    dr_stats *s = &st->stats;
+    FILE *f = stdout;
+    int i, last;
+
+    if(strcmp(name, "-") != 0 && (f = fopen(name, "w")) == NULL) {
+        dr_msg(st, DR_LOG_ERROR, "Can not open report file %s\n", name);
+        return ERROR;
+    }
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"files\": %d,\n", files);
+    fprintf(f, "  \"bytes\": %ld,\n", (long)bytes);
+    fprintf(f, "  \"seconds\": %.6f,\n", secs);
+    fprintf(f, "  \"mb_per_second\": %.2f,\n", secs > 0 ? bytes / secs / (1024 * 1024) : 0.0);
+
+    fprintf(f, "  \"phases\": {\n");
+    for(i = 0; i < NR_PHASES; ++ i)
+        fprintf(f, "    \"%s\": { \"calls\": %lu, \"wall\": %.6f, \"cpu\": %.6f }%s\n", phase_names[i],
+                s->calls[i], s->wall[i], s->cpu[i], i < NR_PHASES - 1 ? "," : "");
+    fprintf(f, "  },\n");
+
+    fprintf(f, "  \"syscalls\": { \"total\": %lu, \"read\": %lu, \"write\": %lu, \"seek\": %lu, \"copy_range\": %lu },\n",
+            s->reads + s->writes + s->seeks + s->copies, s->reads, s->writes, s->seeks, s->copies);
+    fprintf(f, "  \"bytes_read\": %ld,\n", (long)s->bytes_read);
+    fprintf(f, "  \"bytes_written\": %ld,\n", (long)s->bytes_written);
+    fprintf(f, "  \"blocks\": %lu,\n", s->blocks);
+    fprintf(f, "  \"holes\": %lu,\n", s->holes);
+    fprintf(f, "  \"reallocated\": %lu,\n", s->reallocated);
+    fprintf(f, "  \"cache\": { \"hits\": %lu, \"misses\": %lu }", s->cache_hits, s->cache_misses);
+
+    if(st->throttle != NULL)
+        fprintf(f, ",\n  \"throttle\": { \"waits\": %lu, \"seconds\": %.6f, \"scale\": %.4f }",
+                s->throttled, s->throttled_secs, st->throttle->scale);
+
+    if(s->histogram) {
+        for(last = HIST_BUCKETS - 1; last > 0 && s->hist[last] == 0; -- last)
+            ;
+        fprintf(f, ",\n  \"read_disk_us\": [");
+        for(i = 0; i <= last; ++ i)
+            fprintf(f, "%s{ \"below\": %lu, \"count\": %lu }", i ? ", " : "", 1UL << i, s->hist[i]);
+        fprintf(f, "]");
+    }
+    fprintf(f, "\n}\n");
+
+    if(f != stdout && fclose(f) == EOF) {
+        dr_msg(st, DR_LOG_ERROR, "Problem writing %s\n", name);
+        return ERROR;
+    }
+
+    return OK;
+}
+
+/* time_since(&start)
+ *
+ *      seconds elapsed since "start"
+ */
+double time_since(start)
+struct timeval *start;
+{
+    struct timeval now;
+    
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+}
@@ -0,0 +1,277 @@
+//
+//  dr_throttle.c
+//
+//      Limits on the rate of reads from the device.
+//
+//      Each read takes tokens from two buckets, one of bytes and one
+//      of reads, refilled at the rates given with -T. A read that
+//      empties a bucket sleeps until it is paid for, so recovery from
+//      a volume in use takes no more than that share of it. At most
+//      THROTTLE_BURST seconds worth of tokens are saved up.
+//
+//      With a latency limit the rates are also adapted: each
+//      THROTTLE_WINDOW in which the average read took longer than the
+//      limit halves them, each window below it raises them a step back
+//      toward the rates given. Without rates, the first window over the
+//      limit takes the rate it saw as the rate to scale.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <minix/config.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+
+#include <minix/const.h>
+#include <minix/type.h>
+#include "mfs/const.h"
+
+#include "drecover.h"
+
+/* throttle_create(bytes, ios, latency)
+ *
+ *      a throttle of "bytes" per second and "ios" reads per second,
+ *      either 0 for no limit, adapted to keep reads under "latency"
+ *      seconds unless it is 0.
+ *      NULL is returned if there is not enough memory.
+ */
+dr_throttle *throttle_create(bytes, ios, latency)
+double bytes;
+double ios;
+double latency;
+{
+    dr_throttle *th;
+
+    if((th = (dr_throttle *)calloc(1, sizeof(dr_throttle))) == NULL)
+        return(NULL);
+
+    th->bytes_rate = bytes;
+    th->ios_rate = ios;
+    th->latency = latency;
+    th->scale = 1.0;
+    th->bytes = bytes * THROTTLE_BURST;
+    th->ios = ios * THROTTLE_BURST;
+    th->last = th->window = throttle_now();
+    return(th);
+}
+
+/* throttle_parse(st, str)
+ *
+ *      set up the throttle of "st" from "bytes[:ios[:ms]]", bytes
+ *      with an optional K, M or G
+ */
+int throttle_parse(st, str)
+dr_state *st;
+char *str;
+{
+    double bytes, ios = 0, ms = 0;
+    char *p;
+
+    bytes = strtod(str, &p);
+    switch(*p) {
+        case 'G': case 'g': bytes *= 1024;
+            /* FALLTHROUGH */
+        case 'M': case 'm': bytes *= 1024;
+            /* FALLTHROUGH */
+        case 'K': case 'k': bytes *= 1024;
+            ++ p;
+    }
+    if(*p == ':') {
+        ios = strtod(p + 1, &p);
+        if(*p == ':')
+            ms = strtod(p + 1, &p);
+    }
+
+    if(*p != '\0' || bytes < 0 || ios < 0 || ms < 0 || (bytes == 0 && ios == 0 && ms == 0)) {
+        dr_msg(st, DR_LOG_ERROR, "Bad throttle %s, use bytes[:reads[:ms]]\n", str);
+        return ERROR;
+    }
+
+    throttle_destroy(st->throttle);
+    if((st->throttle = throttle_create(bytes, ios, ms / 1000)) == NULL) {
+        dr_msg(st, DR_LOG_ERROR, "Not enough memory for a throttle\n");
+        return ERROR;
+    }
+    return OK;
+}
+
+/* throttle_destroy(th)
+ *
+ */
+void throttle_destroy(th)
+dr_throttle *th;
+{
+    free(th);
+}
+
+/* throttle_share(th, n)
+ *
+ *      give one of "n" processes reading at once its share of the
+ *      rates
+ */
+void throttle_share(th, n)
+dr_throttle *th;
+int n;
+{
+    if(th == NULL || n <= 1)
+        return;
+
+    th->bytes_rate /= n;
+    th->ios_rate /= n;
+    th->bytes /= n;
+    th->ios /= n;
+}
+
+/* throttle_now()
+ *
+ *      the time in seconds
+ */
+double throttle_now()
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec / 1e6;
+}
+
+/* throttle_chunk(st, len)
+ *
+ *      how much of "len" bytes to move in one call, so that a long
+ *      copy takes its tokens a part at a time
+ */
+off_t throttle_chunk(st, len)
+dr_state *st;
+off_t len;
+{
+    if(st->throttle == NULL || len <= (off_t)st->run_size)
+        return(len);
+    return (off_t)st->run_size;
+}
+
+/* throttle_wait(st, bytes, &start)
+ *
+ *      take the tokens for a read of "bytes", sleeping until they
+ *      are there, and put the time the read may start in "start"
+ *      unless it is NULL. an asynchronous read is paid for once it
+ *      is issued, and timed from then.
+ */
+void throttle_wait(st, bytes, start)
+dr_state *st;
+off_t bytes;
+struct timeval *start;
+{
+    dr_throttle *th = st->throttle;
+    struct timespec ts;
+    double now, delay = 0;
+    double rate;
+
+    if(th == NULL)
+        return;
+
+    now = throttle_now();
+    throttle_fill(th, now);
+
+    /* a bucket may go below empty; the read waits until it is paid back */
+    th->bytes -= (double)bytes;
+    th->ios -= 1;
+    if((rate = th->bytes_rate * th->scale) > 0 && th->bytes < 0)
+        delay = -th->bytes / rate;
+    if((rate = th->ios_rate * th->scale) > 0 && th->ios < 0 && -th->ios / rate > delay)
+        delay = -th->ios / rate;
+
+    th->window_bytes += (double)bytes;
+    if(delay > 0) {
+        ts.tv_sec = (time_t)delay;
+        ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+        ++ st->stats.throttled;
+        st->stats.throttled_secs += delay;
+    }
+
+    if(start != NULL)
+        gettimeofday(start, NULL);
+}
+
+/* throttle_fill(th, now)
+ *
+ *      add the tokens earned since they were last added
+ */
+void throttle_fill(th, now)
+dr_throttle *th;
+double now;
+{
+    double elapsed = now - th->last;
+    double rate;
+
+    th->last = now;
+    if(elapsed <= 0)
+        return;
+
+    if((rate = th->bytes_rate * th->scale) > 0) {
+        th->bytes += elapsed * rate;
+        if(th->bytes > rate * THROTTLE_BURST)
+            th->bytes = rate * THROTTLE_BURST;
+    }
+    if((rate = th->ios_rate * th->scale) > 0) {
+        th->ios += elapsed * rate;
+        if(th->ios > rate * THROTTLE_BURST)
+            th->ios = rate * THROTTLE_BURST;
+    }
+}
+
+/* throttle_done(st, &start)
+ *
+ *      note the latency of a read started at "start" and adapt the
+ *      rates at the end of each window
+ */
+void throttle_done(st, start)
+dr_state *st;
+struct timeval *start;
+{
+    dr_throttle *th = st->throttle;
+    double now;
+
+    if(th == NULL || th->latency <= 0)
+        return;
+
+    now = throttle_now();
+    th->lat_sum += now - (start->tv_sec + start->tv_usec / 1e6);
+    ++ th->lat_count;
+
+    if(now - th->window >= THROTTLE_WINDOW)
+        throttle_adapt(th, now);
+}
+
+/* throttle_adapt(th, now)
+ *
+ *      halve the rates if reads were slower than th->latency over
+ *      the window ending "now", otherwise raise them a step, and
+ *      start the next window
+ */
+void throttle_adapt(th, now)
+dr_throttle *th;
+double now;
+{
+    if(th->lat_sum / th->lat_count > th->latency) {
+        if(th->bytes_rate == 0 && th->ios_rate == 0) {
+            th->bytes_rate = th->window_bytes / (now - th->window);
+            th->bytes = 0;
+        }
+        th->scale /= 2;
+        if(th->scale < THROTTLE_MIN)
+            th->scale = THROTTLE_MIN;
+    }
+    else if(th->scale < 1.0) {
+        th->scale += THROTTLE_STEP;
+        if(th->scale > 1.0)
+            th->scale = 1.0;
+    }
+
+    th->window = now;
+    th->window_bytes = 0;
+    th->lat_sum = 0;
+    th->lat_count = 0;
+}
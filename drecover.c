@@ -27,6 +27,10 @@
 #include <minix/fslib.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/dirent.h>
 #include <a.out.h>
 #include <tools.h>
@@ -36,169 +40,891 @@
 #include "drecover.h"
 
 /* function reference */
-_PROTOTYPE(void do_recover, (char *str));
 _PROTOTYPE(void do_test, (char *fstr));
+_PROTOTYPE(int do_carve, (dr_state *st, char *path));
 
 /* main function */
 int main(int argc, char *argv[])
 {
+    static dr_state st;         /* static since it is safer not to put it on the stack and for special initialization */
     char *command = argv[0];
+    char *list_name = NULL;
+    char *single = NULL;
+    char *carve = NULL;
+    char *cat_name = NULL;
+    char *serve = NULL;
+    char *server = NULL;
+    dr_catalog *cat;
+    char **paths;
+    int count;
+    int batch = 0;
+    int rounds = 0;
+    int jobs = 1;
+    int c;
+    
+    st.device_mode = O_RDONLY;
+    st.cache_blocks = CACHE_BLOCKS;
+    st.queue_depth = 1;
+    st.out_dir = TMP;
     
     /* parse command */
-    if(argc == 3 && strcmp(argv[1], "-r") == 0) {
-        -- argc;
-        ++ argv;
-        do_recover(argv[1]);
+    while((c = getopt(argc, argv, "r:t:bf:c:puq:j:C:s:d:R:Ho:B:aO:K:L:k:eD:S:T:")) != -1) {
+        switch(c) {
+            case 'r':
+                /* a batch of one, once all the options are in */
+                single = optarg;
+                batch = 1;
+                break;
+            case 't':
+                do_test(optarg);
+                return 0;
+            case 'b':
+                batch = 1;
+                break;
+            case 'f':
+                list_name = optarg;
+                break;
+            case 'c':
+                st.cache_blocks = get_count(c, optarg, 0);
+                break;
+            case 'p':
+                st.no_map = 1;
+                break;
+            case 'u':
+                st.uncached = 1;
+                break;
+            case 'q':
+                st.queue_depth = get_count(c, optarg, 1);
+                break;
+            case 'j':
+                jobs = get_count(c, optarg, 1);
+                break;
+            case 'd':
+                st.device_path = optarg;
+                break;
+            case 'R':
+                st.report_name = optarg;
+                break;
+            case 'H':
+                st.stats.histogram = 1;
+                break;
+            case 'T':
+                if(throttle_parse(&st, optarg) != OK)
+                    exit(1);
+                break;
+            case 'C':
+                carve = optarg;
+                break;
+            case 's':
+                if(add_signature(&st, optarg) != OK)
+                    exit(1);
+                break;
+            case 'o':
+                if(strlen(optarg) > MAX_STRING / 2) {
+                    fprintf(stderr, "Output directory name too long\n");
+                    exit(1);
+                }
+                st.out_dir = optarg;
+                break;
+            case 'a':
+                st.prealloc = 1;
+                break;
+            case 'e':
+                st.elevator = 1;
+                break;
+            case 'O':
+                if(out_stream(&st, optarg) != OK)
+                    exit(1);
+                break;
+            case 'B':
+                batch = 1;
+                rounds = get_count(c, optarg, 1);
+                break;
+            case 'K':
+                cat_name = optarg;
+                break;
+            case 'D':
+                serve = optarg;
+                break;
+            case 'S':
+                server = optarg;
+                break;
+            case 'L':
+                if((cat = catalog_read(&st, optarg)) == NULL)
+                    exit(1);
+                catalog_list(&st, cat);
+                catalog_free(cat);
+                return 0;
+            case 'k':
+                if((st.catalog = catalog_read(&st, optarg)) == NULL)
+                    exit(1);
+                /* the device is the one the catalog was built from */
+                if(st.device_path == NULL)
+                    st.device_path = st.catalog->names + st.catalog->head.device;
+                break;
+            default:
+                usage(command);
+        }
     }
-    else if(argc == 3 && strcmp(argv[1], "-t") == 0) {
-        -- argc;
-        ++ argv;
-        do_test(argv[1]);
+    
+    if(carve != NULL)
+        return do_carve(&st, carve) == -1 ? 1 : 0;
+    
+    if(cat_name != NULL)
+        return do_catalog(&st, cat_name, optind < argc ? argv[optind] : "/") == OK ? 0 : 1;
+    
+    if(serve != NULL)
+        return daemon_serve(&st, serve) == OK ? 0 : 1;
+    
+    if(server != NULL && !batch)
+        return daemon_request(&st, server, 0, NULL) == 0 ? 0 : 1;
+    
+    if(!batch)
+        usage(command);
+    
+    /* batch paths come from -r, argv, a list file, or stdin */
+    if(single != NULL) {
+        paths = &single;
+        count = 1;
+    }
+    else if(list_name != NULL || optind == argc) {
+        if((paths = read_path_list(list_name, &count)) == NULL)
+            exit(1);
     }
     else {
-        fprintf(stderr, "Usage: %s -[p] /path_name\n", command);
-        exit(1);
+        paths = argv + optind;
+        count = argc - optind;
     }
-    return 0;
+    
+    if(server != NULL)
+        return daemon_request(&st, server, count, paths) == count ? 0 : 1;
+    
+    if(rounds > 0 && st.out.stream)
+        usage(command);
+    if(rounds > 0)
+        return do_bench(&st, rounds, count, paths, jobs) == OK ? 0 : 1;
+    
+    return do_batch(&st, count, paths, jobs) == count ? 0 : 1;
 }
 
-/* do_recover()
+/* usage(command)
  *
  */
-void do_recover(str)
+void usage(command)
+char *command;
+{
+    fprintf(stderr, "Usage: %s [-d device] [-p | -u] [-c cache_blocks] [-q depth] -r /path_name\n", command);
+    fprintf(stderr, "       %s [-d device] [-p | -u] [-c cache_blocks] [-q depth] -b [-j jobs] [-f list_file] [/path_name ...]\n", command);
+    fprintf(stderr, "       %s [-d device] [-p] [-s ext:header[:footer]] ... -C /path_name\n", command);
+    fprintf(stderr, "       %s [-d device] -K catalog [/path_name]\n", command);
+    fprintf(stderr, "       %s -L catalog\n", command);
+    fprintf(stderr, "       %s [-d device | -k catalog] [-p] [-c cache_blocks] -D socket\n", command);
+    fprintf(stderr, "       %s [-o dir] -S socket [-b [-f list_file] [/path_name ...]]\n", command);
+    fprintf(stderr, "with -d, path names are on \"device\", which need not be mounted\n");
+    fprintf(stderr, "-K catalogs the deleted entries of a device, -L lists them, and -k catalog\n");
+    fprintf(stderr, "   before -r or -b looks path names up in it, as they are listed\n");
+    fprintf(stderr, "-p reads an image file instead of mapping it, -u reads the device with O_DIRECT,\n");
+    fprintf(stderr, "   or drops what it read from the page cache, to leave that to other programs\n");
+    fprintf(stderr, "-a preallocates the recovered files to their full size\n");
+    fprintf(stderr, "-e copies all the files in one sweep in disk order, not file by file\n");
+    fprintf(stderr, "-o puts the recovered files in a directory other than %s\n", TMP);
+    fprintf(stderr, "-O fd streams them, one after another, to an open descriptor (- for stdout)\n");
+    fprintf(stderr, "-R writes a JSON report to a file (- for stdout), -H adds read latencies to it\n");
+    fprintf(stderr, "-T bytes[:reads[:ms]] limits reads from the device to that many bytes (K, M or G)\n");
+    fprintf(stderr, "   and reads a second, 0 for no limit, and slows down further while reads take\n");
+    fprintf(stderr, "   longer than ms milliseconds; the jobs of -j share the limit\n");
+    fprintf(stderr, "-D serves the device to clients on a socket until killed; -S is such a client,\n");
+    fprintf(stderr, "   which lists the deleted entries, or with -b recovers path names as listed\n");
+    fprintf(stderr, "-B rounds in place of -b times the batch that many times, each into a new directory\n");
+    exit(1);
+}
+
+/* get_count(option, str, min)
+ *
+ *      the number "str" given with "option", which must be a whole
+ *      number from "min" up; exit if it is not
+ */
+int get_count(option, str, min)
+int option;
 char *str;
+int min;
 {
-    static dr_state st;         /* static since it is safer not to putit on the stack and for special initialization */
-    st.device_mode = O_RDONLY;
+    char *end;
+    long n;
     
-    char *dir_name;
-    char *file_name;
+    errno = 0;
+    n = strtol(str, &end, 10);
+    if(*str == '\0' || *end != '\0' || errno != 0 || n < min || n > INT_MAX) {
+        fprintf(stderr, "Bad count %s for -%c\n", str, option);
+        exit(1);
+    }
+    return (int)n;
+}
+
+/* do_batch(st, count, paths, jobs)
+ *
+ *      recover every path in "paths" in one session. the device is
+ *      opened and the super block and bit maps are read only once
+ *      (again only if a path lives on a different device). with
+ *      "jobs" above 1 the files are shared out to that many worker
+ *      processes. per-file and aggregate throughput is reported at
+ *      the end.
+ *      return the number of files recovered.
+ */
+int do_batch(st, count, paths, jobs)
+dr_state *st;
+int count;
+char **paths;
+int jobs;
+{
+    off_t *sizes;
+    double *secs;
+    off_t total_size = 0;
+    double total_secs;
+    struct timeval start;
+    int recovered = 0;
+    int i;
     
-    struct stat device_stat;
-    struct stat tmp_stat;
+    if((sizes = (off_t *)calloc(count, sizeof(off_t))) == NULL ||
+       (secs = (double *)calloc(count, sizeof(double))) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
     
-    off_t size;
-    ino_t inode;                 /* inode number of file which need to be recovered */
+    st->device_name = st->device_buf;
+    st->device_d = -1;
     
-    /* data structure construction */
-    /* split the path name into a directory and a file name */
-    if(strlen(str) > MAX_STRING) {
-        fprintf(stderr, "Path name too long!\n");
-        exit(1);
+    gettimeofday(&start, NULL);
+    
+    /* a stream must be written in order, by one process */
+    if(st->elevator && !st->out.stream)
+        elevator_batch(st, count, paths, sizes, secs);
+    else if(jobs > 1 && count > 1 && !st->out.stream && batch_workers(st, count, paths, jobs, sizes, secs) == OK)
+        ;
+    else {
+        for(i = 0; i < count; ++ i)
+            sizes[i] = batch_file(st, paths[i], &secs[i]);
     }
     
-    if(!split_dir_file(str, &dir_name, &file_name)) {
-        fprintf(stderr, "Path name error!\n");
-        exit(1);
+    total_secs = time_since(&start);
+    
+    close_device(st);
+    if(st->stats.cache_hits + st->stats.cache_misses > 0)
+        printf("Block cache: %lu hits, %lu misses\n", st->stats.cache_hits, st->stats.cache_misses);
+    
+    for(i = 0; i < count; ++ i) {
+        if(sizes[i] != -1L) {
+            total_size += sizes[i];
+            ++ recovered;
+        }
     }
     
-    printf("dir_name: %s\n", dir_name);
-    printf("file_name: %s\n", file_name);
+    /* throughput report */
+    if(count > 1) {
+        for(i = 0; i < count; ++ i) {
+            if(sizes[i] == -1L)
+                printf("%-40s failed\n", paths[i]);
+            else
+                printf("%-40s %10ld bytes %8.3f s %8.2f MB/s\n", paths[i], sizes[i], secs[i],
+                       secs[i] > 0 ? sizes[i] / secs[i] / (1024 * 1024) : 0.0);
+        }
+        printf("Recovered %d of %d files, %ld bytes in %.3f s (%.2f MB/s)\n", recovered, count,
+               total_size, total_secs, total_secs > 0 ? total_size / total_secs / (1024 * 1024) : 0.0);
+    }
     
-    /* find the device holding the directory */
-    if((st.device_name = file_device(dir_name)) == NULL) {
-        fprintf(stderr, "Recover aborted!\n");
-        exit(1);
+    if(st->stats.reallocated > 0)
+        printf("%lu of them had zones reallocated while they were recovered\n", st->stats.reallocated);
+    
+    if(st->report_name != NULL)
+        stats_report(st, st->report_name, recovered, total_size, total_secs);
+    
+    free(sizes);
+    free(secs);
+    return recovered;
+}
+
+/* do_carve(st, path)
+ *
+ *      carve files out of the free zones of the device holding
+ *      "path", or of the device given with -d. return the number
+ *      of files carved, -1 on error.
+ */
+int do_carve(st, path)
+dr_state *st;
+char *path;
+{
+    struct timeval start;
+    int files;
+    
+    gettimeofday(&start, NULL);
+    st->device_name = st->device_buf;
+    st->device_d = -1;
+    
+    if(st->device_path != NULL)
+        st->device_name = st->device_path;
+    else if(file_device(st, path, st->device_buf) == NULL) {
+        fprintf(stderr, "Carve of %s aborted!\n", path);
+        return(-1);
     }
-    printf("device_name: %s\n", st.device_name);
     
-    /* the output file will be in /tmp with the same file name */
-    strcpy(st.file_name, TMP);
-    strcat(st.file_name, "/");
-    strcat(st.file_name, file_name);
+    if(open_device(st) != OK) {
+        fprintf(stderr, "Carve of %s aborted!\n", path);
+        return(-1);
+    }
     
-    if(stat(st.device_name, &device_stat) == -1) {
-        fprintf(stderr, "Can not stat(2) device %s\n", st.device_name);
-        exit(1);
+    files = carve_free(st);
+    close_device(st);
+    
+    if(st->report_name != NULL)
+        stats_report(st, st->report_name, files, st->stats.bytes_written, time_since(&start));
+    return(files);
+}
+
+/* do_catalog(st, cat_name, path)
+ *
+ *      catalog the deleted entries of the device holding "path",
+ *      or of the device given with -d, into the file "cat_name".
+ */
+int do_catalog(st, cat_name, path)
+dr_state *st;
+char *cat_name;
+char *path;
+{
+    struct timeval start;
+    dr_catalog *cat;
+    int r;
+    
+    gettimeofday(&start, NULL);
+    st->device_name = st->device_buf;
+    st->device_d = -1;
+    
+    if(st->device_path != NULL)
+        st->device_name = st->device_path;
+    else if(file_device(st, path, st->device_buf) == NULL) {
+        fprintf(stderr, "Catalog of %s aborted!\n", path);
+        return ERROR;
     }
     
-    if(stat(TMP, &tmp_stat) == -1) {
-        fprintf(stderr, "Can not stat(2) directory %s\n", TMP);
-        exit(1);
+    if((cat = (dr_catalog *)calloc(1, sizeof(dr_catalog))) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return ERROR;
     }
     
-    if(access(st.file_name, F_OK) == 0) {
-        fprintf(stderr, "Will not overwrite file %s\n", st.file_name);
-        exit(1);
+    if(open_device(st) != OK) {
+        fprintf(stderr, "Catalog of %s aborted!\n", path);
+        catalog_free(cat);
+        return ERROR;
     }
     
-    /* open the output file */
-    if((st.file_f = fopen(st.file_name, "w")) == NULL) {
-        fprintf(stderr, "Can not open file %s\n", st.file_name);
-        exit(1);
+    r = catalog_build(st, cat) == OK && catalog_write(st, cat, cat_name) == OK ? OK : ERROR;
+    close_device(st);
+    
+    if(r == OK)
+        printf("Cataloged %lu deleted entries in %d directories of %s in %.3f s\n",
+               (unsigned long)cat->head.entries, cat->dir_count, st->device_name, time_since(&start));
+    else
+        fprintf(stderr, "Catalog of %s aborted!\n", path);
+    
+    if(r == OK && st->report_name != NULL)
+        stats_report(st, st->report_name, (int)cat->head.entries, 0, time_since(&start));
+    
+    catalog_free(cat);
+    return(r);
+}
+
+/* do_bench(st, rounds, count, paths, jobs)
+ *
+ *      recover the batch "paths" "rounds" times, each time into a
+ *      new directory under st->out_dir which is removed afterwards,
+ *      and print the throughput of every round, the best and median
+ *      throughput, the system calls per MB and the peak memory use.
+ *      with -R the report is of the last round.
+ */
+int do_bench(st, rounds, count, paths, jobs)
+dr_state *st;
+int rounds;
+int count;
+char **paths;
+int jobs;
+{
+    char dir[MAX_STRING + 1];
+    char *out_dir = st->out_dir;
+    char *report_name = st->report_name;
+    struct timeval start;
+    struct rusage self, children;
+    unsigned long calls;
+    double *rates;
+    double secs = 0, mb;
+    off_t bytes = 0;
+    int hist = st->stats.histogram;
+    int done = 0;
+    int r = OK;
+    
+    if((rates = (double *)calloc(rounds, sizeof(double))) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return ERROR;
     }
-     
-    /* open the device file */
-    if(stat(st.device_name, &device_stat) == -1) {
-        fprintf(stderr, "Can not find file %s\n", st.device_name);
-        exit(1);
+    
+    st->report_name = NULL;
+    
+    for(done = 0; done < rounds && r == OK; ++ done) {
+        sprintf(dir, "%s/drbench.XXXXXX", out_dir);
+        if(mkdtemp(dir) == NULL) {
+            fprintf(stderr, "Can not create a directory in %s\n", out_dir);
+            r = ERROR;
+            break;
+        }
+        
+        /* every round starts from nothing */
+        st->out_dir = dir;
+        memset(&st->stats, 0, sizeof(dr_stats));
+        st->stats.histogram = hist;
+        
+        gettimeofday(&start, NULL);
+        if(do_batch(st, count, paths, jobs) != count)
+            r = ERROR;
+        secs = time_since(&start);
+        
+        if((bytes = clear_dir(dir)) == -1L || rmdir(dir) == -1) {
+            fprintf(stderr, "Can not remove directory %s\n", dir);
+            r = ERROR;
+        }
+        
+        mb = bytes / (1024.0 * 1024);
+        calls = st->stats.reads + st->stats.writes + st->stats.seeks + st->stats.copies;
+        rates[done] = secs > 0 ? mb / secs : 0.0;
+        printf("Round %d: %ld bytes in %.3f s, %.2f MB/s, %lu system calls (%.1f per MB)\n", done + 1,
+               (long)bytes, secs, rates[done], calls, mb > 0 ? calls / mb : 0.0);
     }
     
-    /*
-    printf("# of device = %u\n# of inode is %llu\nsize of file = %lld\namount of blocks is %lld\n", device_stat.st_dev,
-           device_stat.st_ino, device_stat.st_size, device_stat.st_blocks);
-     */
+    st->out_dir = out_dir;
+    st->report_name = report_name;
     
-    /*if((device_stat.st_mode & S_IFMT) != S_IFBLK &&
-       (device_stat.st_mode & S_IFMT) != S_IFREG) {
-        fprintf(stderr, "Can only edit block special or regular files.\n");
-        exit(1);
-    }*/
+    if(r == OK) {
+        qsort(rates, rounds, sizeof(double), rate_compare);
+        getrusage(RUSAGE_SELF, &self);
+        getrusage(RUSAGE_CHILDREN, &children);
+        printf("Best %.2f MB/s, median %.2f MB/s of %d rounds, peak RSS %ld KB (workers %ld KB)\n",
+               rates[rounds - 1], (rates[(rounds - 1) / 2] + rates[rounds / 2]) / 2, rounds,
+               (long)self.ru_maxrss, (long)children.ru_maxrss);
+        
+        if(report_name != NULL)
+            stats_report(st, report_name, count, bytes, secs);
+    }
     
-    if((st.device_d = open(st.device_name, st.device_mode)) == -1) {
-        fprintf(stderr, "Can not open %s\n", st.device_name);
-        exit(1);
+    free(rates);
+    return r;
+}
+
+/* rate_compare(a, b)
+ *
+ *      qsort(3) order of two throughputs
+ */
+int rate_compare(a, b)
+const void *a;
+const void *b;
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    
+    return x < y ? -1 : x > y;
+}
+
+/* clear_dir(dir_name)
+ *
+ *      remove the files in "dir_name", returning their total size,
+ *      -1L on error.
+ */
+off_t clear_dir(dir_name)
+char *dir_name;
+{
+    char name[PATH_MAX];
+    struct stat file_stat;
+    struct dirent *d;
+    off_t total = 0;
+    DIR *dir;
+    
+    if((dir = opendir(dir_name)) == NULL)
+        return(-1L);
+    
+    while((d = readdir(dir)) != NULL) {
+        if(strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+            continue;
+        if(snprintf(name, sizeof(name), "%s/%s", dir_name, d->d_name) >= (int)sizeof(name)) {
+            total = -1L;
+            break;
+        }
+        if(lstat(name, &file_stat) == 0)
+            total += file_stat.st_size;
+        if(unlink(name) == -1)
+            total = -1L;
+        if(total == -1L)
+            break;
     }
     
-    printf("device %s has been opened, st.device_d = %d\n", st.device_name, st.device_d);
+    closedir(dir);
+    return(total);
+}
+
+/* batch_file(st, path, &secs)
+ *
+ *      recover one path of a batch, timing it in "secs".
+ *      -1L is returned on failure, otherwise the size of the
+ *      recovered file.
+ */
+off_t batch_file(st, path, secs)
+dr_state *st;
+char *path;
+double *secs;
+{
+    struct timeval start;
+    off_t size;
     
-    if((size = lseek(st.device_d, 0L, SEEK_END)) == -1) {
-        fprintf(stderr, "Error seeking %s\n", st.device_name);
-        exit(1);
+    gettimeofday(&start, NULL);
+    
+    if(batch_device(st, path) != OK || recover_file(st, path, &size) != OK) {
+        fprintf(stderr, "Recover of %s aborted!\n", path);
+        return(-1L);
+    }
+    
+    *secs = time_since(&start);
+    return(size);
+}
+
+/* batch_workers(st, count, paths, jobs, sizes, secs)
+ *
+ *      recover "paths" with "jobs" worker processes. the device of
+ *      the first path is set up before forking, so the workers
+ *      share its super block and bit maps and need not read them
+ *      again. workers take the index of the next path from a pipe
+ *      and send back a dr_result for each. a new index is handed
+ *      out for each result, so neither pipe can fill up.
+ *      ERROR is returned if no worker could be started.
+ */
+int batch_workers(st, count, paths, jobs, sizes, secs)
+dr_state *st;
+int count;
+char **paths;
+int jobs;
+off_t *sizes;
+double *secs;
+{
+    int work[2];
+    int done[2];
+    dr_result res;
+    int hist;
+    pid_t pid;
+    int started = 0;
+    int lost = 0;
+    int status;
+    int next;
+    int i;
+    
+    if(pipe(work) == -1 || pipe(done) == -1) {
+        fprintf(stderr, "Can not create worker pipes\n");
+        return ERROR;
     }
     
-    //printf("size = %ld\n", size);
+    /* the shared, read-only part of the state */
+    if(batch_device(st, paths[0]) == OK)
+        load_bit_map(st);
+    
+    for(i = 0; i < count; ++ i)
+        sizes[i] = -1L;
+    
+    fflush(stdout);
+    fflush(stderr);
+    
+    for(i = 0; i < jobs && i < count; ++ i) {
+        if((pid = fork()) == -1)
+            break;
+        
+        if(pid == 0) {
+            /* worker: own cursor, buffers, cache and output file */
+            close(work[1]);
+            close(done[0]);
+            /* count only what this worker does */
+            hist = st->stats.histogram;
+            memset(&st->stats, 0, sizeof(dr_stats));
+            st->stats.histogram = hist;
+            throttle_share(st->throttle, jobs < count ? jobs : count);
+            while(read(work[0], &res.index, sizeof(res.index)) == sizeof(res.index)) {
+                res.size = batch_file(st, paths[res.index], &res.secs);
+                if(write(done[1], &res, sizeof(res)) != sizeof(res))
+                    break;
+            }
+            close_device(st);
+            
+            /* an index of -1 carries the figures of the worker */
+            res.index = -1;
+            res.stats = st->stats;
+            status = write(done[1], &res, sizeof(res)) == sizeof(res) ? 0 : 1;
+            fflush(stdout);
+            _exit(status);
+        }
+        ++ started;
+    }
+    
+    close(work[0]);
+    close(done[1]);
+    
+    if(started == 0) {
+        close(work[1]);
+        close(done[0]);
+        return ERROR;
+    }
+    
+    /* two paths for each worker to start with, then one for each
+     * result; writes of an int to a pipe are atomic */
+    for(next = 0; next < count && next < 2 * started; ++ next) {
+        if(write(work[1], &next, sizeof(next)) != sizeof(next))
+            break;
+    }
+    if(next == count)
+        close(work[1]);
+    
+    while(read(done[0], &res, sizeof(res)) == sizeof(res)) {
+        if(res.index == -1)
+            stats_merge(&st->stats, &res.stats);
+        else if(res.index >= 0 && res.index < count) {
+            sizes[res.index] = res.size;
+            secs[res.index] = res.secs;
+            
+            if(next < count) {
+                if(write(work[1], &next, sizeof(next)) != sizeof(next))
+                    next = count;
+                else
+                    ++ next;
+                if(next == count)
+                    close(work[1]);
+            }
+        }
+    }
+    if(next < count)
+        close(work[1]);
+    close(done[0]);
+    
+    while(started > 0 && wait(&status) != -1) {
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            lost = 1;
+        -- started;
+    }
+    if(lost)
+        fprintf(stderr, "A worker failed, its figures are not in the totals\n");
+    
+    return OK;
+}
+
+/* recover_file(st, path, &size)
+ *
+ *      recover the deleted file "path" from the already opened
+ *      device into st->out_dir. if the name was deleted more than once,
+ *      every copy is recovered, all but the first with their
+ *      i-node number appended to the name. the total size of the
+ *      recovered files is returned in "size".
+ */
+int recover_file(st, path, size)
+dr_state *st;
+char *path;
+off_t *size;
+{
+    char dir_name[MAX_STRING + 1];
+    char file_name[MAX_STRING + 1];
+    
+    struct stat tmp_stat;
+    
+    ino_t inodes[DEL_MATCHES];   /* inode numbers of files which need to be recovered */
+    dr_cat_ent *ents[DEL_MATCHES];  /* or their catalog entries */
+    dr_timer t;
+    off_t one;
+    int count;
+    int recovered = 0;
+    int i, n, r;
     
-    if(size % K != 0) {
-        printf("Device size is not a multiple of 4096\n");
-        printf("The (partial) last block will not be accessible\n");
+    /* data structure construction */
+    /* split the path name into a directory and a file name */
+    if(!split_dir_file(st, path, dir_name, file_name)) {
+        fprintf(stderr, "Path name error!\n");
+        return ERROR;
     }
     
-    /* initialize the rest of state record */
-    sync();
+    DR_TRACE(("dir_name: %s\n", dir_name));
+    DR_TRACE(("file_name: %s\n", file_name));
     
-    printf("Read super block...\n");
-    read_super_block(&st);
-    read_bit_map(&st);
-    st.address = 0L;
+    if(!st->out.stream && stat(st->out_dir, &tmp_stat) == -1) {
+        fprintf(stderr, "Can not stat(2) directory %s\n", st->out_dir);
+        return ERROR;
+    }
     
     /* recover percedure */
-    inode = find_del_entry(&st, str);
-    printf("The inode number for the file to be recovered is %ld\n", inode);
+    timer_start(&t);
+    if(st->catalog != NULL)
+        count = catalog_find(st, st->catalog, path, ents, DEL_MATCHES);
+    else
+        count = find_del_entry(st, path, inodes, DEL_MATCHES);
+    timer_stop(st, PH_DIR, &t);
     
-    if(inode == 0) {
-        unlink(st.file_name);
-        fprintf(stderr, "Recover aborted: inode error!");
-        exit(1);
+    if(count == 0) {
+        fprintf(stderr, "Recover aborted: inode error!\n");
+        return ERROR;
+    }
+    
+    /* a stream gets only the first match */
+    if(st->out.stream && count > 1)
+        count = 1;
+    
+    *size = 0;
+    for(i = 0; i < count; ++ i) {
+        if(st->catalog != NULL)
+            inodes[i] = (ino_t)ents[i]->inode;
+        
+        /* the output file will be in st->out_dir with the same file name */
+        if(i == 0)
+            n = snprintf(st->file_name, sizeof(st->file_name), "%s/%s", st->out_dir, file_name);
+        else
+            n = snprintf(st->file_name, sizeof(st->file_name), "%s/%s.%lu", st->out_dir, file_name,
+                         (unsigned long)inodes[i]);
+        if(n >= (int)sizeof(st->file_name)) {
+            fprintf(stderr, "Output file name for %s too long\n", path);
+            continue;
+        }
+        
+        r = st->catalog != NULL ? catalog_recover(st, ents[i], &one) : recover_inode(st, inodes[i], &one);
+        if(r == OK || r == DR_ECHANGED) {
+            *size += one;
+            ++ recovered;
+        }
     }
     
-    st.address = ((long)st.first_data - st.inode_blocks) * K + (long)(inode - 1) * st.inode_size;
-    printf("The address of i-node %ld is: %ld\n", inode, st.address);
+    return recovered > 0 ? OK : ERROR;
+}
+
+/* recover_inode(st, inode, &size)
+ *
+ *      recover the file of the deleted i-node "inode" into
+ *      st->file_name, returning its size in "size". DR_ECHANGED
+ *      is returned if it was recovered but may hold other data.
+ */
+int recover_inode(st, inode, size)
+dr_state *st;
+ino_t inode;
+off_t *size;
+{
+    dr_timer t;
+    int r;
+    
+    DR_TRACE(("The inode number for the file to be recovered is %ld\n", inode));
+    
+    if(!st->out.stream && access(st->file_name, F_OK) == 0) {
+        fprintf(stderr, "Will not overwrite file %s\n", st->file_name);
+        return ERROR;
+    }
+    
+    /* open the output file */
+    if(out_open(st) != OK)
+        return ERROR;
+    
+    st->address = inode_addr(st, inode);
+    DR_TRACE(("The address of i-node %ld is: %ld\n", inode, st->address));
     
     /* read inode block */
-    read_block(&st, st.buffer);
+    timer_start(&t);
+    r = read_block(st, st->buffer) != NULL;
+    timer_stop(st, PH_INODE, &t);
+    
+    if(!r) {
+        out_abort(st);
+        fprintf(stderr, "Recover aborted: can not read i-node!\n");
+        return ERROR;
+    }
     
-    printf("i-node of the file has been read...\n");
+    DR_TRACE(("i-node of the file has been read...\n"));
     
     
     /* have found the lost i-node, now extract the block */
-    if((size = recover_blocks(&st)) == -1L) {
-        unlink(st.file_name);
+    timer_start(&t);
+    st->ncopied = 0;
+    r = (*size = recover_blocks(st)) != -1L && (st->async == NULL || async_drain(st) == OK);
+    timer_stop(st, PH_COPY, &t);
+    
+    if(!r) {
+        if(st->async != NULL)
+            async_drain(st);
+        out_abort(st);
         fprintf(stderr, "Recover aborted: recover block error!\n");
-        exit(1);
+        return ERROR;
+    }
+    
+    if(out_close(st) != OK) {
+        fprintf(stderr, "Problem writing %s\n", st->file_name);
+        return ERROR;
+    }
+    
+    if(st->out.stream)
+        printf("Recovered %ld bytes, written to the output stream\n", *size);
+    else
+        printf("Recovered %ld bytes, written to file %s\n", *size, st->file_name);
+    return copy_verify(st, st->copied, st->ncopied);
+}
+
+/* read_path_list(list_name, &count)
+ *
+ *      read one path name per line from "list_name", or from
+ *      stdin if "list_name" is NULL or "-".
+ */
+char **read_path_list(list_name, count)
+char *list_name;
+int *count;
+{
+    FILE *f = stdin;
+    char line[MAX_STRING + 2];
+    char **paths = NULL;
+    int slots = 0;
+    size_t len;
+    
+    *count = 0;
+    
+    if(list_name != NULL && strcmp(list_name, "-") != 0 && (f = fopen(list_name, "r")) == NULL) {
+        fprintf(stderr, "Can not open list file %s\n", list_name);
+        return(NULL);
+    }
+    
+    while(fgets(line, sizeof(line), f) != NULL) {
+        len = strlen(line);
+        if(len > 0 && line[len - 1] == '\n')
+            line[-- len] = '\0';
+        else if(!feof(f)) {
+            fprintf(stderr, "Path name too long in list: %s...\n", line);
+            while(fgets(line, sizeof(line), f) != NULL && strchr(line, '\n') == NULL)
+                ;
+            continue;
+        }
+        if(len == 0)
+            continue;
+        
+        if(*count == slots) {
+            slots = slots ? slots * 2 : 64;
+            if((paths = (char **)realloc(paths, slots * sizeof(char *))) == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        if((paths[*count] = strdup(line)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        ++ *count;
+    }
+    
+    if(f != stdin)
+        fclose(f);
+    
+    if(*count == 0) {
+        fprintf(stderr, "No path names to recover\n");
+        return(NULL);
     }
     
-    printf("Recovered %ld bytes, written to file %s\n", size, st.file_name);
+    return(paths);
 }
 
 /* do_test()
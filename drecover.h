@@ -10,99 +10,725 @@
 
 #include <stdio.h>
 #include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "libdrecover.h"
 
 /* constants for general use */
 #define     MAX_STRING        128       /* max length of input string line */
 
-/* constants for block */
-#define     K               4096        /* Block size for the file system */
-#define     K_MASK          (~(K - 1))
-#define     K_SHIFT         12
+/* constants for block, the geometry itself comes from the super block */
+#define     MAX_BLOCK_SIZE  32768       /* largest block size, s_block_size is 16 bits */
+#define     MAX_ZONE_SIZE   (64L * 1024 * 1024)     /* largest zone handled */
 
 /* files */
 #define     TMP         "/tmp"	     /* for output */
 #define     DEV         "/dev"
+#define     DEV_NAME_MAX    (sizeof(DEV) + NAME_MAX)    /* "/dev/" and a name */
 
 /* return values */
 #define     OK              0
 #define     ERROR           -1
 
-#ifndef I_MAP_SLOTS
-#define I_MAP_SLOTS         128
-#define Z_MAP_SLOTS         128
-#endif	
+/* directory search */
+#define     DEL_MATCHES     16          /* deleted entries recovered for one name */
+
+/* multi-block reads */
+#define     RUN_BLOCKS      64          /* data blocks read per batch */
+
+#ifndef IOV_MAX
+#define IOV_MAX             16
+#endif
+
+#if (defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__)) && !defined(__minix)
+#define HAVE_PREADV         1           /* positional vectored reads */
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 27)
+#define HAVE_COPY_FILE_RANGE 1          /* in-kernel copies */
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__)
+#define HAVE_SPLICE         1           /* splice() and vmsplice() into pipes */
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 14)
+#define HAVE_SYNCFS         1           /* flush one file system */
+#endif
+
+#if defined(_POSIX_ASYNCHRONOUS_IO) && _POSIX_ASYNCHRONOUS_IO > 0
+#define HAVE_AIO            1           /* POSIX asynchronous I/O */
+#include <aio.h>
+#endif
+
+/* verbose tracing, compiled in with -DDR_VERBOSE */
+#ifdef DR_VERBOSE
+#define     DR_TRACE(args)  printf args
+#else
+#define     DR_TRACE(args)
+#endif
+
+/* instrumentation */
+#define     PH_SUPER        0           /* phases timed */
+#define     PH_MAPS         1
+#define     PH_DIR          2
+#define     PH_INODE        3
+#define     PH_COPY         4
+#define     NR_PHASES       5
+#define     HIST_BUCKETS    24          /* read_disk() latencies up to 2^23 us */
+
+/* output writer */
+#define     OUT_BYTES       (1024 * 1024)       /* output buffer */
+#define     OUT_ALIGN       4096                /* its alignment */
+
+/* reads past the page cache, see dev_open() */
+#define     DIRECT_NONE     0           /* st->direct: through the page cache */
+#define     DIRECT_IO       1           /* opened with O_DIRECT */
+#define     DIRECT_DROP     2           /* pages dropped after they are read */
+#define     DIRECT_ALIGN    4096        /* of O_DIRECT reads and of read buffers */
+#define     DIRECT_BOUNCE   (256 * 1024)        /* unaligned bytes read at a time */
+
+/* batches in disk order */
+#define     ELEV_OPEN       64          /* output files kept open by a sweep */
+
+/* block cache */
+#define     CACHE_BLOCKS    256         /* default number of cached blocks */
+
+/* signature carving */
+#define     MAX_SIG         16          /* longest header or footer */
+#define     CARVE_BYTES     (4 * 1024 * 1024)   /* free zones read at a time */
+#define     CARVE_MAX       (64L * 1024 * 1024) /* largest file for a user signature */
+
+#define     SIG_OPEN        0           /* ends at the next header */
+#define     SIG_FOOTER      1           /* ends after its footer */
+#define     SIG_SQLITE      2           /* size from an SQLite header */
+#define     SIG_ELF         3           /* size from an ELF header */
+
+/* recovery catalog */
+#define     CAT_MAGIC       0x31544344  /* "DCT1" in host byte order */
+#define     CAT_OK          DR_ENTRY_OK         /* i-node and zones were free */
+#define     CAT_REUSED      DR_ENTRY_REUSED     /* the i-node was in use again */
+#define     CAT_LOST        DR_ENTRY_LOST       /* its zones were in use or illegal */
+
+/* daemon */
+#define     DAEMON_CHECK    5           /* seconds between checks of the bit maps when idle */
+#define     DAEMON_CLIENTS  32          /* clients served at once */
+#define     DAEMON_LINE     (PATH_MAX + 16)     /* longest request or reply */
+
+/* throttle */
+#define     THROTTLE_BURST  0.1         /* seconds of tokens saved up */
+#define     THROTTLE_WINDOW 0.1         /* seconds of reads averaged to adapt */
+#define     THROTTLE_STEP   (1.0 / 16)  /* raise of the rates after a fast window */
+#define     THROTTLE_MIN    (1.0 / 64)  /* lowest scale of the rates */
+
+/* bit maps */
+#define     MAP_INODE       1           /* in_use() and map_chunk() modes */
+#define     MAP_ZONE        0
+#define     BITCHUNK_BITS   (sizeof(bitchunk_t) * CHAR_BIT)
+
+typedef struct dr_cache {
+    int slots;                      /* number of cached blocks */
+    int block_size;                 /* size of each cached block */
+    int hand;                       /* clock hand */
+    int buckets;                    /* hash buckets, a power of 2 */
+    zone_t *block;                  /* block number held in each slot */
+    unsigned char *ref;             /* clock reference bits */
+    int *next;                      /* hash chain links */
+    int *hash;                      /* first slot in each bucket */
+    char *data;                     /* slots * block_size bytes */
+    
+    unsigned long hits;
+    unsigned long misses;
+} dr_cache;
+
+/* asynchronous read pipeline */
+typedef struct dr_async_op {
+#ifdef HAVE_AIO
+    struct aiocb cb;
+#endif
+    off_t len;                      /* bytes read, or length of a hole */
+    int hole;                       /* non zero for a hole */
+    struct timeval start;           /* when the read was issued, for the throttle */
+} dr_async_op;
+
+typedef struct dr_async {
+    int depth;                      /* requests kept in flight */
+    int head;                       /* oldest request */
+    int count;                      /* requests queued */
+    size_t chunk;                   /* largest single read */
+    dr_async_op *ops;
+    char *data;                     /* depth * chunk bytes */
+} dr_async;
+
+/* buffered output file, written at its offset */
+typedef struct dr_out {
+    char *buf;                      /* OUT_BYTES, aligned */
+    size_t fill;                    /* bytes in buf */
+    off_t pos;                      /* file offset of buf */
+    off_t written;                  /* end of the data written or allocated */
+    int stream;                     /* non zero to write to stream_fd in order */
+    int stream_fd;
+    int pipe;                       /* stream_fd is a pipe, splice into it */
+} dr_out;
+
+/* a run of physically contiguous zones, start is NO_ZONE for a hole */
+typedef struct dr_extent {
+    zone_t start;                   /* first zone of the run */
+    zone_t length;                  /* number of zones */
+} dr_extent;
+
+/* an i-node as decoded from either layout */
+typedef struct dr_inode {
+    mode_t mode;
+    off_t size;
+    time_t mtime;
+    zone_t zone[V2_NR_TZONES];      /* NO_ZONE past those of the layout */
+} dr_inode;
+
+/* on-disk layout of a file system version, see dr_layout.c */
+typedef struct dr_layout {
+    char *name;
+    unsigned inode_size;            /* size of disk inode */
+    unsigned zone_num_size;         /* size of disk zone num */
+    int ndzones;                    /* number of direct zones in an inode */
+    _PROTOTYPE(void (*inode), (char *p, dr_inode *ip));
+    _PROTOTYPE(void (*ptrs), (char *bp, zone_t *zones, int count));
+} dr_layout;
+
+/* a file of an elevator ordered batch, see dr_elevator.c */
+typedef struct dr_elev_file {
+    char name[MAX_STRING + 1];
+    int fd;                         /* -1 while it is not open */
+    int created;                    /* on its first piece */
+    int used;                       /* piece last written, to pick one to close */
+    int index;                      /* of its path in the batch */
+    int last;                       /* its last piece in disk order */
+    int failed;
+    int changed;                    /* zones reallocated while copied */
+    int done;                       /* closed */
+    off_t size;
+} dr_elev_file;
+
+/* a run of zones to copy to one place in one file */
+typedef struct dr_elev_piece {
+    zone_t zone;                    /* first zone */
+    int file;
+    off_t offset;                   /* in the file */
+    off_t len;
+} dr_elev_piece;
+
+typedef struct dr_elevator {
+    dr_elev_file *files;
+    int nfiles;
+    int file_slots;
+    dr_elev_piece *pieces;
+    int npieces;
+    int piece_slots;
+    int nopen;                      /* files open, at most ELEV_OPEN */
+    struct timeval start;           /* of the batch */
+} dr_elevator;
+
+/* start of a timed phase */
+typedef struct dr_timer {
+    struct timeval wall;
+    clock_t cpu;
+} dr_timer;
+
+typedef struct dr_stats {
+    double wall[NR_PHASES];         /* seconds per phase */
+    double cpu[NR_PHASES];
+    unsigned long calls[NR_PHASES];
+    
+    unsigned long reads;            /* system calls */
+    unsigned long writes;
+    unsigned long seeks;
+    unsigned long copies;           /* copy_file_range() */
+    off_t bytes_read;
+    off_t bytes_written;
+    unsigned long blocks;           /* data zones recovered */
+    unsigned long holes;            /* zones left as holes */
+    unsigned long reallocated;      /* files with zones reallocated while copied */
+    unsigned long throttled;        /* reads delayed by the throttle */
+    double throttled_secs;          /* and the time they were delayed */
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    
+    int histogram;                  /* non zero to time read_disk() */
+    unsigned long hist[HIST_BUCKETS];
+} dr_stats;
+
+/* limits on the rate of reads, see dr_throttle.c */
+typedef struct dr_throttle {
+    double bytes_rate;              /* bytes per second, 0 for no limit */
+    double ios_rate;                /* reads per second, 0 for no limit */
+    double latency;                 /* seconds a read may take, 0 not to adapt */
+    double scale;                   /* of the rates, lowered when reads are slow */
+    double bytes;                   /* tokens, below 0 when owed */
+    double ios;
+    double last;                    /* when tokens were last added */
+    double window;                  /* start of the current window */
+    double window_bytes;            /* read in it */
+    double lat_sum;                 /* latencies of its reads */
+    unsigned long lat_count;
+} dr_throttle;
+
+/* block devices by device number */
+typedef struct dr_devent {
+    dev_t rdev;
+    char name[DEV_NAME_MAX + 1];
+} dr_devent;
+
+typedef struct dr_devidx {
+    int count;
+    dr_devent *ents;                /* sorted by rdev */
+} dr_devidx;
+
+/* a file signature for carving */
+typedef struct dr_sig {
+    char ext[8];                    /* extension of carved files */
+    unsigned char head[MAX_SIG];
+    int head_len;
+    unsigned char foot[MAX_SIG];
+    int foot_len;                   /* 0 for no footer */
+    int kind;                       /* SIG_* */
+    off_t max_size;                 /* largest file carved */
+    struct dr_sig *next;            /* next with the same first header byte */
+} dr_sig;
+
+typedef struct dr_carve {
+    dr_sig *first[UCHAR_MAX + 1];   /* signatures by first header byte */
+    
+    /* file being carved */
+    dr_sig *sig;                    /* NULL if none */
+    zone_t zone;                    /* its first zone */
+    off_t size;                     /* bytes so far */
+    off_t want;                     /* size from its header, 0 if unknown */
+    int found;                      /* none zero once its end is found */
+    int fd;
+    char *out;                      /* its data not yet written */
+    unsigned char seam[MAX_SIG];    /* end of the previous zone, for footers */
+    int seam_len;
+    char name[MAX_STRING + 1];
+    int files;                      /* files carved */
+    
+    /* double buffered reads */
+    char *buf[2];
+    int busy[2];                    /* read in flight */
+    struct timeval start[2];        /* since when, for the throttle */
+#ifdef HAVE_AIO
+    struct aiocb cb[2];
+#endif
+} dr_carve;
+
+/* recovery catalog file: a dr_cat_head, then its entries, extents
+ * and names, written and read on the same kind of machine */
+typedef struct dr_cat_head {
+    uint32_t magic;                 /* CAT_MAGIC */
+    uint32_t block_size;            /* geometry of the device cataloged */
+    uint32_t zone_size;
+    uint32_t zones;
+    uint32_t inodes;
+    uint32_t inode_start;
+    uint32_t first_data;
+    uint32_t device;                /* offset of the device name in the names */
+    uint32_t built;                 /* time of the build */
+    uint32_t entries;
+    uint32_t extents;
+    uint32_t names;                 /* bytes of names */
+} dr_cat_head;
+
+/* a deleted directory entry */
+typedef struct dr_cat_ent {
+    uint64_t size;                  /* from its i-node */
+    uint32_t inode;                 /* original i-node, from the end of the name */
+    uint32_t parent;                /* i-node of the directory */
+    uint32_t path;                  /* offset of the full path in the names */
+    uint32_t mtime;
+    uint32_t extent;                /* first extent */
+    uint32_t count;                 /* number of extents */
+    uint16_t mode;
+    uint16_t state;                 /* CAT_* */
+    uint32_t indirects;             /* extents of its indirect zones, after those */
+} dr_cat_ent;
+
+/* a directory still to be read while a catalog is built */
+typedef struct dr_cat_dir {
+    ino_t inode;
+    uint32_t path;                  /* offset of its path in the names */
+} dr_cat_dir;
+
+/* an entry and its path, for sorting */
+typedef struct dr_cat_key {
+    char *path;
+    dr_cat_ent ent;
+} dr_cat_key;
+
+typedef struct dr_catalog {
+    dr_cat_head head;
+    dr_cat_ent *ents;               /* sorted by path */
+    dr_extent *exts;
+    char *names;
+    
+    /* while it is built */
+    int ent_slots;
+    int ext_slots;
+    int name_slots;
+    unsigned char *is_dir;          /* a bit for each live directory i-node */
+    dr_cat_dir *dirs;               /* directories in the order they are read */
+    int dir_count;
+    int dir_slots;
+} dr_catalog;
 
 typedef struct dr_state {
     /* information from super block */
 	unsigned inodes;                /* number of inodes */
-	zone_t zones;                   /* total number of blocks */
+	zone_t zones;                   /* total number of zones */
     unsigned inode_maps;            /* number of inode bitmap blocks */
     unsigned zone_maps;             /* number of zone bitmap blocks */
     unsigned inode_blocks;          /* inode blocks */
-    unsigned first_data;            /* total non-data blocks */
+    unsigned inode_start;           /* first inode block */
+    unsigned first_data;            /* first data zone */
     int magic;                      /* Magic number */
     
-    bit_t isearch;                  /* inodes below this bit number are in use */
-    bit_t zsearch;                  /* all zones below this bit number are in use */
-    
     /* information derived from the magic number */
     unsigned char is_fs;            /* none zero for good fs */
     unsigned char v1;               /* none zero for v1 fs */
+    dr_layout *layout;              /* its i-nodes and indirect blocks */
     unsigned inode_size;            /* size of disk inode */
     unsigned nr_indirects;          /* number of indirect blocks */
     unsigned zone_num_size;         /* size of disk zone num */
     int block_size;                 /* file system block size */
+    int log_zone_size;              /* log2 of blocks per zone */
+    off_t zone_size;                /* bytes per zone */
     
     /* other derived numbers */
     bit_t inodes_in_map;            /* bits in inode map */
     bit_t zones_in_map;             /* bits in zone map */
     int ndzones;                    /* number of direct zones in an inode */
     
-    /* information from map blocks */
-    bitchunk_t inode_map[ I_MAP_SLOTS * K / sizeof (bitchunk_t) ];
-    bitchunk_t zone_map[ Z_MAP_SLOTS * K / sizeof (bitchunk_t) ];
+    /* information from map blocks, sized from the super block and
+     * read a block at a time on first access, see map_chunk() */
+    bitchunk_t *inode_map;
+    bitchunk_t *zone_map;
+    unsigned char *imap_loaded;     /* non zero for each map block read */
+    unsigned char *zmap_loaded;
     
     /* information for current block */
     off_t address;                  /* current address */
     off_t last_addr;                /* for erasing ptrs */
     zone_t block;                   /* current block */
     unsigned offset;                /* offset within block */
+    char *bp;                       /* data of current block */
     
     char sbuf[_MIN_BLOCK_SIZE];     /* buffer for super block */
-    char buffer[_MAX_BLOCK_SIZE];   /* general buffer */
+    
+    /* work buffers, sized from the super block */
+    char *buffer;                   /* general buffer, one block */
+    char *indir;                    /* one indirect block per level */
+    zone_t *ptrs;                   /* zone pointers of one indirect block per level */
+    dr_extent *extents;             /* extents of one zone list */
+    char *run;                      /* copy buffer, allocated on first use */
+    size_t run_size;
     
     /* search information */
     char search_string[MAX_STRING + 1];
     
     /* file information */
+    char *device_path;              /* device given by the user, NULL to look it up */
+    dr_devidx *devidx;              /* devices in DEV, built on first use */
     char *device_name;
+    char device_buf[DEV_NAME_MAX + 1];
     int device_d;
     int device_mode;
+    int no_copy_range;              /* copy_file_range() not supported */
+    int no_map;                     /* do not map image files */
+    int uncached;                   /* keep reads out of the page cache */
+    int direct;                     /* DIRECT_* mode the device was opened in */
+    char *bounce;                   /* for unaligned reads under O_DIRECT */
+    char *map;                      /* device mapping, NULL if not mapped */
+    off_t map_size;
     zone_t device_size;             /* number of blocks */
     
+    /* metadata block cache */
+    int cache_blocks;               /* size of cache, 0 for none */
+    dr_cache *cache;
+    
+    /* asynchronous data reads */
+    int queue_depth;                /* reads in flight, 1 for synchronous */
+    dr_async *async;
+    
+    /* user signatures for carving */
+    dr_sig *sigs;
+    int sig_count;
+    
+    /* deleted entries looked up in a catalog, NULL to read directories */
+    dr_catalog *catalog;
+    
+    /* zones the file being recovered was copied from, see copy_verify() */
+    dr_extent *copied;
+    int ncopied;
+    int copied_slots;
+    char *sync_dir;                 /* on the mounted device, for dev_sync() */
+    dr_throttle *throttle;          /* NULL to read at full speed */
+    dr_entry *entries;              /* the catalog for dr_list() */
+    
+    /* messages, see dr_msg() */
+    dr_log_fn log;                  /* NULL to print them */
+    void *log_arg;
+    int quiet;                      /* drop them instead */
+    
+    /* instrumentation */
+    dr_stats stats;
+    char *report_name;              /* JSON report, NULL for none */
+    char *out_dir;                  /* where recovered files go, TMP by default */
+    
     char file_name[MAX_STRING + 1];
-    FILE *file_f;
+    int file_d;
+    dr_out out;
+    int prealloc;                   /* preallocate output files */
+    int elevator;                   /* copy a batch in disk order */
 } dr_state;
 
+/* result of one file of a batch, sent back by a worker in one
+ * write(), which a pipe keeps whole as it is below PIPE_BUF */
+typedef struct dr_result {
+    int index;                      /* index of the path, -1 when the worker is done */
+    off_t size;                     /* size recovered, -1 on failure */
+    double secs;                    /* time taken */
+    dr_stats stats;                 /* with an index of -1, the figures of the worker */
+} dr_result;
+
+/* a daemon serving one device, see dr_daemon.c */
+typedef struct dr_daemon {
+    char *name;                     /* path of its socket */
+    int fd;                         /* listening on it */
+    int clients;                    /* children serving a client */
+    time_t checked;                 /* when the bit maps were last checked */
+    time_t mtime;                   /* of an image file at that check */
+} dr_daemon;
+
 /* function referenes */
 /* drecover.c */
 _PROTOTYPE(int main, (int argc, char *argv[]));
-_PROTOTYPE(void do_recover, (char *str));
+_PROTOTYPE(void usage, (char *command));
+_PROTOTYPE(int get_count, (int option, char *str, int min));
+_PROTOTYPE(int do_batch, (dr_state *st, int count, char **paths, int jobs));
+_PROTOTYPE(off_t batch_file, (dr_state *st, char *path, double *secs));
+_PROTOTYPE(int batch_workers, (dr_state *st, int count, char **paths, int jobs, off_t *sizes, double *secs));
+_PROTOTYPE(int recover_file, (dr_state *st, char *path, off_t *size));
+_PROTOTYPE(int recover_inode, (dr_state *st, ino_t inode, off_t *size));
+_PROTOTYPE(char **read_path_list, (char *list_name, int *count));
 _PROTOTYPE(void do_test, (char *fstr));
+_PROTOTYPE(int do_carve, (dr_state *st, char *path));
+_PROTOTYPE(int do_catalog, (dr_state *st, char *cat_name, char *path));
+_PROTOTYPE(int do_bench, (dr_state *st, int rounds, int count, char **paths, int jobs));
+_PROTOTYPE(int rate_compare, (const void *a, const void *b));
+_PROTOTYPE(off_t clear_dir, (char *dir_name));
 
 /* dr_recover.c */
-_PROTOTYPE(int split_dir_file, (char *path_name, char **dir_name, char **file_name));
-_PROTOTYPE(char *file_device, (char *file_name));
-_PROTOTYPE(ino_t find_del_entry, (dr_state *st, char *path_name));
+_PROTOTYPE(int batch_device, (dr_state *st, char *path));
+_PROTOTYPE(int copied_add, (dr_state *st, dr_extent *x));
+_PROTOTYPE(int copy_verify, (dr_state *st, dr_extent *x, int n));
+_PROTOTYPE(int split_dir_file, (dr_state *st, char *path_name, char *directory, char *filename));
+_PROTOTYPE(char *file_device, (dr_state *st, char *file_name, char *device_name));
+_PROTOTYPE(int find_del_entry, (dr_state *st, char *path_name, ino_t *inodes, int max));
+_PROTOTYPE(ino_t mounted_dir, (dr_state *st, char *path_name, char *dir_name));
+_PROTOTYPE(ino_t path_inode, (dr_state *st, char *path_name));
+_PROTOTYPE(int scan_dir, (dr_state *st, zone_t *zones, int count, off_t size, char *file_name, int deleted, ino_t *inodes, int max));
+_PROTOTYPE(void entry_key, (char *file_name, int deleted, uint64_t *key, uint64_t *mask));
+_PROTOTYPE(int match_entries, (dr_state *st, char *block, int entries, char *file_name, int deleted, uint64_t key, uint64_t mask, ino_t *inodes, int max));
+_PROTOTYPE(off_t inode_addr, (dr_state *st, ino_t inode));
+_PROTOTYPE(int inode_zones, (dr_state *st, ino_t inode, zone_t **zones, off_t *size));
+_PROTOTYPE(int zone_ptrs, (dr_state *st, zone_t block, zone_t *zones, int count, char *buffer));
+_PROTOTYPE(int indirect_zones, (dr_state *st, dr_inode *di, zone_t *zones));
 _PROTOTYPE(ino_t find_inode, (dr_state *st, char *filename));
 _PROTOTYPE(off_t recover_blocks, (dr_state *st));
 _PROTOTYPE(int in_use, (bit_t bit, dr_state *st, int mode));
-_PROTOTYPE(int data_block, (dr_state *st, zone_t block, off_t *file_size));
+_PROTOTYPE(int data_blocks, (dr_state *st, zone_t *zones, int count, off_t *file_size));
+_PROTOTYPE(int zone_extents, (dr_state *st, zone_t *zones, int count, dr_extent *extents));
+_PROTOTYPE(int zone_runs, (dr_state *st, zone_t *zones, int count, dr_extent *extents));
+_PROTOTYPE(int copy_extent, (dr_state *st, dr_extent *x, off_t *file_size));
+_PROTOTYPE(int skip_hole, (dr_state *st, off_t len));
 _PROTOTYPE(int free_block, (dr_state *st, zone_t block));
 _PROTOTYPE(int indirect, (dr_state *st, zone_t block, off_t *file_size, int dblind));
 
 /* dr_dio.c */
-_PROTOTYPE(void read_disk, (dr_state *st, off_t block_addr, char *buffer));
-_PROTOTYPE(void read_block, (dr_state *st, char *buffer));
-_PROTOTYPE(void read_super_block, (dr_state *st));
-_PROTOTYPE(void read_bit_map, (dr_state *st));
\ No newline at end of file
+_PROTOTYPE(void dev_map, (dr_state *st));
+_PROTOTYPE(void dev_unmap, (dr_state *st));
+_PROTOTYPE(int dev_open, (dr_state *st));
+_PROTOTYPE(char *dev_alloc, (size_t size));
+_PROTOTYPE(int dev_aligned, (dr_state *st, off_t addr, char *buffer, size_t len));
+_PROTOTYPE(int dev_direct, (dr_state *st, off_t addr, char *buffer, size_t len));
+_PROTOTYPE(void dev_drop, (dr_state *st, off_t addr, off_t len));
+_PROTOTYPE(int dev_read, (dr_state *st, off_t addr, char *buffer, size_t len));
+_PROTOTYPE(int read_blocks, (dr_state *st, zone_t *blocks, int count, char **buffers));
+_PROTOTYPE(int copy_range, (dr_state *st, off_t addr, off_t len));
+_PROTOTYPE(void dev_prefetch, (dr_state *st, zone_t *blocks, int count));
+_PROTOTYPE(char *read_disk, (dr_state *st, off_t block_addr, char *buffer));
+_PROTOTYPE(char *disk_block, (dr_state *st, off_t block_addr, char *buffer));
+_PROTOTYPE(char *read_block, (dr_state *st, char *buffer));
+_PROTOTYPE(int read_super_block, (dr_state *st));
+_PROTOTYPE(int read_bit_map, (dr_state *st));
+_PROTOTYPE(int load_bit_map, (dr_state *st));
+_PROTOTYPE(int reload_bit_map, (dr_state *st, long *inodes, long *zones));
+_PROTOTYPE(long map_reload, (dr_state *st, int mode));
+_PROTOTYPE(int map_reread, (dr_state *st, dr_extent *x, int n));
+_PROTOTYPE(bitchunk_t *map_chunk, (dr_state *st, int mode, bit_t bit));
+_PROTOTYPE(int alloc_buffers, (dr_state *st));
+_PROTOTYPE(void free_buffers, (dr_state *st));
+_PROTOTYPE(void dev_sync, (dr_state *st));
+_PROTOTYPE(int open_device, (dr_state *st));
+_PROTOTYPE(void close_device, (dr_state *st));
+
+/* dr_bitmap.c */
+_PROTOTYPE(int bit_test, (dr_state *st, int mode, bit_t bit));
+_PROTOTYPE(int map_words, (dr_state *st, int mode, bit_t bit, bit_t count, uint64_t **words, int *lo, int *hi));
+_PROTOTYPE(uint64_t word_mask, (int lo, int hi));
+_PROTOTYPE(int range_free, (dr_state *st, int mode, bit_t bit, bit_t count));
+_PROTOTYPE(int popcount, (uint64_t w));
+_PROTOTYPE(bit_t count_used, (dr_state *st, int mode, bit_t bit, bit_t count));
+_PROTOTYPE(bit_t find_bit, (dr_state *st, int mode, bit_t bit, bit_t limit, int value));
+_PROTOTYPE(int extents_free, (dr_state *st, dr_extent *x, int n));
+
+/* dr_carve.c */
+_PROTOTYPE(int parse_hex, (char *str, unsigned char *out, int max));
+_PROTOTYPE(int add_signature, (dr_state *st, char *spec));
+_PROTOTYPE(int carve_setup, (dr_state *st, dr_carve *c));
+_PROTOTYPE(void carve_cleanup, (dr_state *st, dr_carve *c));
+_PROTOTYPE(int carve_next, (dr_state *st, bit_t *bit, zone_t *zone, zone_t *count));
+_PROTOTYPE(int carve_start, (dr_state *st, dr_carve *c, int i, zone_t zone, zone_t count));
+_PROTOTYPE(char *carve_wait, (dr_state *st, dr_carve *c, int i, zone_t zone, zone_t count));
+_PROTOTYPE(dr_sig *carve_header, (dr_carve *c, unsigned char *p));
+_PROTOTYPE(off_t get_num, (unsigned char *p, int len, int big));
+_PROTOTYPE(off_t header_size, (dr_sig *s, unsigned char *p));
+_PROTOTYPE(long find_footer, (unsigned char *p, long len, unsigned char *foot, int foot_len));
+_PROTOTYPE(void carve_open, (dr_state *st, dr_carve *c, dr_sig *s, char *p, zone_t zone));
+_PROTOTYPE(int carve_flush, (dr_state *st, dr_carve *c, char *end));
+_PROTOTYPE(void carve_close, (dr_state *st, dr_carve *c, char *end));
+_PROTOTYPE(long carve_end, (dr_carve *c, unsigned char *p, long len));
+_PROTOTYPE(int carve_zones, (dr_state *st, dr_carve *c, char *data, zone_t zone, zone_t count));
+_PROTOTYPE(int carve_free, (dr_state *st));
+
+/* dr_lib.c */
+_PROTOTYPE(void dr_msg, (dr_state *st, int level, char *fmt, ...));
+_PROTOTYPE(int lib_entries, (dr_state *st));
+
+/* dr_daemon.c */
+_PROTOTYPE(int daemon_serve, (dr_state *st, char *name));
+_PROTOTYPE(int daemon_warm, (dr_state *st, dr_daemon *d));
+_PROTOTYPE(int daemon_listen, (dr_state *st, dr_daemon *d));
+_PROTOTYPE(void daemon_reap, (dr_daemon *d, int wait));
+_PROTOTYPE(int daemon_check, (dr_state *st, dr_daemon *d));
+_PROTOTYPE(int daemon_catalog, (dr_state *st));
+_PROTOTYPE(void daemon_client, (dr_state *st, int conn));
+_PROTOTYPE(int daemon_recover, (dr_state *st, char *path, int fd, off_t *size));
+_PROTOTYPE(void daemon_log, (void *arg, int level, const char *msg));
+_PROTOTYPE(int daemon_send, (int conn, char *fmt, ...));
+_PROTOTYPE(int daemon_read, (int conn, char *line, size_t size, int *fd));
+_PROTOTYPE(int daemon_connect, (dr_state *st, char *name));
+_PROTOTYPE(int daemon_request, (dr_state *st, char *name, int count, char **paths));
+_PROTOTYPE(int daemon_ask, (dr_state *st, int conn, FILE *replies, char *request, int fd, long long *value));
+
+/* dr_catalog.c */
+_PROTOTYPE(int catalog_build, (dr_state *st, dr_catalog *cat));
+_PROTOTYPE(int catalog_dirs, (dr_state *st, dr_catalog *cat));
+_PROTOTYPE(int catalog_dir, (dr_state *st, dr_catalog *cat, dr_cat_dir *d));
+_PROTOTYPE(int catalog_entry, (dr_state *st, dr_catalog *cat, char *entry, dr_cat_dir *d));
+_PROTOTYPE(int catalog_inodes, (dr_state *st, dr_catalog *cat));
+_PROTOTYPE(long catalog_name, (dr_state *st, dr_catalog *cat, char *dir, char *name));
+_PROTOTYPE(int catalog_grow, (dr_state *st, void **p, int *slots, int need, size_t size));
+_PROTOTYPE(int catalog_sort, (dr_state *st, dr_catalog *cat));
+_PROTOTYPE(int catalog_states, (dr_state *st, dr_catalog *cat));
+_PROTOTYPE(int inode_compare, (const void *a, const void *b));
+_PROTOTYPE(int path_compare, (const void *a, const void *b));
+_PROTOTYPE(int catalog_write, (dr_state *st, dr_catalog *cat, char *name));
+_PROTOTYPE(dr_catalog *catalog_read, (dr_state *st, char *name));
+_PROTOTYPE(void catalog_list, (dr_state *st, dr_catalog *cat));
+_PROTOTYPE(void catalog_free, (dr_catalog *cat));
+_PROTOTYPE(char *catalog_state, (int state));
+_PROTOTYPE(int catalog_check, (dr_state *st));
+_PROTOTYPE(int catalog_find, (dr_state *st, dr_catalog *cat, char *path, dr_cat_ent **found, int max));
+_PROTOTYPE(int catalog_recover, (dr_state *st, dr_cat_ent *e, off_t *size));
+
+/* dr_elevator.c */
+_PROTOTYPE(int elevator_batch, (dr_state *st, int count, char **paths, off_t *sizes, double *secs));
+_PROTOTYPE(int elevator_device, (dr_state *st, dr_elevator *el, char *path, off_t *sizes, double *secs));
+_PROTOTYPE(int elevator_add, (dr_state *st, dr_elevator *el, char *path, int index));
+_PROTOTYPE(int elevator_file, (dr_state *st, dr_elevator *el, char *name, int index));
+_PROTOTYPE(int elevator_inode, (dr_state *st, dr_elevator *el, int file, ino_t inode));
+_PROTOTYPE(int elevator_entry, (dr_state *st, dr_elevator *el, int file, dr_cat_ent *e));
+_PROTOTYPE(int elevator_extents, (dr_state *st, dr_elevator *el, int file, dr_extent *x, int n));
+_PROTOTYPE(void elevator_sweep, (dr_state *st, dr_elevator *el, off_t *sizes, double *secs));
+_PROTOTYPE(int elevator_open, (dr_state *st, dr_elevator *el, dr_elev_file *f, int piece));
+_PROTOTYPE(void elevator_verify, (dr_state *st, dr_elevator *el));
+_PROTOTYPE(void elevator_finish, (dr_state *st, dr_elevator *el, dr_elev_file *f, off_t *sizes, double *secs));
+_PROTOTYPE(int piece_compare, (const void *a, const void *b));
+
+/* dr_layout.c */
+_PROTOTYPE(void v1_inode, (char *p, dr_inode *ip));
+_PROTOTYPE(void v1_ptrs, (char *bp, zone_t *zones, int count));
+_PROTOTYPE(void v2_inode, (char *p, dr_inode *ip));
+_PROTOTYPE(void v2_ptrs, (char *bp, zone_t *zones, int count));
+extern dr_layout v1_layout;
+extern dr_layout v2_layout;
+
+/* dr_devidx.c */
+_PROTOTYPE(int devidx_compare, (const void *a, const void *b));
+_PROTOTYPE(dr_devidx *devidx_create, (dr_state *st));
+_PROTOTYPE(void devidx_destroy, (dr_devidx *idx));
+_PROTOTYPE(char *devidx_lookup, (dr_devidx *idx, dev_t dev));
+
+/* dr_stats.c */
+_PROTOTYPE(void timer_start, (dr_timer *t));
+_PROTOTYPE(double time_since, (struct timeval *start));
+_PROTOTYPE(void timer_stop, (dr_state *st, int phase, dr_timer *t));
+_PROTOTYPE(void stats_latency, (dr_state *st, struct timeval *start));
+_PROTOTYPE(void stats_merge, (dr_stats *to, dr_stats *from));
+_PROTOTYPE(int stats_report, (dr_state *st, char *name, int files, off_t bytes, double secs));
+
+/* dr_throttle.c */
+_PROTOTYPE(dr_throttle *throttle_create, (double bytes, double ios, double latency));
+_PROTOTYPE(int throttle_parse, (dr_state *st, char *str));
+_PROTOTYPE(void throttle_destroy, (dr_throttle *th));
+_PROTOTYPE(void throttle_share, (dr_throttle *th, int n));
+_PROTOTYPE(double throttle_now, (void));
+_PROTOTYPE(off_t throttle_chunk, (dr_state *st, off_t len));
+_PROTOTYPE(void throttle_wait, (dr_state *st, off_t bytes, struct timeval *start));
+_PROTOTYPE(void throttle_fill, (dr_throttle *th, double now));
+_PROTOTYPE(void throttle_done, (dr_state *st, struct timeval *start));
+_PROTOTYPE(void throttle_adapt, (dr_throttle *th, double now));
+
+/* dr_cache.c */
+_PROTOTYPE(dr_cache *cache_create, (int slots, int block_size));
+_PROTOTYPE(void cache_destroy, (dr_cache *c));
+_PROTOTYPE(void cache_clear, (dr_cache *c));
+_PROTOTYPE(int *cache_bucket, (dr_cache *c, zone_t block));
+_PROTOTYPE(char *cache_lookup, (dr_cache *c, zone_t block));
+_PROTOTYPE(char *cache_insert, (dr_cache *c, zone_t block));
+_PROTOTYPE(void cache_forget, (dr_cache *c, zone_t block));
+
+/* dr_async.c */
+_PROTOTYPE(dr_async *async_create, (int depth, size_t chunk));
+_PROTOTYPE(void async_destroy, (dr_async *a));
+_PROTOTYPE(int async_queue, (dr_state *st, off_t addr, off_t len));
+_PROTOTYPE(int async_complete, (dr_state *st));
+_PROTOTYPE(int async_drain, (dr_state *st));
+
+/* dr_out.c */
+_PROTOTYPE(int zero_block, (char *p, size_t len));
+_PROTOTYPE(int out_stream, (dr_state *st, char *name));
+_PROTOTYPE(int out_fd, (dr_state *st, int fd));
+_PROTOTYPE(int out_open, (dr_state *st));
+_PROTOTYPE(void out_prealloc, (dr_state *st, off_t size));
+_PROTOTYPE(int out_put, (dr_state *st, char *data, size_t len));
+_PROTOTYPE(int out_flush, (dr_state *st));
+_PROTOTYPE(int out_hole, (dr_state *st, off_t len));
+_PROTOTYPE(int out_data, (dr_state *st, char *data, size_t len));
+_PROTOTYPE(int out_write, (dr_state *st, char *data, off_t len));
+_PROTOTYPE(int out_close, (dr_state *st));
+_PROTOTYPE(void out_abort, (dr_state *st));
+_PROTOTYPE(void out_free, (dr_state *st));
@@ -0,0 +1,87 @@
+/****************************************************************
+ *                                                              *
+ *  libdrecover.h                                               *
+ *                                                              *
+ *      Interface of the recovery library                       *
+ *--------------------------------------------------------------*
+ *  A handle holds everything about one open device or image;   *
+ *  nothing is kept in static storage and nothing is printed    *
+ *  or exited on, so a program may keep several handles and     *
+ *  recover many files without forking. See README.md.          *
+ *--------------------------------------------------------------*
+ ****************************************************************/
+
+#ifndef LIBDRECOVER_H
+#define LIBDRECOVER_H
+
+/* error codes, all negative */
+#define     DR_OK           0
+#define     DR_EFAIL        -1          /* any other failure, the same as ERROR */
+#define     DR_ENOMEM       -2          /* out of memory */
+#define     DR_EOPEN        -3          /* device or file can not be opened */
+#define     DR_ENOTFS       -4          /* not a file system that can be used */
+#define     DR_EIO          -5          /* a read or write failed */
+#define     DR_ENOENT       -6          /* no such deleted entry */
+#define     DR_EINUSE       -7          /* its i-node or zones are in use again */
+#define     DR_EINVAL       -8          /* bad argument */
+#define     DR_ECATALOG     -9          /* catalog damaged or of another device */
+#define     DR_ECHANGED     -10         /* recovered, but zones were reallocated meanwhile */
+
+/* message levels */
+#define     DR_LOG_INFO     0
+#define     DR_LOG_ERROR    1
+
+/* entry states */
+#define     DR_ENTRY_OK     0           /* i-node and zones free, it can be recovered */
+#define     DR_ENTRY_REUSED 1           /* the i-node is in use again */
+#define     DR_ENTRY_LOST   2           /* its zones are in use or illegal */
+
+typedef struct dr_state dr_handle;
+
+/* called with each message, which has no trailing newline */
+typedef void (*dr_log_fn)(void *arg, int level, const char *msg);
+
+/* a deleted directory entry */
+typedef struct dr_entry {
+    const char *path;               /* full path on the device */
+    unsigned long inode;            /* original i-node */
+    unsigned long parent;           /* i-node of its directory */
+    unsigned long long size;
+    unsigned mode;
+    long mtime;
+    int state;                      /* DR_ENTRY_* */
+} dr_entry;
+
+/* open "device", a block device or an image file, read-only.
+ * messages go to "log", or nowhere if it is NULL. */
+int dr_open(const char *device, dr_log_fn log, void *log_arg, dr_handle **h);
+
+/* take the deleted entries from a catalog file written by
+ * drecover -K instead of reading the directories */
+int dr_use_catalog(dr_handle *h, const char *catalog);
+
+/* the deleted entries, sorted by path; the array belongs to
+ * the handle. the first call reads every directory. */
+int dr_list(dr_handle *h, const dr_entry **entries, int *count);
+
+/* the index in dr_list() of the first entry for "path" */
+int dr_find(dr_handle *h, const char *path, int *index);
+
+/* write the file of entry "index" to "fd" from its current
+ * offset, holes as zeros; its size is put in "size". on
+ * DR_ECHANGED the file was written but some of its zones were
+ * allocated again while it was, so it may hold their new data */
+int dr_recover(dr_handle *h, int index, int fd, long long *size);
+
+/* limit reads from the device to "bytes" bytes and "reads" reads
+ * a second, 0 for no limit, slowing down further while reads take
+ * longer than "latency_ms"; all 0 to read at full speed */
+int dr_set_throttle(dr_handle *h, double bytes, double reads, double latency_ms);
+
+/* close the device and free the handle */
+void dr_close(dr_handle *h);
+
+/* a message for an error code */
+const char *dr_strerror(int err);
+
+#endif /* LIBDRECOVER_H */
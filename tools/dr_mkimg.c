@@ -0,0 +1,591 @@
+//
+//  dr_mkimg.c
+//
+//      Write a MINIX V2 or V3 file system image with deleted files,
+//      for measuring drecover on a host without MINIX.
+//
+//      The image has one directory, the root, holding the files named
+//      on the command line and any number of filler entries. A file
+//      is given as
+//
+//          name:size[:del][:hole][:frag]
+//
+//      size may end in k, m or g. "del" deletes the file the way MINIX
+//      does: its i-node and zones are freed and the i-node number is
+//      kept at the end of its directory entry. "hole" leaves holes in
+//      the file and "frag" leaves gaps between its zones. Large files
+//      go through the single and double indirect blocks.
+//
+//      With -l a zone is 2^log_zone_size blocks.
+//
+//      The contents are generated from the seed, and with -x a copy
+//      of every file is written to a directory to check against.
+//
+//      This program stands on its own and needs no MINIX headers:
+//
+//          cc -o dr_mkimg tools/dr_mkimg.c
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+/* on-disk layout */
+#define SUPER_OFFSET    1024
+#define SUPER_V2        0x2468
+#define SUPER_V3        0x4d5a
+#define INODE_SIZE      64
+#define DIRENT_SIZE     64
+#define NAME_SIZE       60
+#define NR_DZONES       7
+#define NR_TZONES       10
+#define ROOT_INODE      1
+#define MAX_FILES       1024
+
+typedef struct mk_file {
+    char name[NAME_SIZE + 1];
+    off_t size;
+    int del;                        /* delete it */
+    int hole;                       /* leave holes in it */
+    int frag;                       /* leave gaps between its zones */
+    uint32_t inode;
+} mk_file;
+
+typedef struct mk_image {
+    int fd;
+    int version;                    /* 2 or 3 */
+    int block_size;
+    int log_zone_size;
+    int zone_size;                  /* block_size << log_zone_size */
+    uint32_t zones;
+    uint32_t inodes;
+    int imap_blocks;
+    int zmap_blocks;
+    int inode_blocks;
+    uint32_t first_data;
+    uint32_t next_zone;             /* next zone to allocate */
+    int frag_pct;                   /* chance of a gap after a zone of a "frag" file */
+    unsigned char *imap;
+    unsigned char *zmap;
+    unsigned char *itable;
+    uint64_t rng;
+    char *expect_dir;               /* where to write copies, or NULL */
+} mk_image;
+
+/* on-disk numbers are little endian */
+#define PUT16(p, v)     ((p)[0] = (unsigned char)(v), (p)[1] = (unsigned char)((v) >> 8))
+#define PUT32(p, v)     (PUT16(p, v), PUT16((p) + 2, (v) >> 16))
+
+/* usage(command)
+ *
+ */
+void usage(command)
+char *command;
+{
+    fprintf(stderr, "Usage: %s [-v 2|3] [-b block_size] [-l log_zone_size] [-z zones] [-i inodes] [-f frag_pct]\n", command);
+    fprintf(stderr, "       [-n filler_entries] [-s seed] [-x expect_dir] image name:size[:del][:hole][:frag] ...\n");
+    exit(1);
+}
+
+/* next_rand(img)
+ *
+ *      xorshift64, so images are the same on every host
+ */
+uint64_t next_rand(img)
+mk_image *img;
+{
+    img->rng ^= img->rng << 13;
+    img->rng ^= img->rng >> 7;
+    img->rng ^= img->rng << 17;
+    return(img->rng);
+}
+
+/* set_bit(map, bit, value)
+ *
+ */
+void set_bit(map, bit, value)
+unsigned char *map;
+uint32_t bit;
+int value;
+{
+    if(value)
+        map[bit >> 3] |= 1 << (bit & 7);
+    else
+        map[bit >> 3] &= ~(1 << (bit & 7));
+}
+
+/* parse_size(str)
+ *
+ *      a size with an optional k, m or g suffix, -1 if bad
+ */
+off_t parse_size(str)
+char *str;
+{
+    char *end;
+    off_t size = (off_t)strtoll(str, &end, 10);
+
+    switch(*end) {
+        case 'k': case 'K': size <<= 10; ++ end; break;
+        case 'm': case 'M': size <<= 20; ++ end; break;
+        case 'g': case 'G': size <<= 30; ++ end; break;
+    }
+
+    return *end == '\0' && end != str && size >= 0 ? size : -1;
+}
+
+/* parse_file(spec, f)
+ *
+ */
+int parse_file(spec, f)
+char *spec;
+mk_file *f;
+{
+    char buf[256];
+    char *p, *q;
+
+    memset(f, 0, sizeof(mk_file));
+    strncpy(buf, spec, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    if((p = strchr(buf, ':')) == NULL)
+        return(-1);
+    *p ++ = '\0';
+    if(buf[0] == '\0' || strlen(buf) > NAME_SIZE - 4)
+        return(-1);
+    strcpy(f->name, buf);
+
+    if((q = strchr(p, ':')) != NULL)
+        *q ++ = '\0';
+    if((f->size = parse_size(p)) == -1)
+        return(-1);
+
+    for(p = q; p != NULL; p = q) {
+        if((q = strchr(p, ':')) != NULL)
+            *q ++ = '\0';
+        if(strcmp(p, "del") == 0)
+            f->del = 1;
+        else if(strcmp(p, "hole") == 0)
+            f->hole = 1;
+        else if(strcmp(p, "frag") == 0)
+            f->frag = 1;
+        else
+            return(-1);
+    }
+
+    return(0);
+}
+
+/* alloc_zone(img, frag)
+ *
+ *      allocate the next zone, leaving a gap after it now and then
+ *      if "frag" is set. 0 is returned when the image is full.
+ */
+uint32_t alloc_zone(img, frag)
+mk_image *img;
+int frag;
+{
+    uint32_t z = img->next_zone;
+
+    if(z >= img->zones)
+        return(0);
+
+    img->next_zone = z + 1;
+    if(frag && (int)(next_rand(img) % 100) < img->frag_pct)
+        img->next_zone += 1 + (uint32_t)(next_rand(img) % 3);
+
+    set_bit(img->zmap, z - (img->first_data - 1), 1);
+    return(z);
+}
+
+/* write_zone(img, zone, data, len)
+ *
+ *      write "len" bytes at the start of "zone"
+ */
+int write_zone(img, zone, data, len)
+mk_image *img;
+uint32_t zone;
+unsigned char *data;
+int len;
+{
+    if(pwrite(img->fd, data, len, (off_t)zone * img->zone_size) != len) {
+        perror("write");
+        return(-1);
+    }
+    return(0);
+}
+
+/* is_hole(f, n, count)
+ *
+ *      is zone "n" of a file of "count" zones a hole? zones 2
+ *      to 4, every 64th zone and, past 8 zones, the last two
+ *      are.
+ */
+int is_hole(f, n, count)
+mk_file *f;
+off_t n;
+off_t count;
+{
+    return f->hole && ((n >= 2 && n <= 4) || n % 64 == 63 || (count > 8 && n >= count - 2));
+}
+
+/* write_file(img, f, data, zones, owned, nowned)
+ *
+ *      write the file "f" with contents "data", or generated
+ *      contents if "data" is NULL. the ten i-node zone pointers
+ *      are put in "zones" and every zone used, indirect blocks
+ *      included, in "owned".
+ */
+int write_file(img, f, data, zones, owned, nowned)
+mk_image *img;
+mk_file *f;
+unsigned char *data;
+uint32_t *zones;
+uint32_t *owned;
+off_t *nowned;
+{
+    int bs = img->zone_size;
+    int ibs = img->block_size;
+    uint32_t per = ibs / 4;
+    off_t count = (f->size + bs - 1) / bs;
+    unsigned char *block, *ind, *dbl;
+    uint32_t z, ind_zone = 0, dbl_zone = 0;
+    off_t n, k;
+    FILE *expect = NULL;
+    char name[1024];
+    int i, len;
+
+    if(count > NR_DZONES + per + (off_t)per * per) {
+        fprintf(stderr, "%s is too big for a double indirect block\n", f->name);
+        return(-1);
+    }
+
+    block = (unsigned char *)malloc(bs);
+    ind = (unsigned char *)calloc(1, ibs);
+    dbl = (unsigned char *)calloc(1, ibs);
+    if(block == NULL || ind == NULL || dbl == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return(-1);
+    }
+
+    if(data == NULL && img->expect_dir != NULL) {
+        snprintf(name, sizeof(name), "%s/%s", img->expect_dir, f->name);
+        if((expect = fopen(name, "wb")) == NULL) {
+            perror(name);
+            return(-1);
+        }
+    }
+
+    memset(zones, 0, NR_TZONES * sizeof(uint32_t));
+    *nowned = 0;
+
+    for(n = 0; n < count; ++ n) {
+        len = f->size - n * bs < bs ? (int)(f->size - n * bs) : bs;
+
+        if(data != NULL) {
+            memset(block, 0, bs);
+            memcpy(block, data + n * bs, len);
+        }
+        else if(is_hole(f, n, count))
+            memset(block, 0, bs);
+        else {
+            for(i = 0; i < bs; i += 8) {
+                uint64_t r = next_rand(img);
+                memcpy(block + i, &r, 8);
+            }
+            memset(block + len, 0, bs - len);
+        }
+
+        if(expect != NULL && fwrite(block, 1, len, expect) != (size_t)len) {
+            perror(name);
+            return(-1);
+        }
+
+        if(data == NULL && is_hole(f, n, count))
+            z = 0;
+        else {
+            if((z = alloc_zone(img, f->frag)) == 0)
+                goto full;
+            owned[(*nowned) ++] = z;
+            if(write_zone(img, z, block, bs) != 0)
+                return(-1);
+        }
+
+        /* place the zone pointer */
+        if(n < NR_DZONES) {
+            zones[n] = z;
+            continue;
+        }
+
+        k = n - NR_DZONES;
+        if(k < per) {
+            if(k == 0) {
+                if((ind_zone = alloc_zone(img, 0)) == 0)
+                    goto full;
+                owned[(*nowned) ++] = zones[NR_DZONES] = ind_zone;
+            }
+            PUT32(ind + k * 4, z);
+            if(k == per - 1 || n == count - 1) {
+                if(write_zone(img, ind_zone, ind, ibs) != 0)
+                    return(-1);
+                memset(ind, 0, ibs);
+            }
+            continue;
+        }
+
+        k -= per;
+        if(k == 0) {
+            if((dbl_zone = alloc_zone(img, 0)) == 0)
+                goto full;
+            owned[(*nowned) ++] = zones[NR_DZONES + 1] = dbl_zone;
+        }
+        if(k % per == 0) {
+            if((ind_zone = alloc_zone(img, 0)) == 0)
+                goto full;
+            owned[(*nowned) ++] = ind_zone;
+            PUT32(dbl + (k / per) * 4, ind_zone);
+        }
+        PUT32(ind + (k % per) * 4, z);
+        if(k % per == per - 1 || n == count - 1) {
+            if(write_zone(img, ind_zone, ind, ibs) != 0)
+                return(-1);
+            memset(ind, 0, ibs);
+        }
+        if(n == count - 1 && write_zone(img, dbl_zone, dbl, ibs) != 0)
+            return(-1);
+    }
+
+    if(expect != NULL && fclose(expect) == EOF) {
+        perror(name);
+        return(-1);
+    }
+
+    free(block);
+    free(ind);
+    free(dbl);
+    return(0);
+
+full:
+    fprintf(stderr, "Image is full, use more zones (-z)\n");
+    return(-1);
+}
+
+/* put_inode(img, inode, mode, size, zones)
+ *
+ */
+void put_inode(img, inode, mode, size, zones)
+mk_image *img;
+uint32_t inode;
+int mode;
+off_t size;
+uint32_t *zones;
+{
+    unsigned char *p = img->itable + (size_t)(inode - 1) * INODE_SIZE;
+    int i;
+
+    memset(p, 0, INODE_SIZE);
+    PUT16(p, mode);                 /* d2_mode */
+    PUT16(p + 2, 1);                /* d2_nlinks */
+    PUT32(p + 8, (uint32_t)size);   /* d2_size */
+    for(i = 0; i < NR_TZONES; ++ i)
+        PUT32(p + 24 + i * 4, zones[i]);
+
+    set_bit(img->imap, inode, 1);
+}
+
+/* put_entry(dir, inode, name, del)
+ *
+ *      a directory entry, or a deleted one keeping "inode" at the
+ *      end of the name
+ */
+void put_entry(dir, inode, name, del)
+unsigned char *dir;
+uint32_t inode;
+char *name;
+int del;
+{
+    memset(dir, 0, DIRENT_SIZE);
+    strncpy((char *)dir + 4, name, NAME_SIZE);
+    if(del)
+        PUT32(dir + 4 + NAME_SIZE - 4, inode);
+    else
+        PUT32(dir, inode);
+}
+
+/* write_super(img)
+ *
+ */
+int write_super(img)
+mk_image *img;
+{
+    unsigned char sb[64];
+
+    memset(sb, 0, sizeof(sb));
+    PUT32(sb, img->inodes);                 /* s_ninodes */
+    PUT16(sb + 6, img->imap_blocks);        /* s_imap_blocks */
+    PUT16(sb + 8, img->zmap_blocks);        /* s_zmap_blocks */
+    PUT16(sb + 10, img->first_data);        /* s_firstdatazone_old */
+    PUT16(sb + 12, img->log_zone_size);     /* s_log_zone_size */
+    PUT32(sb + 16, 0x7fffffff);             /* s_max_size */
+    PUT32(sb + 20, img->zones);             /* s_zones */
+    PUT16(sb + 24, img->version == 3 ? SUPER_V3 : SUPER_V2);
+    PUT16(sb + 28, img->block_size);        /* s_block_size */
+
+    if(pwrite(img->fd, sb, sizeof(sb), SUPER_OFFSET) != sizeof(sb) ||
+       pwrite(img->fd, img->imap, (size_t)img->imap_blocks * img->block_size,
+              (off_t)2 * img->block_size) != (ssize_t)img->imap_blocks * img->block_size ||
+       pwrite(img->fd, img->zmap, (size_t)img->zmap_blocks * img->block_size,
+              (off_t)(2 + img->imap_blocks) * img->block_size) != (ssize_t)img->zmap_blocks * img->block_size ||
+       pwrite(img->fd, img->itable, (size_t)img->inode_blocks * img->block_size,
+              (off_t)(2 + img->imap_blocks + img->zmap_blocks) * img->block_size) != (ssize_t)img->inode_blocks * img->block_size) {
+        perror("write");
+        return(-1);
+    }
+
+    return(0);
+}
+
+int main(argc, argv)
+int argc;
+char *argv[];
+{
+    static mk_file files[MAX_FILES];
+    static mk_image image;
+    mk_image *img = &image;
+    mk_file dir;
+    unsigned char *dirdata;
+    uint32_t *owned;
+    uint32_t zones[NR_TZONES];
+    off_t nowned, n;
+    long fillers = 0;
+    int nfiles, i, c;
+    char name[NAME_SIZE + 1];
+
+    img->version = 3;
+    img->block_size = 4096;
+    img->zones = 65536;
+    img->inodes = 1024;
+    img->frag_pct = 30;
+    img->rng = 7;
+
+    while((c = getopt(argc, argv, "v:b:l:z:i:f:n:s:x:")) != -1) {
+        switch(c) {
+            case 'v': img->version = atoi(optarg); break;
+            case 'b': img->block_size = atoi(optarg); break;
+            case 'l': img->log_zone_size = atoi(optarg); break;
+            case 'z': img->zones = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'i': img->inodes = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'f': img->frag_pct = atoi(optarg); break;
+            case 'n': fillers = atol(optarg); break;
+            case 's': img->rng = strtoull(optarg, NULL, 0) | 1; break;
+            case 'x': img->expect_dir = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if(optind >= argc || (img->version != 2 && img->version != 3))
+        usage(argv[0]);
+    if(img->version == 2)
+        img->block_size = 1024;
+    if(img->block_size < 1024 || img->block_size > 32768 || (img->block_size & (img->block_size - 1))) {
+        fprintf(stderr, "Block size must be a power of 2 from 1024 to 32768\n");
+        return(1);
+    }
+    if(img->log_zone_size < 0 || img->log_zone_size > 8) {
+        fprintf(stderr, "Log zone size must be from 0 to 8\n");
+        return(1);
+    }
+    img->zone_size = img->block_size << img->log_zone_size;
+
+    nfiles = argc - optind - 1;
+    if(nfiles > MAX_FILES || nfiles + 1 >= (int)img->inodes) {
+        fprintf(stderr, "Too many files\n");
+        return(1);
+    }
+    for(i = 0; i < nfiles; ++ i) {
+        if(parse_file(argv[optind + 1 + i], &files[i]) != 0) {
+            fprintf(stderr, "Bad file %s, use name:size[:del][:hole][:frag]\n", argv[optind + 1 + i]);
+            return(1);
+        }
+        files[i].inode = ROOT_INODE + 1 + i;
+    }
+
+    /* layout: boot block, super block, maps, i-nodes, data */
+    img->imap_blocks = (int)((img->inodes + 1 + img->block_size * 8 - 1) / (img->block_size * 8));
+    img->inode_blocks = (int)(((off_t)img->inodes * INODE_SIZE + img->block_size - 1) / img->block_size);
+    img->zmap_blocks = (int)(((off_t)img->zones + img->block_size * 8 - 1) / (img->block_size * 8));
+    img->first_data = (2 + img->imap_blocks + img->zmap_blocks + img->inode_blocks +
+                       (1 << img->log_zone_size) - 1) >> img->log_zone_size;
+    img->next_zone = img->first_data;
+    if(img->first_data >= img->zones || img->first_data > 0xffff) {
+        fprintf(stderr, "Too few zones for the maps and i-nodes\n");
+        return(1);
+    }
+
+    img->imap = (unsigned char *)calloc(img->imap_blocks, img->block_size);
+    img->zmap = (unsigned char *)calloc(img->zmap_blocks, img->block_size);
+    img->itable = (unsigned char *)calloc(img->inode_blocks, img->block_size);
+    owned = (uint32_t *)malloc((size_t)img->zones * sizeof(uint32_t));
+    dirdata = (unsigned char *)calloc(nfiles + fillers + 2, DIRENT_SIZE);
+    if(img->imap == NULL || img->zmap == NULL || img->itable == NULL || owned == NULL || dirdata == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return(1);
+    }
+
+    /* bit 0 of each map is never used; bits past the end are set */
+    set_bit(img->imap, 0, 1);
+    set_bit(img->zmap, 0, 1);
+    for(n = img->inodes + 1; n < (off_t)img->imap_blocks * img->block_size * 8; ++ n)
+        set_bit(img->imap, (uint32_t)n, 1);
+    for(n = img->zones - img->first_data + 1; n < (off_t)img->zmap_blocks * img->block_size * 8; ++ n)
+        set_bit(img->zmap, (uint32_t)n, 1);
+
+    if((img->fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+        perror(argv[optind]);
+        return(1);
+    }
+    if(ftruncate(img->fd, (off_t)img->zones * img->zone_size) == -1) {
+        perror(argv[optind]);
+        return(1);
+    }
+
+    put_entry(dirdata, ROOT_INODE, ".", 0);
+    put_entry(dirdata + DIRENT_SIZE, ROOT_INODE, "..", 0);
+
+    for(i = 0; i < nfiles; ++ i) {
+        if(write_file(img, &files[i], (unsigned char *)NULL, zones, owned, &nowned) != 0)
+            return(1);
+        put_inode(img, files[i].inode, 0100644, files[i].size, zones);
+        put_entry(dirdata + (i + 2) * DIRENT_SIZE, files[i].inode, files[i].name, files[i].del);
+
+        if(files[i].del) {
+            set_bit(img->imap, files[i].inode, 0);
+            for(n = 0; n < nowned; ++ n)
+                set_bit(img->zmap, owned[n] - (img->first_data - 1), 0);
+        }
+    }
+
+    /* filler entries, two of three of them deleted, make a large directory */
+    for(n = 0; n < fillers; ++ n) {
+        snprintf(name, sizeof(name), "filler%ld", (long)n);
+        put_entry(dirdata + (nfiles + 2 + n) * DIRENT_SIZE, ROOT_INODE, name, n % 3 != 0);
+    }
+
+    memset(&dir, 0, sizeof(dir));
+    strcpy(dir.name, ".");
+    dir.size = (nfiles + fillers + 2) * DIRENT_SIZE;
+    if(write_file(img, &dir, dirdata, zones, owned, &nowned) != 0)
+        return(1);
+    put_inode(img, ROOT_INODE, 040755, dir.size, zones);
+
+    if(write_super(img) != 0 || close(img->fd) == -1)
+        return(1);
+
+    printf("%s: V%d, %d byte blocks, %d byte zones, %lu zones, %lu i-nodes, %lu zones used\n", argv[optind],
+           img->version, img->block_size, img->zone_size, (unsigned long)img->zones, (unsigned long)img->inodes,
+           (unsigned long)(img->next_zone - img->first_data));
+    return(0);
+}